@@ -0,0 +1,53 @@
+#!/bin/sh
+# Exports a .GRA through the installed plug-in to a named pipe and checks it
+# comes out byte for byte the same as the export to a regular file, with and
+# without a memory ceiling. Needs gimp-console (GIMP 2.10), the plug-in
+# installed (make install) and gra-convert built (make gra-convert).
+#
+#   sh check-pipe.sh
+
+set -e
+
+GIMP=${GIMP:-gimp-console-2.10}
+command -v "$GIMP" >/dev/null 2>&1 || GIMP=gimp-console
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# A 320x200 test card: bands of the 16 colours with a diagonal through them
+LC_ALL=C awk 'BEGIN {
+    printf "P6\n320 200\n255\n";
+    for (y = 0; y < 200; y++)
+        for (x = 0; x < 320; x++) {
+            c = (x == y) ? 15 : int(x / 20);
+            printf "%c%c%c", (c % 2) * 170 + (c > 7) * 85, (int(c / 2) % 2) * 170 + (c > 7) * 85, (int(c / 4) % 2) * 170 + (c > 7) * 85;
+        }
+}' > "$dir/card.ppm"
+./gra-convert --to-gra "$dir/card.ppm" "$dir/card.GRA"
+
+status=0
+for ceiling in "" 64; do
+    rm -f "$dir/file.GRA" "$dir/pipe" "$dir/pipe.GRA"
+    mkfifo "$dir/pipe"
+    cat "$dir/pipe" > "$dir/pipe.GRA" &
+    reader=$!
+
+    GRA_MAX_MEMORY=$ceiling "$GIMP" -i -d -f -b "
+        (let* ((image (car (file-gra-load RUN-NONINTERACTIVE \"$dir/card.GRA\" \"card.GRA\")))
+               (drawable (car (gimp-image-get-active-drawable image))))
+          (file-gra-save RUN-NONINTERACTIVE image drawable \"$dir/file.GRA\" \"file.GRA\" 0 0 0 0 0)
+          (file-gra-save RUN-NONINTERACTIVE image drawable \"$dir/pipe\" \"pipe\" 0 0 0 0 0))" \
+        -b "(gimp-quit 0)" >/dev/null 2>"$dir/gimp.log" || true
+    # If the export never opened the pipe, cat is still waiting for it
+    sleep 1
+    kill $reader 2>/dev/null || true
+    wait $reader 2>/dev/null || true
+
+    if [ -s "$dir/file.GRA" ] && cmp -s "$dir/file.GRA" "$dir/pipe.GRA"; then
+        echo "pipe export${ceiling:+ under GRA_MAX_MEMORY=$ceiling}: ok"
+    else
+        echo "pipe export${ceiling:+ under GRA_MAX_MEMORY=$ceiling}: FAILED"
+        cat "$dir/gimp.log"
+        status=1
+    fi
+done
+exit $status
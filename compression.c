@@ -23,7 +23,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "compression.h"
+#include "gra-trace.h"
 
 #pragma pack(1)
 
@@ -33,6 +38,7 @@
 typedef unsigned char BYTE;
 typedef unsigned short WORD;
 typedef unsigned int DWORD; typedef unsigned char BOOL;
+typedef unsigned long QWORD;
 
 #define ARC_MAX_BITS 12
 
@@ -42,16 +48,25 @@ typedef unsigned int DWORD; typedef unsigned char BOOL;
 
 #define MAX_INT     0xFFFFFFFFl
 
+#ifdef GRA_CODEC_STATS
+#define ARC_STAT(c, stmt)   do { if ((c)->stats) { stmt; } } while (0)
+#else
+#define ARC_STAT(c, stmt)   do { } while (0)
+#endif
+
 typedef struct _CArcEntry
 { 
     struct _CArcEntry *next;
     WORD basecode;
-    BYTE ch,pad;
+    BYTE ch,
+         valid; // decoder: a code may name this entry now
 } CArcEntry;
 
 typedef struct _CArcCtrl //control structure
 { 
-    DWORD src_pos,src_size,
+    // Bits of stream or bytes of data. A DWORD of bits would only cover
+    // 512MB of stream.
+    QWORD src_pos,src_size,
           dst_pos,dst_size;
     BYTE *src_buf,*dst_buf;
     DWORD min_bits,min_table_entry;
@@ -61,9 +76,17 @@ typedef struct _CArcCtrl //control structure
     DWORD free_index,free_limit,
           saved_basecode,
           entry_used,
-          last_ch;
+          last_ch,
+          corrupt; // decoder: rejected a code no encoder could have sent
     CArcEntry compress[1<<ARC_MAX_BITS],
               *hash[1<<ARC_MAX_BITS];
+    // encoder: ARC_RUNG(c,ch,i) is the code for i+1 ch's, for the
+    // run_len[ch] lengths the table has (see ArcRunAdd)
+    WORD *run_rung;
+    DWORD run_len[256];
+#ifdef GRA_CODEC_STATS
+    ArcCodecStats *stats;
+#endif
 } CArcCtrl;
 
 typedef struct _CArcCompress
@@ -74,29 +97,88 @@ typedef struct _CArcCompress
     BYTE body[1]; 
 } CArcCompress;
 
+// Reads a 64-bit size split into two DWORDs, as TempleOS' I64 is laid out
+#define ARC_SIZE64(lo,hi)   ((long)((unsigned long)(hi)<<32|(lo)))
+
 // Function prototypes
-int Bt(int bit_num, BYTE *bit_field);
-int Bts(int bit_num, BYTE *bit_field);
-DWORD BFieldExtU32(BYTE *src,DWORD pos,DWORD bits);
+int Bt(long bit_num, BYTE *bit_field);
+int Bts(long bit_num, BYTE *bit_field);
+DWORD BFieldExtU32(BYTE *src,QWORD pos,DWORD bits);
 void ArcEntryGet(CArcCtrl *c);
 void ArcExpandBuf(CArcCtrl *c);
 CArcCtrl *ArcCtrlNew(DWORD expand,DWORD compression_type);
 void ArcCtrlDel(CArcCtrl *c);
 BYTE *ExpandBuf(CArcCompress *arc);
-long FSize(FILE *f);
 long ArcDetermineCompressionType(BYTE *src, long size);
 void BFieldOrU32(BYTE * bit_field, long bit_num, DWORD pattern);
 void ArcCompressBuf(CArcCtrl *c);
 
+#ifdef GRA_CODEC_STATS
+static CompressionStats arc_stats={{{0},0,-1,0},{{0},0,-1,0},{0}};
+// Buffers can be coded on several threads at once, e.g. by gra-convert --watch
+static pthread_mutex_t arc_stats_lock=PTHREAD_MUTEX_INITIALIZER;
+
+// Starts collecting counters for one buffer into a zeroed local struct
+static void ArcStatsAttach(CArcCtrl *c, ArcCodecStats *s)
+{
+    memset(s,0,sizeof(ArcCodecStats));
+    s->table_full_at=-1;
+    c->stats=s;
+}
+
+// Adds one buffer's counters to the running totals
+static void ArcStatsMerge(ArcCodecStats *total, ArcCodecStats *s)
+{
+    int i;
+    pthread_mutex_lock(&arc_stats_lock);
+    for (i=0;i<ARC_STATS_WIDTHS;i++)
+        total->codes[i]+=s->codes[i];
+    if (total->table_full_at<0 && s->table_full_at>=0)
+        total->table_full_at=total->bytes+s->table_full_at;
+    total->bytes+=s->bytes;
+    total->recycled+=s->recycled;
+    pthread_mutex_unlock(&arc_stats_lock);
+}
+
+// Once the table has filled, sets table_full_at (if not set yet) to the
+// start of the code whose string is the last len bytes counted. The encoder
+// fills the table just before the code it then writes, and the decoder,
+// which adds each entry a code later, just after reading that same code, so
+// each calls this at that point and both record the same byte.
+static inline void ArcStatsFull(ArcCodecStats *s,long len)
+{
+    if (s->recycled && s->table_full_at<0)
+        s->table_full_at=s->bytes-len;
+}
+
+// Records the length of every hash[] chain left by the encoder
+static void ArcStatsChains(CArcCtrl *c)
+{
+    long i,len;
+    unsigned long chain_lengths[ARC_STATS_CHAINS]={0};
+    CArcEntry *temp;
+    for (i=0;i<1<<ARC_MAX_BITS;i++) {
+        len=0;
+        for (temp=c->hash[i];temp;temp=temp->next)
+            len++;
+        chain_lengths[len<ARC_STATS_CHAINS ? len:ARC_STATS_CHAINS-1]++;
+    }
+    pthread_mutex_lock(&arc_stats_lock);
+    for (i=0;i<ARC_STATS_CHAINS;i++)
+        arc_stats.chain_lengths[i]+=chain_lengths[i];
+    pthread_mutex_unlock(&arc_stats_lock);
+}
+#endif
+
 // Returns the bit within bit_field at bit_num (assuming it's stored as little-endian). Whole bunch of finicky stuff because of bytes
-int Bt(int bit_num, BYTE *bit_field)
+int Bt(long bit_num, BYTE *bit_field)
 {
     bit_field+=bit_num>>3; // bit_field now points to the appropriate byte in src byte-array
     bit_num&=7; // Get the last 3 bits of bit_num ( 7 is 111 in binary). Basically bit_num % 8. Signifies which bit in the byte now specified by bit_num we are looking at.
     return (*bit_field & (1<<bit_num)) ? 1:0;
 }
 
-int Bts(int bit_num, BYTE *bit_field)
+int Bts(long bit_num, BYTE *bit_field)
 {
     int result;
     bit_field+=bit_num>>3; //Get the relevant byte (now in the dest bitfield)
@@ -108,7 +190,7 @@ int Bts(int bit_num, BYTE *bit_field)
     return (result) ? 1:0;
 }
 
-DWORD BFieldExtU32(BYTE *src,DWORD pos,DWORD bits)
+DWORD BFieldExtU32(BYTE *src,QWORD pos,DWORD bits)
 {
     DWORD i,result=0;
     for (i=0;i<bits;i++)
@@ -117,6 +199,71 @@ DWORD BFieldExtU32(BYTE *src,DWORD pos,DWORD bits)
     return result;
 }
 
+/* Runs
+ *
+ * The strings of one repeated byte in the table form a ladder: ch, ch ch,
+ * ch ch ch and so on up to the longest one, each the previous one plus ch.
+ * Every rung but the top has the next one as a child, so only the top can be
+ * recycled. Knowing the ladder, the encoder can match a run of ch in one
+ * step where the greedy walk would have followed it a rung at a time, and
+ * it ends up on the same rung, so the output is the same.
+ */
+
+// Rungs are stored by height first, so the bottom rungs of all the ladders,
+// which are all most images use, share a few cache lines and pages
+#define ARC_RUNG(c,ch,i)    (c)->run_rung[((i)<<8)+(ch)]
+
+// An entry was added: the top of ch's ladder with another ch is a new top
+static inline void ArcRunAdd(CArcCtrl *c,DWORD basecode,DWORD ch,CArcEntry *e)
+{
+    if (ARC_RUNG(c,ch,c->run_len[ch]-1)==basecode)
+        ARC_RUNG(c,ch,c->run_len[ch]++)=e-c->compress;
+}
+
+// An entry is being recycled: it may have been the top of its ladder
+static inline void ArcRunRecycle(CArcCtrl *c,CArcEntry *e)
+{
+    if (c->run_rung && c->run_len[e->ch]>1 &&
+            ARC_RUNG(c,e->ch,c->run_len[e->ch]-1)==e-c->compress)
+        c->run_len[e->ch]--;
+}
+
+// Builds the ladders again from the table
+static void ArcRunRebuild(CArcCtrl *c)
+{
+    DWORD ch,n;
+    CArcEntry *temp;
+    for (ch=0;ch<c->min_table_entry;ch++) {
+        ARC_RUNG(c,ch,0)=ch;
+        n=1;
+        for (temp=c->hash[ch];temp;)
+            if (temp->ch==ch) {
+                ARC_RUNG(c,ch,n++)=temp-c->compress;
+                temp=c->hash[temp-c->compress];
+            } else
+                temp=temp->next;
+        c->run_len[ch]=n;
+    }
+}
+
+// How many of the first max bytes at src are ch, compared 16 at a time
+static inline long ArcRunLength(const BYTE *src,long max,DWORD ch)
+{
+    long n=0;
+#ifdef __SSE2__
+    __m128i want=_mm_set1_epi8((char)ch);
+    DWORD mask;
+    for (;n+16<=max;n+=16) {
+        mask=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(src+n)),want));
+        if (mask!=0xFFFF)
+            return n+__builtin_ctz(~mask);
+    }
+#endif
+    while (n<max && src[n]==ch)
+        n++;
+    return n;
+}
+
 void ArcEntryGet(CArcCtrl *c)
 {
     DWORD i;
@@ -127,6 +274,8 @@ void ArcEntryGet(CArcCtrl *c)
 
         c->entry_used=FALSE;
         c->cur_entry=c->next_entry;
+        if (c->cur_entry)
+            c->cur_entry->valid=TRUE;
         c->cur_bits_in_use=c->next_bits_in_use;
         if (c->next_bits_in_use<ARC_MAX_BITS) {
             c->next_entry = &c->compress[i++];
@@ -137,7 +286,10 @@ void ArcEntryGet(CArcCtrl *c)
         } else {
             do if (++i==c->free_limit) i=c->min_table_entry;
             while (c->hash[i]);
+            ARC_STAT(c, c->stats->recycled++);
             temp=&c->compress[i];
+            ArcRunRecycle(c,temp);
+            temp->valid=FALSE;
             c->next_entry=temp;
             temp1=(CArcEntry *)&c->hash[temp->basecode];
             while (temp1 && temp1->next!=temp)
@@ -149,11 +301,217 @@ void ArcEntryGet(CArcCtrl *c)
     }
 }
 
+/* Specialised inner loops
+ *
+ * Between two changes of code width (and once the table is full) nothing in
+ * ArcEntryGet depends on anything but the free index, so ArcCompressBuf and
+ * ArcExpandBuf hand each such phase to one of the loops below, generated for
+ * every (min_bits, code width) pair with both as constants. They work out up
+ * front how many codes the phase can take before the table grows or a
+ * buffer limit is hit, and leave the steps that change the width to the
+ * general loop. Output is identical to the general loop.
+ */
+
+#define ARC_INLINE static inline __attribute__((always_inline))
+
+typedef BYTE *(*ArcCompressPhaseFn)(CArcCtrl *c,BYTE *src_ptr,BYTE *src_limit,long *basecode);
+typedef BYTE *(*ArcExpandPhaseFn)(CArcCtrl *c,BYTE *dst_ptr,BYTE *dst_limit,DWORD *lastcode);
+
+// ArcEntryGet(c) for a step that doesn't change the code width
+ARC_INLINE void ArcPhaseEntryGet(CArcCtrl *c,const DWORD min_bits,const DWORD bits)
+{
+    DWORD i;
+    CArcEntry *temp,*temp1;
+
+    c->entry_used=FALSE;
+    c->cur_entry=c->next_entry;
+    c->cur_entry->valid=TRUE;
+    c->cur_bits_in_use=bits;
+    if (bits<ARC_MAX_BITS)
+        c->next_entry=&c->compress[c->free_index++];
+    else {
+        i=c->free_index;
+        do if (++i==1<<ARC_MAX_BITS) i=1<<min_bits;
+        while (c->hash[i]);
+        ARC_STAT(c, c->stats->recycled++);
+        temp=&c->compress[i];
+        ArcRunRecycle(c,temp);
+        temp->valid=FALSE;
+        c->next_entry=temp;
+        temp1=(CArcEntry *)&c->hash[temp->basecode];
+        while (temp1 && temp1->next!=temp)
+            temp1=temp1->next;
+        if (temp1)
+            temp1->next=temp->next;
+        c->free_index=i;
+    }
+}
+
+// Steps left before ArcEntryGet widens the codes
+ARC_INLINE DWORD ArcPhaseSteps(CArcCtrl *c,const DWORD bits)
+{
+    return bits<ARC_MAX_BITS ? c->free_limit-c->free_index-1:MAX_INT;
+}
+
+// ArcCompressBuf's loop for codes of a fixed width. Returns with
+// entry_used FALSE if the source ran out in the middle of a match.
+ARC_INLINE BYTE *ArcCompressPhase(CArcCtrl *c,BYTE *src_ptr,BYTE *src_limit,
+        long *p_basecode,const DWORD min_bits,const DWORD bits)
+{
+    CArcEntry *temp,*temp1;
+    long ch,basecode=*p_basecode,run;
+    DWORD n;
+    QWORD room;
+
+    n=ArcPhaseSteps(c,bits);
+    room=c->dst_pos<c->dst_size ? (c->dst_size-c->dst_pos)/bits:0;
+    if (n>room)
+        n=room;
+    for (;n && src_ptr<src_limit;n--) {
+        ArcPhaseEntryGet(c,min_bits,bits);
+        // A run of the byte just matched climbs its ladder in one go
+        if (*src_ptr==basecode && c->run_len[basecode]>1) {
+            run=c->run_len[basecode]-1;
+            if (run>src_limit-src_ptr)
+                run=src_limit-src_ptr;
+            run=ArcRunLength(src_ptr,run,basecode);
+            if (run) {
+                src_ptr+=run;
+                basecode=ARC_RUNG(c,basecode,run);
+            }
+        }
+ap_start:
+        if (src_ptr>=src_limit) break;
+        ch=*src_ptr++;
+        for (temp=c->hash[basecode];temp;temp=temp->next)
+            if (temp->ch==ch) {
+                basecode=temp-&c->compress[0];
+                goto ap_start;
+            }
+
+        BFieldOrU32(c->dst_buf,c->dst_pos,basecode);
+        ARC_STAT(c, c->stats->codes[bits]++; ArcStatsFull(c->stats,0); c->stats->bytes=src_ptr-1-c->src_buf);
+        c->dst_pos+=bits;
+
+        c->entry_used=TRUE;
+        temp=c->cur_entry;
+        temp->basecode=basecode;
+        temp->ch=ch;
+        temp1=(CArcEntry *)&c->hash[basecode];
+        temp->next=temp1->next;
+        temp1->next=temp;
+        ArcRunAdd(c,basecode,ch,temp);
+
+        basecode=ch;
+    }
+    *p_basecode=basecode;
+    return src_ptr;
+}
+
+// ArcExpandBuf's loop for codes of a fixed width. Codes are read a DWORD at
+// a time, so it stops 32 bits before the end of the source. The source and
+// destination limits are worked out once for the phase; each code only
+// costs a test that it names a string, which also bounds the stack (see
+// ArcExpandBuf).
+ARC_INLINE BYTE *ArcExpandPhase(CArcCtrl *c,BYTE *dst_ptr,BYTE *dst_limit,
+        DWORD *p_lastcode,const DWORD min_bits,const DWORD bits)
+{
+    DWORD basecode,lastcode=*p_lastcode,code,n,word;
+    QWORD room,src_pos=c->src_pos;
+    BYTE *src_buf=c->src_buf,*stk_ptr=c->stk_ptr,*stk_base=c->stk_base;
+    CArcEntry *temp,*temp1;
+
+    // Kept in locals, as every byte stored through stk_ptr or dst_ptr could
+    // otherwise alias c and force them to be reloaded
+    n=ArcPhaseSteps(c,bits);
+    room=src_pos+32<=c->src_size ? (c->src_size-32-src_pos)/bits+1:0;
+    if (n>room)
+        n=room;
+    for (;n && dst_ptr<dst_limit;n--) {
+        memcpy(&word,src_buf+(src_pos>>3),sizeof(DWORD));
+        basecode=(word>>(src_pos&7))&((1<<bits)-1);
+        if (!c->compress[basecode].valid)
+            goto ap_corrupt;
+        ARC_STAT(c, c->stats->codes[bits]++);
+        src_pos+=bits;
+        if (c->cur_entry==&c->compress[basecode]) {
+            *stk_ptr++=c->last_ch;
+            code=lastcode;
+        } else
+            code=basecode;
+        while (code>=1<<min_bits) {
+            *stk_ptr++=c->compress[code].ch;
+            code=c->compress[code].basecode;
+        }
+        *stk_ptr++=code;
+        c->last_ch=code;
+        ARC_STAT(c, c->stats->bytes+=stk_ptr-stk_base);
+
+        temp=c->cur_entry;
+        temp->basecode=lastcode;
+        temp->ch=c->last_ch;
+        temp1=(CArcEntry *)&c->hash[lastcode];
+        temp->next=temp1->next;
+        temp1->next=temp;
+
+        ArcPhaseEntryGet(c,min_bits,bits);
+        ARC_STAT(c, ArcStatsFull(c->stats,stk_ptr-stk_base));
+        if (bits==ARC_MAX_BITS && c->next_entry==&c->compress[basecode])
+            goto ap_corrupt;
+        while (dst_ptr<dst_limit && stk_ptr!=stk_base)
+            *dst_ptr++ = * -- stk_ptr;
+        lastcode=basecode;
+    }
+    c->src_pos=src_pos;
+    c->stk_ptr=stk_ptr;
+    *p_lastcode=lastcode;
+    return dst_ptr;
+ap_corrupt:
+    c->corrupt=TRUE;
+    c->src_pos=c->src_size;
+    c->stk_ptr=stk_ptr;
+    *p_lastcode=lastcode;
+    return dst_ptr;
+}
+
+#define ARC_PHASES(min_bits,bits) \
+static BYTE *ArcCompressPhase##min_bits##_##bits(CArcCtrl *c,BYTE *src_ptr,BYTE *src_limit,long *basecode) \
+{ return ArcCompressPhase(c,src_ptr,src_limit,basecode,min_bits,bits); } \
+static BYTE *ArcExpandPhase##min_bits##_##bits(CArcCtrl *c,BYTE *dst_ptr,BYTE *dst_limit,DWORD *lastcode) \
+{ return ArcExpandPhase(c,dst_ptr,dst_limit,lastcode,min_bits,bits); }
+
+ARC_PHASES(7,8)  ARC_PHASES(7,9)  ARC_PHASES(7,10) ARC_PHASES(7,11) ARC_PHASES(7,12)
+ARC_PHASES(8,9)  ARC_PHASES(8,10) ARC_PHASES(8,11) ARC_PHASES(8,12)
+
+// Indexed by [min_bits-7][code width]
+static const ArcCompressPhaseFn arc_compress_phases[2][ARC_MAX_BITS+1]={
+    {NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,
+        ArcCompressPhase7_8,ArcCompressPhase7_9,ArcCompressPhase7_10,ArcCompressPhase7_11,ArcCompressPhase7_12},
+    {NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,
+        ArcCompressPhase8_9,ArcCompressPhase8_10,ArcCompressPhase8_11,ArcCompressPhase8_12}
+};
+static const ArcExpandPhaseFn arc_expand_phases[2][ARC_MAX_BITS+1]={
+    {NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,
+        ArcExpandPhase7_8,ArcExpandPhase7_9,ArcExpandPhase7_10,ArcExpandPhase7_11,ArcExpandPhase7_12},
+    {NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,
+        ArcExpandPhase8_9,ArcExpandPhase8_10,ArcExpandPhase8_11,ArcExpandPhase8_12}
+};
+
+/* A code is only accepted if it names a string: a literal, an entry the
+ * encoder has defined and not since recycled, or the entry being defined
+ * (the KwKwK case). Any other code sets c->corrupt and ends the stream, so a
+ * stale or never written entry is never followed. The encoder also never
+ * sends the entry ArcEntryGet picks for recycling in the same step, and
+ * with both rules every chain ends at a literal within the table's size,
+ * so the stack, which is as big as the table, can't overflow. Limits on the
+ * source and destination are checked once per call or phase.
+ */
 void ArcExpandBuf(CArcCtrl *c)
 {
     BYTE *dst_ptr,*dst_limit;
     DWORD basecode,lastcode,code;
     CArcEntry *temp,*temp1;
+    ArcExpandPhaseFn phase;
 
     dst_ptr=c->dst_buf+c->dst_pos;
     dst_limit=c->dst_buf+c->dst_size;
@@ -163,17 +521,35 @@ void ArcExpandBuf(CArcCtrl *c)
 
     if (c->stk_ptr==c->stk_base && dst_ptr<dst_limit) {
         if (c->saved_basecode==0xFFFFFFFFl) {
+            if (c->src_pos+c->next_bits_in_use>c->src_size)
+                goto eb_done;
             lastcode=BFieldExtU32(c->src_buf,c->src_pos,
                     c->next_bits_in_use);
+            if (lastcode>=c->min_table_entry) {
+                c->corrupt=TRUE;
+                goto eb_done;
+            }
             c->src_pos=c->src_pos+c->next_bits_in_use;
+            ARC_STAT(c, c->stats->codes[c->next_bits_in_use]++; c->stats->bytes++);
             *dst_ptr++=lastcode;
             ArcEntryGet(c);
             c->last_ch=lastcode;
         } else
             lastcode=c->saved_basecode;
         while (dst_ptr<dst_limit && c->src_pos+c->next_bits_in_use<=c->src_size) {
+            phase=arc_expand_phases[c->min_bits-7][c->next_bits_in_use];
+            if (phase) {
+                dst_ptr=phase(c,dst_ptr,dst_limit,&lastcode);
+                if (!(dst_ptr<dst_limit && c->src_pos+c->next_bits_in_use<=c->src_size))
+                    break;
+            }
             basecode=BFieldExtU32(c->src_buf,c->src_pos,
                     c->next_bits_in_use);
+            if (!c->compress[basecode].valid) {
+                c->corrupt=TRUE;
+                break;
+            }
+            ARC_STAT(c, c->stats->codes[c->next_bits_in_use]++);
             c->src_pos=c->src_pos+c->next_bits_in_use;
             if (c->cur_entry==&c->compress[basecode]) {
                 *c->stk_ptr++=c->last_ch;
@@ -186,6 +562,7 @@ void ArcExpandBuf(CArcCtrl *c)
             }
             *c->stk_ptr++=code;
             c->last_ch=code;
+            ARC_STAT(c, c->stats->bytes+=c->stk_ptr-c->stk_base);
 
             c->entry_used=TRUE;
             temp=c->cur_entry;
@@ -196,29 +573,47 @@ void ArcExpandBuf(CArcCtrl *c)
             temp1->next=temp;
 
             ArcEntryGet(c);
+            ARC_STAT(c, ArcStatsFull(c->stats,c->stk_ptr-c->stk_base));
+            if (c->next_entry==&c->compress[basecode]) {
+                c->corrupt=TRUE;
+                break;
+            }
             while (dst_ptr<dst_limit && c->stk_ptr!=c->stk_base)
                 *dst_ptr++ = * -- c->stk_ptr;
             lastcode=basecode;
         }
+        if (c->corrupt)
+            c->src_pos=c->src_size;
         c->saved_basecode=lastcode;
     }
+eb_done:
     c->dst_pos=dst_ptr-c->dst_buf;
 }
 
 CArcCtrl *ArcCtrlNew(DWORD expand,DWORD compression_type)
 {
     CArcCtrl *c;
+    DWORD i;
     c=(CArcCtrl *)malloc(sizeof(CArcCtrl));
     memset(c,0,sizeof(CArcCtrl)); // Couldn't you just do calloc here?
-    if (expand) {
-        c->stk_base=(BYTE *)malloc(1<<ARC_MAX_BITS);
-        c->stk_ptr=c->stk_base;
-    }
     if (compression_type==CT_7_BIT)
         c->min_bits=7;
     else
         c->min_bits=8;
     c->min_table_entry=1<<c->min_bits;
+    if (expand) {
+        c->stk_base=(BYTE *)malloc(1<<ARC_MAX_BITS);
+        c->stk_ptr=c->stk_base;
+    } else {
+        // ARC_RUNG indexes by ch as for 8-bit codes whatever this one uses
+        c->run_rung=(WORD *)malloc((sizeof(WORD)*256)<<ARC_MAX_BITS);
+        for (i=0;i<c->min_table_entry;i++) {
+            ARC_RUNG(c,i,0)=i;
+            c->run_len[i]=1;
+        }
+    }
+    for (i=0;i<c->min_table_entry;i++)
+        c->compress[i].valid=TRUE;
     c->free_index=c->min_table_entry;
     c->next_bits_in_use=c->min_bits+1;
     c->free_limit=1<<c->next_bits_in_use;
@@ -232,69 +627,512 @@ CArcCtrl *ArcCtrlNew(DWORD expand,DWORD compression_type)
 void ArcCtrlDel(CArcCtrl *c)
 {
     free(c->stk_base);
+    free(c->run_rung);
     free(c);
 }
 
+#define ARC_ENTRY_INDEX(c,e)    ((e) ? (WORD)((e)-(c)->compress):0)
+#define ARC_INDEX_ENTRY(c,i)    ((i) ? &(c)->compress[i]:NULL)
+
+// Snapshots c, with dst_pos (bits of stream when encoding, bytes expanded
+// when decoding) given by the caller as c only knows it within a piece.
+static void ArcCheckpointSave(CArcCtrl *c,ArcCheckpoint *ck,long dst_bits)
+{
+    DWORD i;
+    ck->src_pos=c->src_pos;
+    ck->dst_pos=dst_bits;
+    ck->saved_basecode=c->saved_basecode;
+    ck->free_index=c->free_index;
+    ck->free_limit=c->free_limit;
+    ck->cur_bits_in_use=c->cur_bits_in_use;
+    ck->next_bits_in_use=c->next_bits_in_use;
+    ck->entry_used=c->entry_used;
+    ck->cur_entry=ARC_ENTRY_INDEX(c,c->cur_entry);
+    ck->next_entry=ARC_ENTRY_INDEX(c,c->next_entry);
+    for (i=0;i<1<<ARC_MAX_BITS;i++) {
+        ck->next[i]=ARC_ENTRY_INDEX(c,c->compress[i].next);
+        ck->basecode[i]=c->compress[i].basecode;
+        ck->ch[i]=c->compress[i].ch;
+        ck->hash[i]=ARC_ENTRY_INDEX(c,c->hash[i]);
+    }
+}
+
+// Puts c back in the state saved by ArcCheckpointSave. Only src_pos of the
+// positions is restored; dst_pos is up to the caller.
+static void ArcCheckpointRestore(CArcCtrl *c,const ArcCheckpoint *ck)
+{
+    DWORD i;
+    CArcEntry *temp;
+    c->src_pos=ck->src_pos;
+    c->saved_basecode=ck->saved_basecode;
+    c->free_index=ck->free_index;
+    c->free_limit=ck->free_limit;
+    c->cur_bits_in_use=ck->cur_bits_in_use;
+    c->next_bits_in_use=ck->next_bits_in_use;
+    c->entry_used=ck->entry_used;
+    c->cur_entry=ARC_INDEX_ENTRY(c,ck->cur_entry);
+    c->next_entry=ARC_INDEX_ENTRY(c,ck->next_entry);
+    for (i=0;i<1<<ARC_MAX_BITS;i++) {
+        c->compress[i].next=ARC_INDEX_ENTRY(c,ck->next[i]);
+        c->compress[i].basecode=ck->basecode[i];
+        c->compress[i].ch=ck->ch[i];
+        c->hash[i]=ARC_INDEX_ENTRY(c,ck->hash[i]);
+        c->compress[i].valid=i<c->min_table_entry;
+    }
+    // Codes may name the literals, the entries in the table and cur_entry
+    for (i=0;i<1<<ARC_MAX_BITS;i++)
+        for (temp=c->hash[i];temp;temp=temp->next)
+            temp->valid=TRUE;
+    if (c->cur_entry)
+        c->cur_entry->valid=TRUE;
+    if (c->run_rung)
+        ArcRunRebuild(c);
+}
+
+// Returns the expanded data, or NULL if arc's stream is invalid or truncated
 BYTE *ExpandBuf(CArcCompress *arc)
 {
     CArcCtrl *c;
     BYTE *result;
+    long compressed_size=ARC_SIZE64(arc->compressed_size,arc->compressed_size_hi),
+         expanded_size=ARC_SIZE64(arc->expanded_size,arc->expanded_size_hi);
+    QWORD expanded;
+#ifdef GRA_CODEC_STATS
+    ArcCodecStats stats;
+#endif
 
+    // Every code is at least a byte of stream and stands for at most a
+    // table's worth of bytes, which bounds what a stream can expand to
     if (!(CT_NONE<=arc->compression_type && arc->compression_type<=CT_8_BIT) ||
-            arc->expanded_size>=0x20000000l)
+            expanded_size<0 || expanded_size/(1<<ARC_MAX_BITS)>compressed_size)
         return NULL;
 
-    result=(BYTE *)malloc(arc->expanded_size+1);
-    result[arc->expanded_size]=0; //terminate
+    if (arc->compression_type==CT_NONE &&
+            expanded_size>compressed_size-(long)(sizeof(CArcCompress)-1))
+        return NULL;
+    result=(BYTE *)malloc(expanded_size+1);
+    if (!result)
+        return NULL;
+    result[expanded_size]=0; //terminate
     switch (arc->compression_type) {
         case CT_NONE:
-            memcpy(result,arc->body,arc->expanded_size);
+            memcpy(result,arc->body,expanded_size);
             break;
         case CT_7_BIT:
         case CT_8_BIT:
             c=ArcCtrlNew(TRUE,arc->compression_type);
-            c->src_size=arc->compressed_size*8;
+#ifdef GRA_CODEC_STATS
+            ArcStatsAttach(c,&stats);
+#endif
+            c->src_size=(QWORD)compressed_size*8;
             c->src_pos=(sizeof(CArcCompress)-1)*8;
             c->src_buf=(BYTE *)arc;
-            c->dst_size=arc->expanded_size;
+            c->dst_size=expanded_size;
             c->dst_buf=result;
             c->dst_pos=0;
             ArcExpandBuf(c);
+            expanded=c->dst_pos;
+#ifdef GRA_CODEC_STATS
+            ArcStatsMerge(&arc_stats.decode,&stats);
+#endif
             ArcCtrlDel(c);
+            if (expanded!=(QWORD)expanded_size) {
+                free(result);
+                return NULL;
+            }
             break;
     }
     return result;
 }
 
-long FSize(FILE *f)
-{
-    long	result,original=ftell(f);
-    fseek(f,0,SEEK_END);
-    result=ftell(f);
-    fseek(f,original,SEEK_SET);
-    return result;
-}
-
 // Sets decompressed to point to the allocated byte array
-// Returns the number of bytes in that array
+// Returns the number of bytes in that array, or -1 (and NULL) if the stream
+// is invalid or truncated
 long decompress(BYTE *compressed, long compressed_size, BYTE**decompressed){
-    DWORD out_size;
+    long out_size;
     CArcCompress *arc;
-    BYTE *out_buf;
+    BYTE *out_buf=NULL;
+    GraTraceSpan span={0};
+    *decompressed=NULL;
+    if (compressed_size<(long)sizeof(CArcCompress)-1)
+        return -1;
     arc=(CArcCompress *)malloc(compressed_size);
     memcpy(arc, compressed, compressed_size);
-    out_size=arc->expanded_size;
-    if (arc->compressed_size==compressed_size &&
+    out_size=ARC_SIZE64(arc->expanded_size,arc->expanded_size_hi);
+    if (ARC_SIZE64(arc->compressed_size,arc->compressed_size_hi)==compressed_size &&
             arc->compression_type && arc->compression_type<=3) {
+        GRA_TRACE_BEGIN(span);
         out_buf=ExpandBuf(arc);
-        if (out_buf) {
-            // Decompression was successful
-        }
+        GRA_TRACE_END(span, "lzw decode", out_size);
     }
     *decompressed = out_buf;
 
     free(arc);
-    return out_size;
+    return out_buf ? out_size:-1;
+}
+
+// Checks a checkpoint read back from disk before any of its indices are
+// used to address the table
+static BOOL ArcCheckpointValid(const ArcCheckpoint *ck,DWORD min_bits,long src_bits)
+{
+    BYTE seen[1<<ARC_MAX_BITS]; // 1 in the table, 2 being followed, 3 ends at a literal
+    DWORD i,e;
+    if (ck->next_bits_in_use<=min_bits || ck->next_bits_in_use>ARC_MAX_BITS ||
+            ck->cur_bits_in_use<=min_bits || ck->cur_bits_in_use>ck->next_bits_in_use ||
+            ck->free_limit!=1u<<ck->next_bits_in_use ||
+            ck->free_index<1u<<min_bits || ck->free_index>=1<<ARC_MAX_BITS ||
+            ck->saved_basecode>=1<<ARC_MAX_BITS ||
+            ck->cur_entry>=1<<ARC_MAX_BITS || ck->next_entry>=1<<ARC_MAX_BITS ||
+            ck->src_pos<0 || ck->src_pos>src_bits)
+        return FALSE;
+    for (i=0;i<1<<ARC_MAX_BITS;i++)
+        if (ck->next[i]>=1<<ARC_MAX_BITS || ck->basecode[i]>=1<<ARC_MAX_BITS ||
+                ck->hash[i]>=1<<ARC_MAX_BITS)
+            return FALSE;
+
+    // Each entry in the table must be on the list of its basecode and no
+    // other, and following basecodes from it must reach a literal, or
+    // restoring or decoding from the checkpoint could loop
+    memset(seen,0,sizeof(seen));
+    for (i=0;i<1<<ARC_MAX_BITS;i++)
+        for (e=ck->hash[i];e;e=ck->next[e]) {
+            if (e<1u<<min_bits || ck->basecode[e]!=i || seen[e])
+                return FALSE;
+            seen[e]=1;
+        }
+    for (i=1<<min_bits;i<1<<ARC_MAX_BITS;i++) {
+        if (seen[i]!=1)
+            continue;
+        for (e=i;e>=1u<<min_bits && seen[e]==1;e=ck->basecode[e])
+            seen[e]=2;
+        if (e>=1u<<min_bits && seen[e]!=3)
+            return FALSE;
+        for (e=i;e>=1u<<min_bits && seen[e]==2;e=ck->basecode[e])
+            seen[e]=3;
+    }
+    return TRUE;
+}
+
+static void ArcExpandCheckpointSave(CArcCtrl *c,ArcExpandCheckpoint *ck,long offset)
+{
+    ArcCheckpointSave(c,&ck->state,offset);
+    ck->last_ch=c->last_ch;
+    ck->stk_len=c->stk_ptr-c->stk_base;
+    memcpy(ck->stk,c->stk_base,ck->stk_len);
+}
+
+static void ArcExpandCheckpointRestore(CArcCtrl *c,const ArcExpandCheckpoint *ck)
+{
+    ArcCheckpointRestore(c,&ck->state);
+    c->last_ch=ck->last_ch;
+    memcpy(c->stk_base,ck->stk,ck->stk_len);
+    c->stk_ptr=c->stk_base+ck->stk_len;
+}
+
+// Expands compressed from the checkpoint from (the start if NULL) up to
+// byte end, passing it to sink as decompress_chunked does. If index is not
+// NULL a checkpoint is stored in it every index->interval bytes.
+static long ArcExpandRange(BYTE *compressed, long compressed_size,
+        const ArcExpandCheckpoint *from, long end, long chunk_size,
+        ArcExpandSink sink, void *user_data, ArcExpandIndex *index)
+{
+    CArcCompress *arc=(CArcCompress *)compressed;
+    GraTraceSpan span={0};
+    CArcCtrl *c;
+    BYTE *buf;
+    long expanded_size,start=0,offset,n,stop;
+    int ok=TRUE;
+#ifdef GRA_CODEC_STATS
+    ArcCodecStats stats;
+#endif
+
+    if (index)
+        index->count=0;
+    if (compressed_size<(long)sizeof(CArcCompress)-1 ||
+            ARC_SIZE64(arc->compressed_size,arc->compressed_size_hi)!=compressed_size ||
+            !(CT_NONE<=arc->compression_type && arc->compression_type<=CT_8_BIT))
+        return -1;
+    expanded_size=ARC_SIZE64(arc->expanded_size,arc->expanded_size_hi);
+    if (expanded_size<0)
+        return -1;
+    if (end<0 || end>expanded_size)
+        end=expanded_size;
+    if (from) {
+        if (arc->compression_type==CT_NONE || from->stk_len>1<<ARC_MAX_BITS ||
+                !ArcCheckpointValid(&from->state,arc->compression_type==CT_7_BIT ? 7:8,compressed_size*8))
+            return -1;
+        start=from->state.dst_pos;
+        if (start<0 || start>end)
+            return -1;
+    }
+    offset=start;
+
+    GRA_TRACE_BEGIN(span);
+    if (arc->compression_type==CT_NONE) {
+        if (end>compressed_size-(long)sizeof(CArcCompress)+1)
+            return -1;
+        for (;ok && offset<end;offset+=n) {
+            n=end-offset<chunk_size ? end-offset:chunk_size;
+            ok=sink(user_data,arc->body+offset,n,offset);
+        }
+    } else {
+        buf=malloc(chunk_size);
+        c=ArcCtrlNew(TRUE,arc->compression_type);
+#ifdef GRA_CODEC_STATS
+        ArcStatsAttach(c,&stats);
+#endif
+        c->src_size=(QWORD)compressed_size*8;
+        c->src_pos=(sizeof(CArcCompress)-1)*8;
+        c->src_buf=compressed;
+        if (from)
+            ArcExpandCheckpointRestore(c,from);
+        stop=index ? index->interval:end;
+        while (ok && offset<end) {
+            c->dst_buf=buf;
+            c->dst_size=end-offset<chunk_size ? end-offset:chunk_size;
+            if (c->dst_size>stop-offset)
+                c->dst_size=stop-offset;
+            c->dst_pos=0;
+            ArcExpandBuf(c);
+            if (c->corrupt) {
+                ok=FALSE;
+                break;
+            }
+            if (!c->dst_pos) // Ran out of codes
+                break;
+            ok=sink(user_data,buf,c->dst_pos,offset);
+            offset+=c->dst_pos;
+            if (offset==stop && stop<end) {
+                ArcExpandCheckpointSave(c,&index->list[index->count++],offset);
+                stop+=index->interval;
+            }
+            if (stop>end)
+                stop=end;
+        }
+#ifdef GRA_CODEC_STATS
+        ArcStatsMerge(&arc_stats.decode,&stats);
+#endif
+        ArcCtrlDel(c);
+        free(buf);
+    }
+    GRA_TRACE_END(span, "lzw decode", offset-start);
+    if (!(ok && offset==end)) {
+        if (index)
+            index->count=0;
+        return -1;
+    }
+    return end-start;
+}
+
+// Like decompress(), but passes the expanded data to sink a piece of at
+// most chunk_size bytes at a time, all pieces sharing one buffer, instead of
+// expanding it all into memory. compressed is only read. Returns the
+// expanded size, or -1 if the stream is invalid or truncated or sink failed.
+long decompress_chunked(BYTE *compressed, long compressed_size, long chunk_size,
+        ArcExpandSink sink, void *user_data)
+{
+    return ArcExpandRange(compressed,compressed_size,NULL,-1,chunk_size,sink,user_data,NULL);
+}
+
+// decompress_chunked, also storing a checkpoint of the decoder in
+// index->list every index->interval bytes of expanded data. index->count is
+// set to the number stored, 0 if the stream is not compressed or invalid.
+long decompress_indexed(BYTE *compressed, long compressed_size, long chunk_size,
+        ArcExpandSink sink, void *user_data, ArcExpandIndex *index)
+{
+    return ArcExpandRange(compressed,compressed_size,NULL,-1,chunk_size,sink,user_data,index);
+}
+
+// Expands bytes from->state.dst_pos up to end (the end of the data if -1)
+// starting from a checkpoint left by decompress_indexed, or from the start
+// if from is NULL. Returns the number of bytes expanded, or -1 on error,
+// including a checkpoint that doesn't fit the stream.
+long decompress_range(BYTE *compressed, long compressed_size,
+        const ArcExpandCheckpoint *from, long end, long chunk_size,
+        ArcExpandSink sink, void *user_data)
+{
+    return ArcExpandRange(compressed,compressed_size,from,end,chunk_size,sink,user_data,NULL);
+}
+
+// Like decompress_chunked, but the stream comes from reader a piece at a time
+// instead of from memory, so only a window of it is held at once: memory
+// use is the same whatever the size of the image. Sizes are taken from the
+// stream's header, all 64 bits of them, and expanded_size (if not NULL) is
+// set from it as soon as it is read. The stream must end exactly where its
+// header says. Returns the expanded size, or -1 if the stream is invalid or
+// truncated, reader failed or sink failed. chunk_size must be at least 64.
+long decompress_streamed(ArcReadFn reader, void *read_data, long chunk_size,
+        ArcExpandSink sink, void *user_data, long *expanded_size)
+{
+    CArcCompress header;
+    GraTraceSpan span={0};
+    CArcCtrl *c=NULL;
+    BYTE *window,*buf;
+    long left,expanded,offset=0,have=0,keep,n;
+    int ok=TRUE;
+
+    if (expanded_size)
+        *expanded_size=-1;
+    for (n=0;n<(long)sizeof(CArcCompress)-1;n+=keep)
+        if ((keep=reader(read_data,(BYTE *)&header+n,sizeof(CArcCompress)-1-n))<=0)
+            return -1;
+    left=ARC_SIZE64(header.compressed_size,header.compressed_size_hi)-(sizeof(CArcCompress)-1);
+    expanded=ARC_SIZE64(header.expanded_size,header.expanded_size_hi);
+    if (left<0 || expanded<0 ||
+            !(CT_NONE<=header.compression_type && header.compression_type<=CT_8_BIT))
+        return -1;
+    if (expanded_size)
+        *expanded_size=expanded;
+
+    // window holds the stream from the byte the decoder is in onwards, with
+    // room for a DWORD read at its end. It is topped up once it is half used.
+    window=malloc(2*chunk_size+4);
+    buf=malloc(chunk_size);
+    if (header.compression_type!=CT_NONE) {
+        c=ArcCtrlNew(TRUE,header.compression_type);
+        c->src_buf=window;
+        c->src_pos=c->src_size=0;
+    }
+    GRA_TRACE_BEGIN(span);
+    while (ok && offset<expanded) {
+        if (c) {
+            keep=have-(c->src_pos>>3);
+            if (keep<chunk_size && left>0) {
+                memmove(window,window+(c->src_pos>>3),keep);
+                c->src_pos&=7;
+                n=2*chunk_size-keep<left ? 2*chunk_size-keep:left;
+                if ((n=reader(read_data,window+keep,n))<=0) {
+                    ok=FALSE;
+                    break;
+                }
+                left-=n;
+                have=keep+n;
+                c->src_size=have*8;
+            }
+            c->dst_buf=buf;
+            c->dst_size=expanded-offset<chunk_size ? expanded-offset:chunk_size;
+            c->dst_pos=0;
+            ArcExpandBuf(c);
+            if (c->corrupt)
+                ok=FALSE;
+            else if (!c->dst_pos && !left) // Ran out of codes
+                break;
+            n=c->dst_pos;
+        } else {
+            // Stored as it is: pass it on as it is read
+            n=expanded-offset<chunk_size ? expanded-offset:chunk_size;
+            if (n>left || (n=reader(read_data,buf,n))<=0) {
+                ok=FALSE;
+                break;
+            }
+            left-=n;
+        }
+        if (ok && n)
+            ok=sink(user_data,buf,n,offset);
+        offset+=n;
+    }
+    // The rest of the stream (the last partial byte, or the padding byte of
+    // a stored one) isn't needed, but is read so that reader is left at its end
+    while (ok && left>0)
+        if ((n=reader(read_data,window,left<chunk_size ? left:chunk_size))>0)
+            left-=n;
+        else
+            ok=FALSE;
+    GRA_TRACE_END(span, "lzw decode", offset);
+    if (c)
+        ArcCtrlDel(c);
+    free(buf);
+    free(window);
+    return ok && offset==expanded ? expanded:-1;
+}
+
+#define ARC_VERIFY_CHUNK 0x10000
+
+struct _ArcVerify
+{
+    const BYTE *expected;
+    long size,offset;   // bytes of expected matched so far
+    long type;          // of the stream being fed, 0 until its header is in
+    int failed;
+    CArcCtrl *c;
+    BYTE *buf;
+};
+
+// Starts checking that a stream, given while it is still being written,
+// expands to the size bytes at expected
+ArcVerify *decompress_verify_new(const BYTE *expected, long size)
+{
+    ArcVerify *v=(ArcVerify *)calloc(1,sizeof(ArcVerify));
+    v->expected=expected;
+    v->size=size;
+    v->buf=malloc(ARC_VERIFY_CHUNK);
+    return v;
+}
+
+// stream holds the first len bytes of the stream, none of which change any
+// more apart from compressed_size. Expands as much of it as they allow and
+// compares that with the expected data. Returns FALSE once the stream is
+// known not to match.
+int decompress_verify_feed(ArcVerify *v, const BYTE *stream, long len)
+{
+    CArcCompress *arc=(CArcCompress *)stream;
+    if (v->failed || v->type==CT_NONE || len<(long)sizeof(CArcCompress)-1)
+        return !v->failed;
+    if (!v->type) {
+        v->type=arc->compression_type;
+        if (v->type==CT_NONE)
+            return TRUE; // nothing to do until it's all there
+        if (!(CT_7_BIT<=v->type && v->type<=CT_8_BIT) ||
+                ARC_SIZE64(arc->expanded_size,arc->expanded_size_hi)!=v->size) {
+            v->failed=TRUE;
+            return FALSE;
+        }
+        v->c=ArcCtrlNew(TRUE,v->type);
+        v->c->src_pos=(sizeof(CArcCompress)-1)*8;
+    }
+    v->c->src_buf=(BYTE *)stream;
+    v->c->src_size=(QWORD)len*8;
+    while (v->offset<v->size) {
+        v->c->dst_buf=v->buf;
+        v->c->dst_size=v->size-v->offset<ARC_VERIFY_CHUNK ? v->size-v->offset:ARC_VERIFY_CHUNK;
+        v->c->dst_pos=0;
+        ArcExpandBuf(v->c);
+        if (v->c->corrupt || memcmp(v->buf,v->expected+v->offset,v->c->dst_pos)) {
+            v->failed=TRUE;
+            return FALSE;
+        }
+        if (!v->c->dst_pos)
+            break;
+        v->offset+=v->c->dst_pos;
+    }
+    return TRUE;
+}
+
+// stream is complete and len bytes long. Returns TRUE if it expands to
+// exactly the expected data. If the stream was rewritten uncompressed after
+// being fed, the new one is checked from scratch.
+int decompress_verify_finish(ArcVerify *v, const BYTE *stream, long len)
+{
+    CArcCompress *arc=(CArcCompress *)stream;
+    if (len<(long)sizeof(CArcCompress)-1 ||
+            ARC_SIZE64(arc->compressed_size,arc->compressed_size_hi)!=len ||
+            ARC_SIZE64(arc->expanded_size,arc->expanded_size_hi)!=v->size)
+        return FALSE;
+    if (arc->compression_type==CT_NONE)
+        return len-(long)sizeof(CArcCompress)+1>=v->size &&
+            !memcmp(arc->body,v->expected,v->size);
+    if (v->type && arc->compression_type!=v->type)
+        return FALSE;
+    return decompress_verify_feed(v,stream,len) && v->offset==v->size &&
+        v->c->src_pos+8>v->c->src_size;
+}
+
+void decompress_verify_free(ArcVerify *v)
+{
+    if (v->c)
+        ArcCtrlDel(v->c);
+    free(v->buf);
+    free(v);
 }
 
 // DECOMPRESS STUFF copied from Compress.cpp
@@ -337,6 +1175,7 @@ void ArcCompressBuf(CArcCtrl *c)
     CArcEntry *temp,*temp1;
     long ch,basecode;
     BYTE *src_ptr,*src_limit;
+    ArcCompressPhaseFn phase;
 
     src_ptr=c->src_buf+c->src_pos;
     src_limit=c->src_buf+c->src_size;
@@ -346,7 +1185,17 @@ void ArcCompressBuf(CArcCtrl *c)
     else
         basecode=c->saved_basecode;
 
-    while (src_ptr<src_limit && c->dst_pos+c->cur_bits_in_use<=c->dst_size) {
+    for (;;) {
+        // A match cut short by the end of the last buffer is finished below
+        if (c->cur_bits_in_use==c->next_bits_in_use && c->entry_used) {
+            phase=arc_compress_phases[c->min_bits-7][c->cur_bits_in_use];
+            if (phase) {
+                src_ptr=phase(c,src_ptr,src_limit,&basecode);
+                if (!c->entry_used) goto ac_done;
+            }
+        }
+        if (!(src_ptr<src_limit && c->dst_pos+c->cur_bits_in_use<=c->dst_size))
+            break;
         ArcEntryGet(c);
 ac_start:
         if (src_ptr>=src_limit) goto ac_done;
@@ -364,6 +1213,7 @@ ac_start:
 
 
         BFieldOrU32(c->dst_buf,c->dst_pos,basecode);
+        ARC_STAT(c, c->stats->codes[c->cur_bits_in_use]++; ArcStatsFull(c->stats,0); c->stats->bytes=src_ptr-1-c->src_buf);
         c->dst_pos+=c->cur_bits_in_use;
 
         c->entry_used=TRUE;
@@ -373,6 +1223,7 @@ ac_start:
         temp1=&c->hash[basecode];
         temp->next=temp1->next;
         temp1->next=temp;
+        ArcRunAdd(c,basecode,ch,temp);
 
         basecode=ch;
     }
@@ -385,6 +1236,7 @@ BOOL ArcFinishCompression(CArcCtrl *c)
 {//Do closing touch on archivew ctrl struct.
     if (c->dst_pos+c->cur_bits_in_use<=c->dst_size) {
         BFieldOrU32(c->dst_buf,c->dst_pos,c->saved_basecode);
+        ARC_STAT(c, c->stats->codes[c->next_bits_in_use]++; ArcStatsFull(c->stats,0); c->stats->bytes=c->src_pos);
         c->dst_pos+=c->next_bits_in_use;
         return TRUE;
     } else
@@ -394,12 +1246,22 @@ BOOL ArcFinishCompression(CArcCtrl *c)
 long compress(BYTE ** compressed, BYTE *src,long size)
 {//See $LK,"::/Demo/Dsk/SerializeTree.CPP"$.
     CArcCompress *arc;
-    long size_out,compression_type=ArcDetermineCompressionType(src,size);
-    CArcCtrl *c=ArcCtrlNew(FALSE,compression_type);
+    GraTraceSpan span={0};
+    long size_out,compression_type;
+    CArcCtrl *c;
+#ifdef GRA_CODEC_STATS
+    ArcCodecStats stats;
+#endif
+    GRA_TRACE_BEGIN(span);
+    compression_type=ArcDetermineCompressionType(src,size);
+    c=ArcCtrlNew(FALSE,compression_type);
+#ifdef GRA_CODEC_STATS
+    ArcStatsAttach(c,&stats);
+#endif
     c->src_size=size;
     c->src_buf=src;
     c->dst_size=(size+sizeof(CArcCompress))<<3;
-    c->dst_buf=calloc(c->dst_size>>3, 1);
+    c->dst_buf=calloc((c->dst_size>>3)+4, 1); // BFieldOrU32 writes a DWORD
     c->dst_pos=(sizeof(CArcCompress) - 1)<<3;
     ArcCompressBuf(c);
     if (ArcFinishCompression(c) && c->src_pos==c->src_size) {
@@ -407,15 +1269,21 @@ long compress(BYTE ** compressed, BYTE *src,long size)
         arc=malloc(size_out);
         memcpy(arc,c->dst_buf,size_out);
         arc->compression_type=compression_type;
-        arc->compressed_size=size_out;
     } else {
-        arc=malloc(size+sizeof(CArcCompress));
+        arc=calloc(size+sizeof(CArcCompress),1);
         memcpy(&arc->body,src,size);
         arc->compression_type=CT_NONE;
-        arc->compressed_size=size+sizeof(CArcCompress);
+        size_out=size+sizeof(CArcCompress);
     }
 
+    arc->compressed_size=size_out;
+    arc->compressed_size_hi=(unsigned long)size_out>>32;
     arc->expanded_size=size;
+    arc->expanded_size_hi=(unsigned long)size>>32;
+#ifdef GRA_CODEC_STATS
+    ArcStatsMerge(&arc_stats.encode,&stats);
+    ArcStatsChains(c);
+#endif
 
     /*
        BYTE * pointer = (BYTE *) arc;
@@ -434,6 +1302,314 @@ long compress(BYTE ** compressed, BYTE *src,long size)
 
     free(c->dst_buf);
     ArcCtrlDel(c);
+    GRA_TRACE_END(span, "compression", size);
     *compressed = (BYTE*) arc;
     return arc->compressed_size;
 }
+
+// Same output as compress(), but handed to sink a piece at a time as soon as
+// each piece of at most chunk_size bytes is complete, so it can be written
+// out while the next one is compressed. Two piece buffers are used in turn:
+// sink may keep reading a piece until it is called again. A call with len 0
+// asks it to wait until everything passed so far is written. Each piece
+// comes with its offset in the stream: compressed_size at offset 0 is only
+// known, and rewritten, at the end, and if the data turns out not to be
+// compressible the whole stream is rewritten uncompressed from offset 0.
+// chunk_size must be at least 64. Returns the size of the stream, or -1 if
+// sink failed.
+long compress_chunked(BYTE *src, long size, long chunk_size,
+        ArcChunkSink sink, void *user_data)
+{
+    return compress_checkpointed(src,size,chunk_size,sink,user_data,NULL);
+}
+
+// compress_chunked, also snapshotting the encoder every checkpoints->interval
+// bytes of source. If checkpoints->count is not 0 on entry, encoding
+// resumes from list[count-1] instead of from the start: the stream up to
+// that checkpoint is taken from checkpoints->prefix, which must hold it
+// including its last partial byte. The caller is responsible for the source
+// up to there being unchanged; the checkpoint is ignored if the compression
+// type or size differs. On return count is the number of checkpoints taken
+// or kept, 0 if the stream ended up uncompressed. The output is the same
+// as compress_chunked's either way.
+long compress_checkpointed(BYTE *src, long size, long chunk_size,
+        ArcChunkSink sink, void *user_data, ArcCheckpoints *checkpoints)
+{
+    CArcCompress *arc,header;
+    const ArcCheckpoint *resume=NULL;
+    GraTraceSpan span={0};
+    BYTE *bufs[2],*buf;
+    DWORD size_out[2];
+    long compression_type,limit,flushed=0,n,next_ck=0,stop=size,total=-1;
+    int cur=0,compressed=FALSE,ok=TRUE;
+    CArcCtrl *c;
+#ifdef GRA_CODEC_STATS
+    ArcCodecStats stats;
+#endif
+    GRA_TRACE_BEGIN(span);
+    compression_type=ArcDetermineCompressionType(src,size);
+    c=ArcCtrlNew(FALSE,compression_type);
+#ifdef GRA_CODEC_STATS
+    ArcStatsAttach(c,&stats);
+#endif
+    // BFieldOrU32 writes a whole DWORD, and a code may run one bit past
+    // dst_size, so each buffer gets some slack
+    bufs[0]=calloc(chunk_size+4,1);
+    bufs[1]=calloc(chunk_size+4,1);
+    buf=bufs[0];
+
+    limit=(size+sizeof(CArcCompress))<<3; // same limit as compress()
+    c->src_size=size;
+    c->src_buf=src;
+    c->dst_buf=buf;
+
+    if (checkpoints) {
+        if (checkpoints->count>0 && checkpoints->compression_type==compression_type &&
+                ARC_SIZE64(((CArcCompress *)checkpoints->prefix)->expanded_size,
+                    ((CArcCompress *)checkpoints->prefix)->expanded_size_hi)==size &&
+                checkpoints->list[checkpoints->count-1].src_pos<size)
+            resume=&checkpoints->list[checkpoints->count-1];
+        else
+            checkpoints->count=0;
+        checkpoints->compression_type=compression_type;
+        next_ck=checkpoints->count;
+        stop=(next_ck+1)*checkpoints->interval;
+        if (stop>size)
+            stop=size;
+    }
+    if (resume) {
+        // Everything before the checkpoint is already in prefix: pass on its
+        // whole bytes and carry on from the partial one
+        ArcCheckpointRestore(c,resume);
+        flushed=resume->dst_pos>>3;
+        ok=sink(user_data,checkpoints->prefix,flushed,0);
+        buf[0]=checkpoints->prefix[flushed]&((1<<(resume->dst_pos&7))-1);
+        c->dst_pos=resume->dst_pos&7;
+    } else {
+        arc=(CArcCompress *)buf;
+        arc->compression_type=compression_type;
+        arc->expanded_size=size;
+        arc->expanded_size_hi=(unsigned long)size>>32;
+        c->dst_pos=(sizeof(CArcCompress) - 1)<<3;
+    }
+    while (ok) {
+        c->src_size=stop;
+        c->dst_size=chunk_size<<3;
+        if (c->dst_size>limit-(flushed<<3))
+            c->dst_size=limit-(flushed<<3);
+        ArcCompressBuf(c);
+        if (c->src_pos==stop && stop<size) {
+            // Reached a checkpoint; go on encoding into the same piece
+            ArcCheckpointSave(c,&checkpoints->list[next_ck++],(flushed<<3)+c->dst_pos);
+            stop+=checkpoints->interval;
+            if (stop>size)
+                stop=size;
+            continue;
+        }
+        if (c->src_pos>=size && ArcFinishCompression(c)) {
+            compressed=c->src_pos==c->src_size;
+            break;
+        }
+        if (c->dst_size==limit-(flushed<<3)) { // Out of room overall
+            compressed=FALSE;
+            break;
+        }
+        // Piece is full: pass on its whole bytes and carry the partial one
+        n=c->dst_pos>>3;
+        if (!(ok=sink(user_data,buf,n,flushed)))
+            break;
+        flushed+=n;
+        cur^=1;
+        memset(bufs[cur],0,chunk_size+4);
+        bufs[cur][0]=buf[n];
+        buf=bufs[cur];
+        c->dst_buf=buf;
+        c->dst_pos&=7;
+    }
+
+    if (ok && compressed) {
+        n=(c->dst_pos+7)>>3;
+        ok=sink(user_data,buf,n,flushed);
+        total=flushed+n;
+        size_out[0]=total;
+        size_out[1]=(unsigned long)total>>32;
+        ok=ok && sink(user_data,(BYTE *)size_out,sizeof(size_out),0);
+    } else if (ok) {
+        // Laid out like compress()'s fallback, including its trailing byte
+        memset(&header,0,sizeof(CArcCompress));
+        total=size+sizeof(CArcCompress);
+        header.compression_type=CT_NONE;
+        header.compressed_size=total;
+        header.compressed_size_hi=(unsigned long)total>>32;
+        header.expanded_size=size;
+        header.expanded_size_hi=(unsigned long)size>>32;
+        ok=sink(user_data,(BYTE *)&header,sizeof(CArcCompress)-1,0) &&
+            sink(user_data,src,size,sizeof(CArcCompress)-1) &&
+            sink(user_data,&header.body[0],1,size+sizeof(CArcCompress)-1);
+    }
+    // Everything above must be written before header and buffers go away
+    ok=sink(user_data,NULL,0,0) && ok;
+    if (checkpoints)
+        checkpoints->count=ok && compressed ? next_ck:0;
+#ifdef GRA_CODEC_STATS
+    ArcStatsMerge(&arc_stats.encode,&stats);
+    ArcStatsChains(c);
+#endif
+
+    free(bufs[0]);
+    free(bufs[1]);
+    ArcCtrlDel(c);
+    GRA_TRACE_END(span, "compression", size);
+    return ok ? total:-1;
+}
+
+// Same output as compress_chunked, but the source is read from source a
+// piece of chunk_size bytes at a time instead of being in memory, so memory
+// use doesn't grow with size. The source is read twice: once to choose
+// between 7-bit and 8-bit codes (stopping at the first byte that needs 8),
+// and again while encoding. If it turns out not to be compressible it is
+// read a third time to be stored as it is. Sizes of 4GB or more go in the
+// high words of the header. chunk_size must be at least 64. Returns the
+// size of the stream, or -1 if source or sink failed.
+long compress_streamed(long size, long chunk_size, ArcSourceFn source,
+        void *src_data, ArcChunkSink sink, void *user_data)
+{
+    CArcCompress *arc,header;
+    GraTraceSpan span={0};
+    BYTE *bufs[2],*buf,*strip;
+    DWORD size_out[2];
+    long compression_type=CT_7_BIT,limit,flushed=0,pos,n,total=-1;
+    int cur=0,compressed=FALSE,ok=TRUE;
+    CArcCtrl *c;
+#ifdef GRA_CODEC_STATS
+    ArcCodecStats stats;
+#endif
+    GRA_TRACE_BEGIN(span);
+    strip=calloc(chunk_size,1);
+    for (pos=0;ok && pos<size && compression_type==CT_7_BIT;pos+=n) {
+        n=size-pos<chunk_size ? size-pos:chunk_size;
+        ok=source(src_data,strip,n,pos);
+        compression_type=ArcDetermineCompressionType(strip,n);
+    }
+    c=ArcCtrlNew(FALSE,compression_type);
+#ifdef GRA_CODEC_STATS
+    ArcStatsAttach(c,&stats);
+#endif
+    bufs[0]=calloc(chunk_size+4,1);
+    bufs[1]=calloc(chunk_size+4,1);
+    buf=bufs[0];
+
+    limit=(size+sizeof(CArcCompress))<<3; // same limit as compress()
+    c->src_buf=strip;
+    c->src_pos=c->src_size=0;
+    c->dst_buf=buf;
+    arc=(CArcCompress *)buf;
+    arc->compression_type=compression_type;
+    arc->expanded_size=size;
+    arc->expanded_size_hi=(unsigned long)size>>32;
+    c->dst_pos=(sizeof(CArcCompress) - 1)<<3;
+    pos=0;
+    while (ok) {
+        if (c->src_pos==c->src_size && pos<size) {
+            n=size-pos<chunk_size ? size-pos:chunk_size;
+            if (!(ok=source(src_data,strip,n,pos)))
+                break;
+            pos+=n;
+            c->src_pos=0;
+            c->src_size=n;
+        }
+        c->dst_size=chunk_size<<3;
+        if (c->dst_size>limit-(flushed<<3))
+            c->dst_size=limit-(flushed<<3);
+        ArcCompressBuf(c);
+        if (c->src_pos<c->src_size || pos<size) {
+            if (c->dst_pos+ARC_MAX_BITS<=c->dst_size)
+                continue; // Only the strip ran out
+        } else if (ArcFinishCompression(c)) {
+            compressed=c->src_pos==c->src_size;
+            break;
+        }
+        if (c->dst_size==limit-(flushed<<3)) { // Out of room overall
+            compressed=FALSE;
+            break;
+        }
+        n=c->dst_pos>>3;
+        if (!(ok=sink(user_data,buf,n,flushed)))
+            break;
+        flushed+=n;
+        cur^=1;
+        memset(bufs[cur],0,chunk_size+4);
+        bufs[cur][0]=buf[n];
+        buf=bufs[cur];
+        c->dst_buf=buf;
+        c->dst_pos&=7;
+    }
+
+    if (ok && compressed) {
+        n=(c->dst_pos+7)>>3;
+        ok=sink(user_data,buf,n,flushed);
+        total=flushed+n;
+        size_out[0]=total;
+        size_out[1]=(unsigned long)total>>32;
+        ok=ok && sink(user_data,(BYTE *)size_out,sizeof(size_out),0);
+    } else if (ok) {
+        // Laid out like compress()'s fallback, including its trailing byte
+        memset(&header,0,sizeof(CArcCompress));
+        total=size+sizeof(CArcCompress);
+        header.compression_type=CT_NONE;
+        header.compressed_size=total;
+        header.compressed_size_hi=(unsigned long)total>>32;
+        header.expanded_size=size;
+        header.expanded_size_hi=(unsigned long)size>>32;
+        ok=sink(user_data,(BYTE *)&header,sizeof(CArcCompress)-1,0);
+        for (pos=0;ok && pos<size;pos+=n) {
+            n=size-pos<chunk_size ? size-pos:chunk_size;
+            // Wait for the last piece to be stored before reusing strip
+            ok=sink(user_data,NULL,0,0) && source(src_data,strip,n,pos) &&
+                sink(user_data,strip,n,sizeof(CArcCompress)-1+pos);
+        }
+        ok=ok && sink(user_data,&header.body[0],1,size+sizeof(CArcCompress)-1);
+    }
+    // Everything above must be written before header and buffers go away
+    ok=sink(user_data,NULL,0,0) && ok;
+#ifdef GRA_CODEC_STATS
+    ArcStatsMerge(&arc_stats.encode,&stats);
+    ArcStatsChains(c);
+#endif
+
+    free(bufs[0]);
+    free(bufs[1]);
+    free(strip);
+    ArcCtrlDel(c);
+    GRA_TRACE_END(span, "compression", size);
+    return ok ? total:-1;
+}
+
+// Clears the counters collected by compress() and decompress()
+void compression_stats_reset(void)
+{
+#ifdef GRA_CODEC_STATS
+    pthread_mutex_lock(&arc_stats_lock);
+    memset(&arc_stats,0,sizeof(arc_stats));
+    arc_stats.encode.table_full_at=-1;
+    arc_stats.decode.table_full_at=-1;
+    pthread_mutex_unlock(&arc_stats_lock);
+#endif
+}
+
+// Copies the counters collected since the last reset into stats. Returns
+// FALSE (and zeroes stats) if the codec was built without GRA_CODEC_STATS.
+int compression_stats_get(CompressionStats *stats)
+{
+#ifdef GRA_CODEC_STATS
+    pthread_mutex_lock(&arc_stats_lock);
+    *stats=arc_stats;
+    pthread_mutex_unlock(&arc_stats_lock);
+    return TRUE;
+#else
+    memset(stats,0,sizeof(CompressionStats));
+    stats->encode.table_full_at=-1;
+    stats->decode.table_full_at=-1;
+    return FALSE;
+#endif
+}
@@ -18,6 +18,125 @@
 
 #ifndef __COMPRESSION_H__
 #define __COMPRESSION_H__
+
+#define ARC_STATS_WIDTHS    13  // code widths 0..ARC_MAX_BITS
+#define ARC_STATS_CHAINS    16  // last bucket counts chains of 15 or more
+
+// Counters for one direction of the codec. Only collected when the codec is
+// built with -DGRA_CODEC_STATS; otherwise none of the counting code exists.
+typedef struct _ArcCodecStats
+{
+    unsigned long codes[ARC_STATS_WIDTHS];  // codes emitted/read, by bit width
+    unsigned long bytes;                    // bytes covered by those codes
+    long          table_full_at;            // byte offset of the first code after the table filled, -1 if never
+    unsigned long recycled;                 // table slots reused by ArcEntryGet
+} ArcCodecStats;
+
+typedef struct _CompressionStats
+{
+    ArcCodecStats encode, decode;
+    unsigned long chain_lengths[ARC_STATS_CHAINS]; // hash[] chain lengths when encoding finished
+} CompressionStats;
+
 long decompress(unsigned char* compressed, long compressed_size, unsigned char ** decompressed);
+
+// Receives len bytes of expanded data that start at offset. Returns 0 on error.
+typedef int (*ArcExpandSink)(void *user_data, const unsigned char *buf, long len, long offset);
+
 long compress(unsigned char ** compressed, unsigned char *src, long size);
+
+// Receives len bytes of compressed stream to be stored at offset. len 0
+// means wait until everything received so far is stored. Returns 0 on error.
+typedef int (*ArcChunkSink)(void *user_data, const unsigned char *buf, long len, long offset);
+
+long compress_chunked(unsigned char *src, long size, long chunk_size,
+        ArcChunkSink sink, void *user_data);
+
+#define ARC_TABLE_ENTRIES   4096    // string table size, 1 << 12 bit codes
+
+// Encoder state between two bytes of source. Table links are stored as
+// indices (0 for none) rather than pointers, so a checkpoint can be kept on
+// disk and restored into a different control structure.
+typedef struct _ArcCheckpoint
+{
+    long            src_pos;        // source bytes consumed
+    long            dst_pos;        // stream bits written, header included
+    unsigned int    saved_basecode,
+                    free_index, free_limit,
+                    cur_bits_in_use, next_bits_in_use,
+                    entry_used;
+    unsigned short  cur_entry, next_entry;
+    unsigned short  next[ARC_TABLE_ENTRIES],
+                    basecode[ARC_TABLE_ENTRIES],
+                    hash[ARC_TABLE_ENTRIES];
+    unsigned char   ch[ARC_TABLE_ENTRIES];
+} ArcCheckpoint;
+
+// Checkpoints for compress_checkpointed. list[i] is taken after
+// (i + 1) * interval bytes of source, so it needs room for
+// (size - 1) / interval of them.
+typedef struct _ArcCheckpoints
+{
+    long                 interval;          // source bytes between checkpoints
+    long                 count;             // leading entries of list that are valid
+    int                  compression_type;  // type of stream they belong to
+    ArcCheckpoint       *list;
+    const unsigned char *prefix;            // stream the checkpoints were taken from
+} ArcCheckpoints;
+
+long compress_checkpointed(unsigned char *src, long size, long chunk_size,
+        ArcChunkSink sink, void *user_data, ArcCheckpoints *checkpoints);
+
+// Fills buf with the len bytes of source at offset. Returns 0 on error.
+typedef int (*ArcSourceFn)(void *user_data, unsigned char *buf, long len, long offset);
+
+long compress_streamed(long size, long chunk_size, ArcSourceFn source,
+        void *src_data, ArcChunkSink sink, void *user_data);
+
+// Decoder state at a byte of expanded data. For the decoder state.src_pos
+// counts bits of stream and state.dst_pos bytes expanded.
+typedef struct _ArcExpandCheckpoint
+{
+    ArcCheckpoint   state;
+    unsigned int    last_ch;
+    unsigned int    stk_len;                    // bytes of the current string still to output
+    unsigned char   stk[ARC_TABLE_ENTRIES];
+} ArcExpandCheckpoint;
+
+// Checkpoints for decompress_indexed. list[i] is taken after
+// (i + 1) * interval bytes of expanded data, so it needs room for
+// (expanded_size - 1) / interval of them.
+typedef struct _ArcExpandIndex
+{
+    long                 interval;  // expanded bytes between checkpoints
+    long                 count;     // leading entries of list that are valid
+    ArcExpandCheckpoint *list;
+} ArcExpandIndex;
+
+long decompress_chunked(unsigned char *compressed, long compressed_size, long chunk_size,
+        ArcExpandSink sink, void *user_data);
+long decompress_indexed(unsigned char *compressed, long compressed_size, long chunk_size,
+        ArcExpandSink sink, void *user_data, ArcExpandIndex *index);
+long decompress_range(unsigned char *compressed, long compressed_size,
+        const ArcExpandCheckpoint *from, long end, long chunk_size,
+        ArcExpandSink sink, void *user_data);
+
+// Reads up to len bytes of stream into buf. Returns how many, 0 at the end
+// of the stream or -1 on error.
+typedef long (*ArcReadFn)(void *user_data, unsigned char *buf, long len);
+
+long decompress_streamed(ArcReadFn reader, void *read_data, long chunk_size,
+        ArcExpandSink sink, void *user_data, long *expanded_size);
+
+// Checks a stream against the data it should expand to while the stream is
+// still being produced, a piece at a time
+typedef struct _ArcVerify ArcVerify;
+
+ArcVerify *decompress_verify_new(const unsigned char *expected, long size);
+int  decompress_verify_feed(ArcVerify *v, const unsigned char *stream, long len);
+int  decompress_verify_finish(ArcVerify *v, const unsigned char *stream, long len);
+void decompress_verify_free(ArcVerify *v);
+
+void compression_stats_reset(void);
+int  compression_stats_get(CompressionStats *stats);
 #endif /*__COMPRESSION_H__*/
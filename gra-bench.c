@@ -0,0 +1,527 @@
+/*
+ * gra-bench.c   Microbenchmarks of the codec's hot primitives.
+ *
+ * Times each primitive on its own, on fixed inputs, so that a slowdown can
+ * be pinned on one of them instead of only showing end to end:
+ *
+ *   bfield-ext         BFieldExtU32, reading 9 to 12-bit codes off a stream
+ *   bfield-or          BFieldOrU32, writing them
+ *   entry-growing      ArcEntryGet while the string table still has room
+ *   entry-full         ArcEntryGet once the table is full and entries are
+ *                      recycled, each followed by the encoder's insert
+ *   chain-walk         the encoder's walk of hash[] chains for a match
+ *   compression-type   ArcDetermineCompressionType on 7-bit data, which it
+ *                      reads to the end
+ *   expand-indexed     gra_expand_indexed, GRA bytes to index alone
+ *   expand-indexeda    gra_expand_indexeda, GRA bytes to index and alpha
+ *   expand-rgba        gra_expand_rgba, GRA bytes to RGBA
+ *   pack-indexeda      gra_pack_indexeda, index and alpha to GRA bytes
+ *
+ * Each kernel is run RUNS times and the best run is reported per unit of
+ * work (a byte, or a call of ArcEntryGet): cycles, instructions, branch
+ * misses and L1 data cache read misses from perf_event_open, and the
+ * wall-clock time. Where the counters can't be opened (perf_event_paranoid,
+ * a VM without a PMU, not Linux) only the time is given.
+ *
+ *   gra-bench [-r RUNS] [KERNEL...]
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#define BENCH_PERF
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "gra-expand.h"
+#include "gra-format.h"
+
+// The string table and hash[] are the codec's internals, so it is built in
+// rather than linked, the way reference/compression-ref.c builds the
+// reference
+#include "compression.c"
+#pragma pack()
+
+#define BENCH_BYTES         (1 << 22)   // of each byte-oriented input
+#define BENCH_CODES         (1 << 20)   // codes written and read by the bit field kernels
+#define BENCH_GROW_ROUNDS   256         // times the table is grown from empty to full a run
+#define BENCH_FULL_CALLS    (1 << 18)   // ArcEntryGet calls a run on a full table
+#define BENCH_RUNS          5
+
+enum
+{
+    BENCH_CYCLES,
+    BENCH_INSTRUCTIONS,
+    BENCH_BRANCH_MISSES,
+    BENCH_L1D_MISSES,
+    BENCH_N_COUNTERS
+};
+
+typedef struct
+{
+    double              ns;
+    unsigned long long  counts[BENCH_N_COUNTERS];
+} BenchSample;
+
+typedef struct
+{
+    const char *name;
+    const char *unit;               // what the work is counted in
+    void      (*prepare)(void);     // untimed, before every run
+    long      (*run)(void);         // returns the units of work done
+} BenchKernel;
+
+static const char *counter_names[BENCH_N_COUNTERS] = {
+    "cycles", "instr", "br-miss", "L1d-miss"
+};
+
+static int                  counter_fds[BENCH_N_COUNTERS];  // -1 where not available
+static unsigned long long   rng_state = 1;
+static volatile DWORD       bench_sink;     // keeps results alive
+
+// Fixed inputs, made once
+static BYTE        *sprite;         // GRA bytes like a drawing's
+static BYTE        *text7;          // 7-bit bytes
+static BYTE        *pairs;          // sprite as index and alpha pairs
+static BYTE        *out;            // 4 bytes a pixel of room for the expand kernels
+static BYTE        *stream, *stream_out;
+static BYTE        *widths;         // of each code in stream
+static long         stream_bytes;
+static BYTE         remap[256];
+
+// String tables: one as ArcCtrlNew leaves it, and one full one with a copy
+// to start every run from
+static CArcCtrl    *grow_ctrl, grow_start;
+static CArcCtrl    *full_ctrl, *full_start;
+static WORD        *full_rungs;
+static const size_t rung_bytes = (sizeof(WORD) * 256) << ARC_MAX_BITS;
+
+static unsigned int rng            (void);
+static double       now_ns         (void);
+static void         counters_open  (void);
+static void         measure_start  (void);
+static void         measure_stop   (BenchSample *sample);
+static void         inputs_init    (void);
+static void         prepare_none   (void);
+static void         prepare_full   (void);
+static void         prepare_stream_out (void);
+static long         run_bfield_ext (void);
+static long         run_bfield_or  (void);
+static long         run_entry_growing (void);
+static long         run_entry_full (void);
+static long         run_chain_walk (void);
+static long         run_compression_type (void);
+static long         run_expand_indexed (void);
+static long         run_expand_indexeda (void);
+static long         run_expand_rgba (void);
+static long         run_pack_indexeda (void);
+static void         bench          (const BenchKernel *kernel, int runs);
+static void         usage          (void);
+
+static const BenchKernel kernels[] = {
+    { "bfield-ext",       "byte", prepare_none,       run_bfield_ext },
+    { "bfield-or",        "byte", prepare_stream_out, run_bfield_or },
+    { "entry-growing",    "call", prepare_none,       run_entry_growing },
+    { "entry-full",       "call", prepare_full,       run_entry_full },
+    { "chain-walk",       "byte", prepare_full,       run_chain_walk },
+    { "compression-type", "byte", prepare_none,       run_compression_type },
+    { "expand-indexed",   "byte", prepare_none,       run_expand_indexed },
+    { "expand-indexeda",  "byte", prepare_none,       run_expand_indexeda },
+    { "expand-rgba",      "byte", prepare_none,       run_expand_rgba },
+    { "pack-indexeda",    "byte", prepare_none,       run_pack_indexeda },
+};
+
+#define N_KERNELS   ((long)(sizeof(kernels) / sizeof(kernels[0])))
+
+// xorshift64*, so the inputs are the same every time
+static unsigned int rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned int)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Opens what counters it can for this thread, user space only
+static void counters_open(void)
+{
+#ifdef BENCH_PERF
+    static const struct
+    {
+        unsigned int        type;
+        unsigned long long  config;
+    } events[BENCH_N_COUNTERS] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+            PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+    };
+    struct perf_event_attr  attr;
+    int                     i, saved = 0, opened = 0;
+
+    for (i = 0; i < BENCH_N_COUNTERS; i++){
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counter_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counter_fds[i] >= 0)
+            opened++;
+        else if (!saved)
+            saved = errno;
+    }
+    if (!opened)
+        fprintf(stderr, "gra-bench: no performance counters (%s), timing only\n",
+                strerror(saved));
+#else
+    int i;
+
+    for (i = 0; i < BENCH_N_COUNTERS; i++)
+        counter_fds[i] = -1;
+    fprintf(stderr, "gra-bench: no performance counters on this system, timing only\n");
+#endif
+}
+
+static double measure_t0;
+
+static void measure_start(void)
+{
+#ifdef BENCH_PERF
+    int i;
+
+    for (i = 0; i < BENCH_N_COUNTERS; i++){
+        if (counter_fds[i] >= 0){
+            ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+    measure_t0 = now_ns();
+}
+
+static void measure_stop(BenchSample *sample)
+{
+    int i;
+
+    sample->ns = now_ns() - measure_t0;
+    for (i = 0; i < BENCH_N_COUNTERS; i++){
+        sample->counts[i] = 0;
+#ifdef BENCH_PERF
+        if (counter_fds[i] >= 0){
+            ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(counter_fds[i], &sample->counts[i], sizeof(sample->counts[i])) !=
+                    sizeof(sample->counts[i]))
+                sample->counts[i] = 0;
+        }
+#endif
+    }
+}
+
+static void inputs_init(void)
+{
+    CArcCtrl   *c;
+    BYTE        pixel = 0;
+    long        i, pos;
+
+    // Like the pixels of a drawing: runs of a few colours, some transparent
+    sprite = malloc(BENCH_BYTES);
+    text7 = malloc(BENCH_BYTES);
+    for (i = 0; i < BENCH_BYTES; i++){
+        if (rng() % 24 == 0)
+            pixel = (rng() % 16) | (rng() % 8 == 0 ? (rng() % 16) << 4 : 0);
+        sprite[i] = pixel;
+        text7[i] = pixel & 0x7F;
+    }
+    pairs = malloc(2 * BENCH_BYTES);
+    gra_expand_indexeda(pairs, sprite, BENCH_BYTES);
+    out = malloc(4 * BENCH_BYTES);
+    for (i = 0; i < 256; i++)
+        remap[i] = i & 0x0F;
+
+    // Codes of the widths the encoder uses, packed as it packs them
+    widths = malloc(BENCH_CODES);
+    stream_bytes = BENCH_CODES * ARC_MAX_BITS / 8 + 4;
+    stream = calloc(stream_bytes, 1);
+    stream_out = calloc(stream_bytes, 1);
+    for (i = pos = 0; i < BENCH_CODES; i++){
+        widths[i] = 9 + rng() % (ARC_MAX_BITS - 8);
+        BFieldOrU32(stream, pos, rng() & ((1 << widths[i]) - 1));
+        pos += widths[i];
+    }
+
+    grow_ctrl = ArcCtrlNew(FALSE, CT_8_BIT);
+    grow_start = *grow_ctrl;
+
+    // The table the encoder has after the sprite, by far enough to be full
+    c = full_ctrl = ArcCtrlNew(FALSE, CT_8_BIT);
+    c->src_buf = sprite;
+    c->src_size = BENCH_BYTES;
+    c->dst_size = (BENCH_BYTES + sizeof(CArcCompress)) << 3;
+    c->dst_buf = calloc((c->dst_size >> 3) + 4, 1);
+    ArcCompressBuf(c);
+    free(c->dst_buf);
+    c->dst_buf = NULL;
+    full_start = malloc(sizeof(CArcCtrl));
+    *full_start = *c;
+    full_rungs = malloc(rung_bytes);
+    memcpy(full_rungs, c->run_rung, rung_bytes);
+}
+
+static void prepare_none(void)
+{
+}
+
+// The table's pointers are into full_ctrl itself, so it's copied back over it
+static void prepare_full(void)
+{
+    WORD *rungs = full_ctrl->run_rung;
+
+    *full_ctrl = *full_start;
+    full_ctrl->run_rung = rungs;
+    memcpy(rungs, full_rungs, rung_bytes);
+}
+
+static void prepare_stream_out(void)
+{
+    memset(stream_out, 0, stream_bytes);
+}
+
+static long run_bfield_ext(void)
+{
+    DWORD   sum = 0;
+    long    i, pos = 0;
+
+    for (i = 0; i < BENCH_CODES; i++){
+        sum += BFieldExtU32(stream, pos, widths[i]);
+        pos += widths[i];
+    }
+    bench_sink = sum;
+    return pos >> 3;
+}
+
+static long run_bfield_or(void)
+{
+    long    i, pos = 0;
+
+    for (i = 0; i < BENCH_CODES; i++){
+        BFieldOrU32(stream_out, pos, i & ((1 << widths[i]) - 1));
+        pos += widths[i];
+    }
+    return pos >> 3;
+}
+
+static long run_entry_growing(void)
+{
+    CArcCtrl   *c = grow_ctrl;
+    long        calls = 0;
+    int         round;
+
+    for (round = 0; round < BENCH_GROW_ROUNDS; round++){
+        // Growing only moves the free index on, never touching the table
+        c->cur_entry = grow_start.cur_entry;
+        c->next_entry = grow_start.next_entry;
+        c->cur_bits_in_use = grow_start.cur_bits_in_use;
+        c->next_bits_in_use = grow_start.next_bits_in_use;
+        c->free_index = grow_start.free_index;
+        c->free_limit = grow_start.free_limit;
+        while (c->next_bits_in_use < ARC_MAX_BITS){
+            c->entry_used = TRUE;
+            ArcEntryGet(c);
+            calls++;
+        }
+    }
+    bench_sink = c->free_index;
+    return calls;
+}
+
+static long run_entry_full(void)
+{
+    CArcCtrl   *c = full_ctrl;
+    CArcEntry  *temp, *temp1;
+    long        i;
+
+    for (i = 0; i < BENCH_FULL_CALLS; i++){
+        c->entry_used = TRUE;
+        ArcEntryGet(c);
+
+        // The encoder's insert, of the string the entry held before it was
+        // recycled, so the table keeps the shape the sprite gave it
+        temp = c->cur_entry;
+        temp1 = (CArcEntry *)&c->hash[temp->basecode];
+        temp->next = temp1->next;
+        temp1->next = temp;
+        ArcRunAdd(c, temp->basecode, temp->ch, temp);
+    }
+    bench_sink = c->free_index;
+    return BENCH_FULL_CALLS;
+}
+
+// ArcCompressBuf's search without its inserts and output
+static long run_chain_walk(void)
+{
+    CArcCtrl   *c = full_ctrl;
+    CArcEntry  *temp;
+    DWORD       basecode = sprite[0], ch;
+    long        i;
+
+    for (i = 1; i < BENCH_BYTES; i++){
+        ch = sprite[i];
+        for (temp = c->hash[basecode]; temp; temp = temp->next)
+            if (temp->ch == ch)
+                break;
+        basecode = temp ? (DWORD)(temp - c->compress) : ch;
+    }
+    bench_sink = basecode;
+    return BENCH_BYTES;
+}
+
+static long run_compression_type(void)
+{
+    bench_sink = ArcDetermineCompressionType(text7, BENCH_BYTES);
+    return BENCH_BYTES;
+}
+
+static long run_expand_indexed(void)
+{
+    bench_sink = gra_expand_indexed(out, sprite, BENCH_BYTES);
+    return BENCH_BYTES;
+}
+
+static long run_expand_indexeda(void)
+{
+    gra_expand_indexeda(out, sprite, BENCH_BYTES);
+    return BENCH_BYTES;
+}
+
+static long run_expand_rgba(void)
+{
+    gra_expand_rgba(out, sprite, BENCH_BYTES, gra_templeos_colors);
+    return BENCH_BYTES;
+}
+
+static long run_pack_indexeda(void)
+{
+    gra_pack_indexeda(out, pairs, BENCH_BYTES, remap);
+    return BENCH_BYTES;
+}
+
+// Runs kernel runs times and prints its best per unit
+static void bench(const BenchKernel *kernel, int runs)
+{
+    BenchSample sample, best = { 0 };
+    long        units = 1;
+    int         i, run;
+
+    for (run = 0; run < runs; run++){
+        kernel->prepare();
+        measure_start();
+        units = kernel->run();
+        measure_stop(&sample);
+        if (!run)
+            best = sample;
+        if (sample.ns < best.ns)
+            best.ns = sample.ns;
+        for (i = 0; i < BENCH_N_COUNTERS; i++)
+            if (sample.counts[i] < best.counts[i])
+                best.counts[i] = sample.counts[i];
+    }
+
+    printf("%-18s %-5s %9.3f", kernel->name, kernel->unit, best.ns / units);
+    for (i = 0; i < BENCH_N_COUNTERS; i++){
+        if (counter_fds[i] < 0)
+            printf(" %9s", "-");
+        else if (i >= BENCH_BRANCH_MISSES)
+            printf(" %9.4f", (double)best.counts[i] / units);
+        else
+            printf(" %9.3f", (double)best.counts[i] / units);
+    }
+    printf("\n");
+}
+
+static void usage(void)
+{
+    long i;
+
+    fprintf(stderr, "Usage: gra-bench [-r RUNS] [KERNEL...]\nKernels:");
+    for (i = 0; i < N_KERNELS; i++)
+        fprintf(stderr, " %s", kernels[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    int     runs = BENCH_RUNS, first, i, j, matched;
+    long    k;
+
+    for (first = 1; first < argc && argv[first][0] == '-'; first += 2){
+        if (first + 1 < argc && strcmp(argv[first], "-r") == 0)
+            runs = atoi(argv[first + 1]);
+        else {
+            usage();
+            return 2;
+        }
+    }
+    if (runs < 1){
+        usage();
+        return 2;
+    }
+    for (i = first; i < argc; i++){
+        for (k = 0; k < N_KERNELS && strcmp(argv[i], kernels[k].name) != 0; k++)
+            ;
+        if (k == N_KERNELS){
+            usage();
+            return 2;
+        }
+    }
+
+    counters_open();
+    inputs_init();
+
+    printf("%-18s %-5s %9s", "kernel", "per", "ns");
+    for (j = 0; j < BENCH_N_COUNTERS; j++)
+        printf(" %9s", counter_names[j]);
+    printf("\n");
+    for (k = 0; k < N_KERNELS; k++){
+        matched = first == argc;
+        for (i = first; i < argc && !matched; i++)
+            matched = strcmp(argv[i], kernels[k].name) == 0;
+        if (matched)
+            bench(&kernels[k], runs);
+    }
+    return 0;
+}
@@ -0,0 +1,399 @@
+/*
+ * gra-cache.c   Keeps codec checkpoints between saves and loads of a file.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "gra-cache.h"
+#include "gra-format.h"
+
+#define GRA_CACHE_DIR       "gimp-gra"
+#define GRA_CACHE_MAGIC     "GRACKPT3"
+#define GRA_INDEX_MAGIC     "GRAINDX3"
+#define GRA_INDEX_SUFFIX    ".idx"
+
+// Start of a cache file. In a save cache it is followed by n_bands band
+// hashes and then n_checkpoints ArcCheckpoints, in a load index by
+// n_checkpoints ArcExpandCheckpoints. Checkpoints are stored as they are in
+// memory, so a cache is only read back by the same build on the same kind
+// of machine; checkpoint_size catches most mismatches.
+typedef struct _GraCacheHeader
+{
+    gchar    magic[8];
+    gint32   width, height;
+    gint32   band_rows;
+    gint32   checkpoint_size;
+    gint32   n_checkpoints;
+    gint32   compression_type;
+    gint32   opaque;            // load index: no pixel of the image is transparent
+    gint64   file_size, file_mtime, file_ino;  // GRA the checkpoints belong to
+    gint64   file_mtime_nsec;   // so a rewrite within the same second is noticed
+} GraCacheHeader;
+
+static guint64  hash_band          (const guchar          *p,
+                                    gsize                  n);
+static gchar   *cache_path         (const gchar           *filename,
+                                    const gchar           *suffix);
+static void     cache_header_init  (GraCacheHeader        *cached,
+                                    const gchar           *magic,
+                                    gint                   width,
+                                    gint                   height,
+                                    gint                   band_rows,
+                                    gint                   checkpoint_size,
+                                    const struct stat     *st);
+static FILE    *cache_open         (const gchar           *filename,
+                                    const gchar           *suffix,
+                                    const GraCacheHeader  *expected,
+                                    GraCacheHeader        *cached);
+static void     cache_write        (const gchar           *filename,
+                                    const gchar           *suffix,
+                                    const GraCacheHeader  *cached,
+                                    const void            *data1,
+                                    gsize                  size1,
+                                    const void            *data2,
+                                    gsize                  size2);
+
+static guint64
+hash_band (const guchar *p, gsize n)
+{
+    guint64  h = 0xcbf29ce484222325ull ^ n;
+    guint64  w;
+    gsize    i;
+
+    for (i = 0; i + 8 <= n; i += 8){
+        memcpy (&w, p + i, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 32;
+    }
+    for (; i < n; i++)
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    return h;
+}
+
+// Cache files are named after a hash of the GRA's full path
+static gchar *
+cache_path (const gchar *filename, const gchar *suffix)
+{
+    gchar *absolute, *hash, *name, *path;
+
+    if (g_path_is_absolute (filename)){
+        absolute = g_strdup (filename);
+    } else {
+        gchar *cwd = g_get_current_dir ();
+
+        absolute = g_build_filename (cwd, filename, NULL);
+        g_free (cwd);
+    }
+    hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, absolute, -1);
+    name = g_strconcat (hash, suffix, NULL);
+    path = g_build_filename (g_get_user_cache_dir (), GRA_CACHE_DIR, name, NULL);
+    g_free (name);
+    g_free (hash);
+    g_free (absolute);
+    return path;
+}
+
+// Describes a cache for an image of width x height stored in the file st is for
+static void
+cache_header_init (GraCacheHeader *cached, const gchar *magic, gint width,
+        gint height, gint band_rows, gint checkpoint_size, const struct stat *st)
+{
+    memset (cached, 0, sizeof (*cached));
+    memcpy (cached->magic, magic, sizeof (cached->magic));
+    cached->width = width;
+    cached->height = height;
+    cached->band_rows = band_rows;
+    cached->checkpoint_size = checkpoint_size;
+    cached->file_size = st->st_size;
+    cached->file_mtime = st->st_mtim.tv_sec;
+    cached->file_mtime_nsec = st->st_mtim.tv_nsec;
+    cached->file_ino = st->st_ino;
+}
+
+// Opens the cache for filename if it matches expected in all but its
+// n_checkpoints, compression_type and opaque, and leaves it positioned after the
+// header, which is returned in cached
+static FILE *
+cache_open (const gchar *filename, const gchar *suffix,
+        const GraCacheHeader *expected, GraCacheHeader *cached)
+{
+    gchar *path = cache_path (filename, suffix);
+    FILE  *file = g_fopen (path, "rb");
+
+    g_free (path);
+    if (file &&
+            (fread (cached, sizeof (*cached), 1, file) != 1 ||
+             memcmp (cached->magic, expected->magic, sizeof (cached->magic)) != 0 ||
+             cached->width != expected->width || cached->height != expected->height ||
+             cached->band_rows != expected->band_rows ||
+             cached->checkpoint_size != expected->checkpoint_size ||
+             cached->file_size != expected->file_size ||
+             cached->file_mtime != expected->file_mtime ||
+             cached->file_mtime_nsec != expected->file_mtime_nsec ||
+             cached->file_ino != expected->file_ino)){
+        fclose (file);
+        file = NULL;
+    }
+    return file;
+}
+
+// Replaces the cache for filename in one go, like the GRA itself. The
+// cache is only an optimisation, so failing to write it is not an error;
+// it is just removed.
+static void
+cache_write (const gchar *filename, const gchar *suffix,
+        const GraCacheHeader *cached, const void *data1, gsize size1,
+        const void *data2, gsize size2)
+{
+    gchar     *path, *dir, *temp_name;
+    FILE      *file;
+    gint       fd;
+    gboolean   ok;
+
+    path = cache_path (filename, suffix);
+    dir = g_path_get_dirname (path);
+    g_mkdir_with_parents (dir, 0700);
+    g_free (dir);
+
+    temp_name = g_strdup_printf ("%s.XXXXXX", path);
+    fd = g_mkstemp (temp_name);
+    file = fd != -1 ? fdopen (fd, "wb") : NULL;
+    ok = file &&
+        fwrite (cached, sizeof (*cached), 1, file) == 1 &&
+        fwrite (data1, 1, size1, file) == size1 &&
+        fwrite (data2, 1, size2, file) == size2;
+    if (file)
+        ok = fclose (file) == 0 && ok;
+    else if (fd != -1)
+        close (fd);
+    if (!ok || g_rename (temp_name, path) != 0){
+        if (fd != -1)
+            g_unlink (temp_name);
+        g_unlink (path);
+    }
+    g_free (temp_name);
+    g_free (path);
+}
+
+// Hashes the bands of pixels, the packed GRA bytes about to be encoded
+GraSaveCache *
+gra_save_cache_new (const guchar *pixels, gint width, gint height)
+{
+    GraSaveCache *cache = g_new0 (GraSaveCache, 1);
+    gint          band, rows;
+
+    cache->width = width;
+    cache->height = height;
+    cache->n_bands = (height + GRA_CACHE_BAND_ROWS - 1) / GRA_CACHE_BAND_ROWS;
+    cache->band_hashes = g_new (guint64, cache->n_bands);
+    for (band = 0; band < cache->n_bands; band++){
+        rows = MIN (GRA_CACHE_BAND_ROWS, height - band * GRA_CACHE_BAND_ROWS);
+        cache->band_hashes[band] = hash_band (
+                pixels + (gsize)band * GRA_CACHE_BAND_ROWS * width,
+                (gsize)rows * width);
+    }
+
+    cache->checkpoints.interval = (long)width * GRA_CACHE_BAND_ROWS;
+    if (cache->n_bands > 1)
+        cache->checkpoints.list = g_new (ArcCheckpoint, cache->n_bands - 1);
+    return cache;
+}
+
+// Looks for checkpoints from the last save of filename, which header is
+// about to replace. They are only used if filename is still the file they
+// were taken from, and only up to the first band that changed since. Sets
+// cache->checkpoints up for compress_checkpointed and returns the number of
+// bands that won't need encoding again.
+gint
+gra_save_cache_load (GraSaveCache *cache, const gchar *filename,
+        const gint *header)
+{
+    GraCacheHeader  expected, cached;
+    struct stat     st;
+    FILE           *file = NULL;
+    guint64        *hashes = NULL;
+    gint            old_header[4];
+    gint            usable = 0;
+    gsize           prefix_size;
+
+    cache->checkpoints.count = 0;
+    if (cache->n_bands < 2 || g_stat (filename, &st) != 0 ||
+            !S_ISREG (st.st_mode))
+        return 0;
+
+    cache_header_init (&expected, GRA_CACHE_MAGIC, cache->width, cache->height,
+            GRA_CACHE_BAND_ROWS, sizeof (ArcCheckpoint), &st);
+    file = cache_open (filename, "", &expected, &cached);
+    if (!file || cached.n_checkpoints < 0 || cached.n_checkpoints >= cache->n_bands)
+        goto out;
+
+    // Bands before the first changed one encode the same as last time
+    hashes = g_new (guint64, cache->n_bands);
+    if (fread (hashes, sizeof (guint64), cache->n_bands, file) != (gsize)cache->n_bands)
+        goto out;
+    while (usable < cached.n_checkpoints && hashes[usable] == cache->band_hashes[usable])
+        usable++;
+    if (!usable ||
+            fread (cache->checkpoints.list, sizeof (ArcCheckpoint), usable, file) != (gsize)usable)
+        goto out;
+    fclose (file);
+
+    // The stream up to the checkpoint, and the partial byte it ends in, come
+    // from the old file
+    prefix_size = (cache->checkpoints.list[usable - 1].dst_pos >> 3) + 1;
+    cache->prefix = g_new (guchar, prefix_size);
+    file = g_fopen (filename, "rb");
+    if (!file ||
+            fread (old_header, GRA_HEADER_SIZE, 1, file) != 1 ||
+            memcmp (old_header, header, GRA_HEADER_SIZE) != 0 ||
+            fseek (file, GRA_BODY_OFFSET (header[3]), SEEK_SET) != 0 ||
+            fread (cache->prefix, prefix_size, 1, file) != 1){
+        usable = 0;
+        goto out;
+    }
+
+    cache->checkpoints.count = usable;
+    cache->checkpoints.compression_type = cached.compression_type;
+    cache->checkpoints.prefix = cache->prefix;
+
+out:
+    if (file)
+        fclose (file);
+    g_free (hashes);
+    return cache->checkpoints.count;
+}
+
+// Records the checkpoints compress_checkpointed left in cache for the file
+// just saved as filename
+void
+gra_save_cache_store (GraSaveCache *cache, const gchar *filename)
+{
+    GraCacheHeader  cached;
+    struct stat     st;
+    gchar          *path;
+
+    // Any load index belongs to the file that was just replaced
+    path = cache_path (filename, GRA_INDEX_SUFFIX);
+    g_unlink (path);
+    g_free (path);
+
+    if (!cache->checkpoints.count || g_stat (filename, &st) != 0 ||
+            !S_ISREG (st.st_mode)){
+        path = cache_path (filename, "");
+        g_unlink (path);
+        g_free (path);
+        return;
+    }
+
+    cache_header_init (&cached, GRA_CACHE_MAGIC, cache->width, cache->height,
+            GRA_CACHE_BAND_ROWS, sizeof (ArcCheckpoint), &st);
+    cached.n_checkpoints = cache->checkpoints.count;
+    cached.compression_type = cache->checkpoints.compression_type;
+    cache_write (filename, "", &cached,
+            cache->band_hashes, sizeof (guint64) * cache->n_bands,
+            cache->checkpoints.list, sizeof (ArcCheckpoint) * cached.n_checkpoints);
+}
+
+void
+gra_save_cache_free (GraSaveCache *cache)
+{
+    g_free (cache->band_hashes);
+    g_free (cache->checkpoints.list);
+    g_free (cache->prefix);
+    g_free (cache);
+}
+
+// Room for the decoder checkpoints of an image of height rows of stride
+// bytes each once expanded, one every GRA_INDEX_ROWS rows
+ArcExpandIndex *
+gra_index_new (gint stride, gint height)
+{
+    ArcExpandIndex *index = g_new0 (ArcExpandIndex, 1);
+    gint            n = (height - 1) / GRA_INDEX_ROWS;
+
+    index->interval = (long)stride * GRA_INDEX_ROWS;
+    if (n > 0)
+        index->list = g_new (ArcExpandCheckpoint, n);
+    return index;
+}
+
+// Reads the index built by an earlier load of filename, if filename hasn't
+// changed since, and whether that load found the image fully opaque.
+// Returns FALSE, with index->count 0, if there is none.
+gboolean
+gra_index_load (ArcExpandIndex *index, const gchar *filename, gint width,
+        gint height, gboolean *opaque)
+{
+    GraCacheHeader  expected, cached;
+    struct stat     st;
+    FILE           *file;
+
+    index->count = 0;
+    // A pipe has new contents each time, so only regular files are indexed
+    if (height <= GRA_INDEX_ROWS || g_stat (filename, &st) != 0 ||
+            !S_ISREG (st.st_mode))
+        return FALSE;
+
+    cache_header_init (&expected, GRA_INDEX_MAGIC, width, height,
+            GRA_INDEX_ROWS, sizeof (ArcExpandCheckpoint), &st);
+    file = cache_open (filename, GRA_INDEX_SUFFIX, &expected, &cached);
+    if (!file)
+        return FALSE;
+    if (cached.n_checkpoints == (height - 1) / GRA_INDEX_ROWS &&
+            fread (index->list, sizeof (ArcExpandCheckpoint), cached.n_checkpoints,
+                file) == (gsize)cached.n_checkpoints)
+        index->count = cached.n_checkpoints;
+    *opaque = cached.opaque;
+    fclose (file);
+    return index->count > 0;
+}
+
+// Records the index decompress_indexed built while loading filename, and
+// whether the image turned out to be fully opaque
+void
+gra_index_store (ArcExpandIndex *index, const gchar *filename, gint width,
+        gint height, gboolean opaque)
+{
+    GraCacheHeader  cached;
+    struct stat     st;
+
+    if (!index->count || g_stat (filename, &st) != 0 ||
+            !S_ISREG (st.st_mode))
+        return;
+
+    cache_header_init (&cached, GRA_INDEX_MAGIC, width, height,
+            GRA_INDEX_ROWS, sizeof (ArcExpandCheckpoint), &st);
+    cached.n_checkpoints = index->count;
+    cached.opaque = opaque;
+    cache_write (filename, GRA_INDEX_SUFFIX, &cached,
+            index->list, sizeof (ArcExpandCheckpoint) * index->count, NULL, 0);
+}
+
+void
+gra_index_free (ArcExpandIndex *index)
+{
+    g_free (index->list);
+    g_free (index);
+}
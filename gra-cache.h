@@ -0,0 +1,76 @@
+/*
+ * gra-cache.h   Encoder checkpoints kept between saves of the same file.
+ *
+ * Saving a GRA encodes one LZW stream from the first pixel to the last. To
+ * avoid redoing all of it when only the bottom of a large image changed,
+ * each save records a hash of every band of GRA_CACHE_BAND_ROWS rows and a
+ * checkpoint of the encoder at the end of every band, in a file under the
+ * user's cache directory. The next save of the same file resumes encoding
+ * at the first band that changed, copying the stream up to there from the
+ * existing file. The output is the same as a full encode.
+ *
+ * Loading works the other way round: the first load of a file keeps a
+ * checkpoint of the decoder every GRA_INDEX_ROWS rows in an index next to
+ * the save cache, and later loads of the unchanged file can start decoding
+ * at any of them, several bands at once. The GRA file itself is never
+ * touched.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRA_CACHE_H__
+#define __GRA_CACHE_H__
+
+#include "compression.h"
+
+#define GRA_CACHE_BAND_ROWS     256     // rows between encoder checkpoints
+#define GRA_INDEX_ROWS          256     // rows between decoder checkpoints
+
+typedef struct _GraSaveCache
+{
+    gint            width, height;
+    gint            n_bands;
+    guint64        *band_hashes;    // of the packed pixels, one per band
+    ArcCheckpoints  checkpoints;    // list[i] is taken at the end of band i
+    guchar         *prefix;         // stream read back from the old file
+} GraSaveCache;
+
+GraSaveCache *gra_save_cache_new   (const guchar  *pixels,
+                                    gint           width,
+                                    gint           height);
+gint          gra_save_cache_load  (GraSaveCache  *cache,
+                                    const gchar   *filename,
+                                    const gint    *header);
+void          gra_save_cache_store (GraSaveCache  *cache,
+                                    const gchar   *filename);
+void          gra_save_cache_free  (GraSaveCache  *cache);
+
+ArcExpandIndex *gra_index_new   (gint             stride,
+                                 gint             height);
+gboolean        gra_index_load  (ArcExpandIndex  *index,
+                                 const gchar     *filename,
+                                 gint             width,
+                                 gint             height,
+                                 gboolean        *opaque);
+void            gra_index_store (ArcExpandIndex  *index,
+                                 const gchar     *filename,
+                                 gint             width,
+                                 gint             height,
+                                 gboolean         opaque);
+void            gra_index_free  (ArcExpandIndex  *index);
+
+#endif /* __GRA_CACHE_H__ */
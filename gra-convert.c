@@ -0,0 +1,378 @@
+/*
+ * gra-convert.c   Command line companion to the GIMP plugin.
+ * Works on .GRA files directly using the same codec as the plugin, without
+ * needing GIMP.
+ *
+ *   gra-convert --stats FILE...   Print LZW codec statistics for each file
+ *   gra-convert --to-gra IN OUT   Convert a PPM or PAM image to .GRA
+ *   gra-convert --to-pam IN OUT   Convert a .GRA to an RGBA PAM image
+ *   gra-convert --watch DIR [-o OUTDIR] [-j THREADS] [-d MS]
+ *                                 Convert PPM and PAM images to .GRA as they
+ *                                 are written to DIR, until interrupted
+ *
+ * A FILE, IN or OUT of "-" is stdin or stdout. Files are only ever read or
+ * written from start to end, so they can be pipes, and conversions can be
+ * chained without going through the disk.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "compression.h"
+#include "gra-expand.h"
+#include "gra-format.h"
+#include "gra-pam.h"
+#include "gra-trace.h"
+#include "gra-watch.h"
+
+static void print_codec_stats (const char *name, const ArcCodecStats *s);
+static FILE *open_file        (const char *path, const char *mode);
+static void close_file        (FILE *fd);
+static unsigned char *read_all (FILE *fd, const char *path, long *len);
+static unsigned char *read_gra (FILE *fd, const char *path, unsigned char *sniff,
+                                long *body_size);
+static int  stats_file        (const char *path);
+static int  to_gra            (const char *in_path, const char *out_path);
+static int  to_pam            (const char *in_path, const char *out_path);
+static int  watch_main        (int argc, char **argv);
+static void usage             (void);
+
+static void print_codec_stats(const char *name, const ArcCodecStats *s)
+{
+    unsigned long codes = 0;
+    int           i;
+
+    printf("  %s:\n", name);
+    printf("    codes by width:");
+    for (i = 0; i < ARC_STATS_WIDTHS; i++){
+        if (s->codes[i]){
+            printf(" %d:%lu", i, s->codes[i]);
+            codes += s->codes[i];
+        }
+    }
+    printf("\n");
+    if (s->table_full_at < 0)
+        printf("    table full at:        never\n");
+    else
+        printf("    table full at:        byte %ld\n", s->table_full_at);
+    printf("    recycled slots:       %lu\n", s->recycled);
+    printf("    average match length: %.2f bytes\n",
+            codes ? (double)s->bytes / codes : 0.0);
+}
+
+// Opens path, or stdin or stdout for "-", reporting any error
+static FILE *open_file(const char *path, const char *mode)
+{
+    FILE *fd;
+
+    if (!strcmp(path, "-"))
+        return mode[0] == 'r' ? stdin : stdout;
+    fd = fopen(path, mode);
+    if (!fd)
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return fd;
+}
+
+static void close_file(FILE *fd)
+{
+    if (fd != stdin && fd != stdout)
+        fclose(fd);
+}
+
+// Reads fd to its end, without needing to know how long it is
+static unsigned char *read_all(FILE *fd, const char *path, long *len)
+{
+    unsigned char *buf = NULL, *grown;
+    long           size = 0;
+    size_t         n;
+
+    *len = 0;
+    do {
+        if (*len == size){
+            size = size ? size * 2 : 1 << 16;
+            grown = realloc(buf, size);
+            if (!grown){
+                fprintf(stderr, "%s: %s\n", path, strerror(ENOMEM));
+                free(buf);
+                return NULL;
+            }
+            buf = grown;
+        }
+        n = fread(buf + *len, 1, size - *len, fd);
+        *len += n;
+    } while (n);
+    if (ferror(fd)){
+        fprintf(stderr, "%s: Error reading file\n", path);
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+// Checks that fd holds a GRA and reads its body, the CArcCompress of a
+// compressed one or the pixels of one that isn't, going by the sizes in its
+// headers rather than the size of the file. sniff (GRA_SNIFF_SIZE bytes)
+// gets the headers and any palette.
+static unsigned char *read_gra(FILE *fd, const char *path, unsigned char *sniff,
+        long *body_size)
+{
+    unsigned char *body;
+    struct stat    st;
+    long           sniff_size, already;
+    GraHeader      header;
+
+    sniff_size = fread(sniff, 1, GRA_HEADER_SIZE, fd);
+    if (sniff_size == GRA_HEADER_SIZE)
+        sniff_size += fread(sniff + sniff_size, 1, gra_sniff_size(sniff) - sniff_size, fd);
+    if (ferror(fd)){
+        fprintf(stderr, "%s: Error reading header\n", path);
+        return NULL;
+    }
+    if (!gra_sniff(sniff, sniff_size,
+                fstat(fileno(fd), &st) == 0 && S_ISREG(st.st_mode) ? (long)st.st_size : -1)){
+        fprintf(stderr, "%s: Not a valid GRA image\n", path);
+        return NULL;
+    }
+    gra_header_parse(sniff, &header);
+
+    // The CArcCompress header was read with the rest
+    *body_size = gra_body_size(sniff);
+    already = header.flags & DCF_COMPRESSED ? GRA_ARC_HEADER_SIZE : 0;
+    body = (unsigned char *) malloc(*body_size);
+    if (!body){
+        fprintf(stderr, "%s: %s\n", path, strerror(ENOMEM));
+        return NULL;
+    }
+    memcpy(body, sniff + GRA_BODY_OFFSET(header.flags), already);
+    if (fread(body + already, *body_size - already, 1, fd) != 1){
+        fprintf(stderr, "%s: Error reading body bytes\n", path);
+        free(body);
+        return NULL;
+    }
+    return body;
+}
+
+// Decodes a GRA body and encodes it again, then prints what both directions
+// of the codec did with it
+static int stats_file(const char *path)
+{
+    FILE             *fd;
+    GraHeader         header;
+    long              arc_size, expanded_size;
+    unsigned char    *arc, *expanded, *compressed;
+    unsigned char     sniff[GRA_SNIFF_SIZE];
+    CompressionStats  stats;
+    int               i;
+
+    fd = open_file(path, "rb");
+    if (!fd)
+        return 1;
+    arc = read_gra(fd, path, sniff, &arc_size);
+    close_file(fd);
+    if (!arc)
+        return 1;
+    gra_header_parse(sniff, &header);
+    if (!(header.flags & DCF_COMPRESSED)){
+        fprintf(stderr, "%s: Body is not compressed\n", path);
+        free(arc);
+        return 1;
+    }
+
+    compression_stats_reset();
+    expanded_size = decompress(arc, arc_size, &expanded);
+    if (expanded_size < 0){
+        fprintf(stderr, "%s: Corrupt or truncated image data\n", path);
+        free(arc);
+        return 1;
+    }
+    compress(&compressed, expanded, expanded_size);
+    compression_stats_get(&stats);
+
+    printf("%s: %dx%d, %ld bytes compressed, %ld bytes expanded\n",
+            path, header.width, header.height, arc_size, expanded_size);
+    print_codec_stats("encode", &stats.encode);
+    print_codec_stats("decode", &stats.decode);
+    printf("  hash chain lengths:");
+    for (i = 0; i < ARC_STATS_CHAINS; i++)
+        if (stats.chain_lengths[i])
+            printf(" %d%s:%lu", i, i == ARC_STATS_CHAINS - 1 ? "+" : "",
+                    stats.chain_lengths[i]);
+    printf("\n");
+
+    free(arc);
+    free(expanded);
+    free(compressed);
+    return 0;
+}
+
+static int to_gra(const char *in_path, const char *out_path)
+{
+    FILE          *in, *out;
+    unsigned char *buf;
+    long           len;
+    int            width, height, failed;
+
+    in = open_file(in_path, "rb");
+    if (!in)
+        return 1;
+    buf = read_all(in, in_path, &len);
+    close_file(in);
+    if (!buf)
+        return 1;
+    out = open_file(out_path, "wb");
+    if (!out){
+        free(buf);
+        return 1;
+    }
+    failed = gra_pam_convert(in_path, buf, len, out, &width, &height);
+    if ((out == stdout ? fflush(out) : fclose(out)) != 0 && !failed){
+        fprintf(stderr, "%s: %s\n", out_path, strerror(errno));
+        failed = 1;
+    }
+    free(buf);
+    return failed;
+}
+
+// Writes the image with its palette applied and its transparency as alpha,
+// as the plugin loads it with GRA_LOAD_RGBA
+static int to_pam(const char *in_path, const char *out_path)
+{
+    FILE          *in, *out;
+    GraHeader      header;
+    unsigned char  sniff[GRA_SNIFF_SIZE], color_map[3 * GRA_PALETTE_COLORS];
+    unsigned char *body, *pixels, *row;
+    long           body_size, size, stride;
+    int            y, failed = 0;
+
+    in = open_file(in_path, "rb");
+    if (!in)
+        return 1;
+    body = read_gra(in, in_path, sniff, &body_size);
+    close_file(in);
+    if (!body)
+        return 1;
+    gra_header_parse(sniff, &header);
+    if (header.flags & DCF_PALETTE)
+        gra_palette_parse(sniff + GRA_HEADER_SIZE, color_map);
+    else
+        memcpy(color_map, gra_templeos_colors, sizeof(color_map));
+
+    if (header.flags & DCF_COMPRESSED){
+        size = decompress(body, body_size, &pixels);
+        free(body);
+        if (size < 0){
+            fprintf(stderr, "%s: Corrupt or truncated image data\n", in_path);
+            return 1;
+        }
+    } else {
+        pixels = body;
+        size = body_size;
+    }
+    // TempleOS pads rows to width_internal
+    stride = size / header.height;
+
+    out = open_file(out_path, "wb");
+    if (!out){
+        free(pixels);
+        return 1;
+    }
+    row = malloc((size_t)header.width * 4);
+    fprintf(out, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+            header.width, header.height);
+    for (y = 0; y < header.height && !failed; y++){
+        gra_expand_rgba(row, pixels + y * stride, header.width, color_map);
+        failed = fwrite(row, (size_t)header.width * 4, 1, out) != 1;
+    }
+    if ((out == stdout ? fflush(out) : fclose(out)) != 0)
+        failed = 1;
+    if (failed)
+        fprintf(stderr, "%s: %s\n", out_path, strerror(errno));
+    free(row);
+    free(pixels);
+    return failed;
+}
+
+// --watch DIR [-o OUTDIR] [-j THREADS] [-d MS]
+static int watch_main(int argc, char **argv)
+{
+    const char  *out_dir = NULL;
+    char        *end;
+    long         value;
+    int          i, threads = 0, debounce_ms = GRA_WATCH_DEBOUNCE;
+
+    for (i = 3; i < argc; i += 2){
+        if (i + 1 >= argc || strlen(argv[i]) != 2 || !strchr("ojd", argv[i][1]) || argv[i][0] != '-'){
+            usage();
+            return 2;
+        }
+        if (argv[i][1] == 'o'){
+            out_dir = argv[i + 1];
+            continue;
+        }
+        value = strtol(argv[i + 1], &end, 10);
+        if (*end || end == argv[i + 1] || value < 0 || value > 1000000){
+            usage();
+            return 2;
+        }
+        if (argv[i][1] == 'j')
+            threads = value;
+        else
+            debounce_ms = value;
+    }
+    return gra_watch(argv[2], out_dir, threads, debounce_ms);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: gra-convert --stats FILE...\n"
+            "       gra-convert --to-gra IN OUT\n"
+            "       gra-convert --to-pam IN OUT\n"
+            "       gra-convert --watch DIR [-o OUTDIR] [-j THREADS] [-d MS]\n");
+}
+
+int main(int argc, char **argv)
+{
+    CompressionStats stats;
+    int              i, failed = 0;
+
+    if (argc >= 3 && strcmp(argv[1], "--watch") == 0)
+        return watch_main(argc, argv);
+    if (argc == 4 && strcmp(argv[1], "--to-gra") == 0)
+        return to_gra(argv[2], argv[3]);
+    if (argc == 4 && strcmp(argv[1], "--to-pam") == 0)
+        return to_pam(argv[2], argv[3]);
+    if (argc < 3 || strcmp(argv[1], "--stats") != 0){
+        usage();
+        return 2;
+    }
+    if (!compression_stats_get(&stats)){
+        fprintf(stderr, "gra-convert was built without GRA_CODEC_STATS\n");
+        return 1;
+    }
+
+    gra_trace_init();
+    for (i = 2; i < argc; i++)
+        failed |= stats_file(argv[i]);
+    gra_trace_finish();
+    return failed;
+}
@@ -0,0 +1,246 @@
+/*
+ * gra-expand.c   Turning GRA bytes into pixels, and indexed pixels into
+ *                GRA bytes.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "gra-expand.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define GRA_EXPAND_X86
+#include <immintrin.h>
+#endif
+
+// One table per output channel, indexed by a nibble of the GRA byte: the
+// low nibble for the colour, the high one for the alpha
+typedef struct
+{
+    unsigned char r[16], g[16], b[16], a[16];
+} RgbaTables;
+
+typedef void (*RgbaKernel)(unsigned char *dest, const unsigned char *src,
+    long n, const RgbaTables *t);
+
+static void rgba_tables_init(RgbaTables *t, const unsigned char *color_map)
+{
+    unsigned char   alpha_value;
+    int             i;
+
+    for (i = 0; i < 16; i++){
+        t->r[i] = color_map[3 * i];
+        t->g[i] = color_map[3 * i + 1];
+        t->b[i] = color_map[3 * i + 2];
+        alpha_value = 0xFF - (i << 4); // GIMP's alpha scale is the opposite of TempleOS'
+        t->a[i] = alpha_value | (alpha_value >> 1);
+    }
+}
+
+static void expand_rgba_scalar(unsigned char *dest, const unsigned char *src,
+    long n, const RgbaTables *t)
+{
+    long    i;
+
+    for (i = 0; i < n; i++){
+        *dest++ = t->r[src[i] & 0x0F];
+        *dest++ = t->g[src[i] & 0x0F];
+        *dest++ = t->b[src[i] & 0x0F];
+        *dest++ = t->a[src[i] >> 4];
+    }
+}
+
+#ifdef GRA_EXPAND_X86
+
+__attribute__((target("ssse3")))
+static void expand_rgba_ssse3(unsigned char *dest, const unsigned char *src,
+    long n, const RgbaTables *t)
+{
+    __m128i lut_r = _mm_loadu_si128((const __m128i *)t->r),
+            lut_g = _mm_loadu_si128((const __m128i *)t->g),
+            lut_b = _mm_loadu_si128((const __m128i *)t->b),
+            lut_a = _mm_loadu_si128((const __m128i *)t->a),
+            nibble = _mm_set1_epi8(0x0F);
+    __m128i v, lo, hi, r, g, b, a, rg, ba;
+    long    i;
+
+    for (i = 0; i + 16 <= n; i += 16){
+        v = _mm_loadu_si128((const __m128i *)(src + i));
+        lo = _mm_and_si128(v, nibble);
+        hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+        r = _mm_shuffle_epi8(lut_r, lo);
+        g = _mm_shuffle_epi8(lut_g, lo);
+        b = _mm_shuffle_epi8(lut_b, lo);
+        a = _mm_shuffle_epi8(lut_a, hi);
+
+        // Interleave r, g, b, a into 4 byte pixels, 4 pixels a store
+        rg = _mm_unpacklo_epi8(r, g);
+        ba = _mm_unpacklo_epi8(b, a);
+        _mm_storeu_si128((__m128i *)dest,        _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i *)(dest + 16), _mm_unpackhi_epi16(rg, ba));
+        rg = _mm_unpackhi_epi8(r, g);
+        ba = _mm_unpackhi_epi8(b, a);
+        _mm_storeu_si128((__m128i *)(dest + 32), _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i *)(dest + 48), _mm_unpackhi_epi16(rg, ba));
+        dest += 64;
+    }
+    expand_rgba_scalar(dest, src + i, n - i, t);
+}
+
+__attribute__((target("avx2")))
+static void expand_rgba_avx2(unsigned char *dest, const unsigned char *src,
+    long n, const RgbaTables *t)
+{
+    // pshufb only looks within each 128-bit lane, so both lanes get a copy
+    // of the tables
+    __m256i lut_r = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t->r)),
+            lut_g = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t->g)),
+            lut_b = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t->b)),
+            lut_a = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t->a)),
+            nibble = _mm256_set1_epi8(0x0F);
+    __m256i v, lo, hi, r, g, b, a, rg, ba, p0, p1, p2, p3;
+    long    i;
+
+    for (i = 0; i + 32 <= n; i += 32){
+        v = _mm256_loadu_si256((const __m256i *)(src + i));
+        lo = _mm256_and_si256(v, nibble);
+        hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+        r = _mm256_shuffle_epi8(lut_r, lo);
+        g = _mm256_shuffle_epi8(lut_g, lo);
+        b = _mm256_shuffle_epi8(lut_b, lo);
+        a = _mm256_shuffle_epi8(lut_a, hi);
+
+        // The unpacks work per lane too: p0 holds pixels 0-3 and 16-19,
+        // p1 4-7 and 20-23, p2 8-11 and 24-27, p3 12-15 and 28-31
+        rg = _mm256_unpacklo_epi8(r, g);
+        ba = _mm256_unpacklo_epi8(b, a);
+        p0 = _mm256_unpacklo_epi16(rg, ba);
+        p1 = _mm256_unpackhi_epi16(rg, ba);
+        rg = _mm256_unpackhi_epi8(r, g);
+        ba = _mm256_unpackhi_epi8(b, a);
+        p2 = _mm256_unpacklo_epi16(rg, ba);
+        p3 = _mm256_unpackhi_epi16(rg, ba);
+        _mm256_storeu_si256((__m256i *)dest,        _mm256_permute2x128_si256(p0, p1, 0x20));
+        _mm256_storeu_si256((__m256i *)(dest + 32), _mm256_permute2x128_si256(p2, p3, 0x20));
+        _mm256_storeu_si256((__m256i *)(dest + 64), _mm256_permute2x128_si256(p0, p1, 0x31));
+        _mm256_storeu_si256((__m256i *)(dest + 96), _mm256_permute2x128_si256(p2, p3, 0x31));
+        dest += 128;
+    }
+    expand_rgba_ssse3(dest, src + i, n - i, t);
+}
+
+#endif
+
+static RgbaKernel   rgba_kernel;
+static const char  *rgba_kernel_name;
+
+static void rgba_kernel_pick(void)
+{
+    RgbaKernel  kernel = expand_rgba_scalar;
+    const char *name = "scalar";
+
+#ifdef GRA_EXPAND_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        kernel = expand_rgba_avx2;
+        name = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")){
+        kernel = expand_rgba_ssse3;
+        name = "ssse3";
+    }
+#endif
+    // Racing threads all pick the same one, so no need for a lock
+    __atomic_store_n(&rgba_kernel_name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&rgba_kernel, kernel, __ATOMIC_RELEASE);
+}
+
+void gra_expand_rgba(unsigned char *dest, const unsigned char *src, long n,
+    const unsigned char *color_map)
+{
+    RgbaTables  t;
+    RgbaKernel  kernel;
+
+    kernel = __atomic_load_n(&rgba_kernel, __ATOMIC_ACQUIRE);
+    if (!kernel){
+        rgba_kernel_pick();
+        kernel = rgba_kernel;
+    }
+    rgba_tables_init(&t, color_map);
+    kernel(dest, src, n, &t);
+}
+
+const char *gra_expand_rgba_kernel(void)
+{
+    if (!__atomic_load_n(&rgba_kernel, __ATOMIC_ACQUIRE))
+        rgba_kernel_pick();
+    return __atomic_load_n(&rgba_kernel_name, __ATOMIC_RELAXED);
+}
+
+void gra_expand_indexeda(unsigned char *dest, const unsigned char *src, long n)
+{
+    unsigned char   alpha_value;
+    long            i;
+
+    for (i = 0; i < n; i++){
+        // Set first byte to the colour
+        *dest++ = src[i] & 0x0F;
+
+        // Get the alpha value, scale it to a fraction out of 256, set this as the second byte
+        alpha_value = 0xFF - (src[i] & 0xF0); // GIMP's alpha scale is the opposite of TempleOS'
+        *dest++ = alpha_value | (alpha_value >> 1);
+    }
+}
+
+// Eight pixels at a time in a 64-bit word. The alpha nibbles are ORed
+// together as the indexes are written rather than checked in a pass of
+// their own.
+int gra_expand_indexed(unsigned char *dest, const unsigned char *src, long n)
+{
+    uint64_t        word, seen = 0;
+    long            i;
+
+    for (i = 0; i + 8 <= n; i += 8){
+        memcpy(&word, src + i, 8);
+        seen |= word;
+        word &= 0x0F0F0F0F0F0F0F0FULL;
+        memcpy(dest + i, &word, 8);
+    }
+    for (; i < n; i++){
+        seen |= src[i];
+        dest[i] = src[i] & 0x0F;
+    }
+    return (seen & 0xF0F0F0F0F0F0F0F0ULL) != 0;
+}
+
+void gra_pack_indexeda(unsigned char *dest, const unsigned char *src, long n,
+    const unsigned char *remap)
+{
+    unsigned char   alpha_value;
+    long            x;
+
+    if (!remap){
+        for (x = 0; x < n; x++, src += 2)
+            dest[x] = src[0] | ((0xFF - src[1]) & 0xF0);
+        return;
+    }
+    for (x = 0; x < n; x++, src += 2){
+        alpha_value = 0xFF - src[1];
+        dest[x] = remap[src[0]] | (alpha_value & 0xF0);
+    }
+}
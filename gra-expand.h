@@ -0,0 +1,63 @@
+/*
+ * gra-expand.h   Turning GRA bytes into pixels, and indexed pixels into
+ *                GRA bytes.
+ *
+ * Each GRA byte holds a colour index in its low nibble and an inverted
+ * alpha in its high one, so both halves are lookups in 16-entry tables.
+ * On x86 the lookups are done 16 or 32 bytes at a time with pshufb, the
+ * kernel being picked once from what the CPU supports; elsewhere, and for
+ * the last few bytes of a run, a plain loop does the same.
+ *
+ * The indexed-and-alpha loops are plain C. They have no GIMP types in them
+ * so that gra-bench can time them on their own.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRA_EXPAND_H__
+#define __GRA_EXPAND_H__
+
+// Writes n RGBA pixels to dest for the n GRA bytes at src, looking colours
+// up in color_map (16 RGB triples)
+void        gra_expand_rgba        (unsigned char       *dest,
+                                    const unsigned char *src,
+                                    long                 n,
+                                    const unsigned char *color_map);
+
+// Name of the kernel gra_expand_rgba uses: "avx2", "ssse3" or "scalar"
+const char *gra_expand_rgba_kernel (void);
+
+// Writes n pairs of colour index and alpha, as a GIMP_INDEXEDA_IMAGE layer
+// holds them, to dest for the n GRA bytes at src
+void        gra_expand_indexeda    (unsigned char       *dest,
+                                    const unsigned char *src,
+                                    long                 n);
+// Writes the colour indexes alone, as a GIMP_INDEXED_IMAGE layer holds them,
+// to dest for the n GRA bytes at src. Returns nonzero if any of them wasn't
+// opaque, whose transparency that layer couldn't hold.
+int         gra_expand_indexed     (unsigned char       *dest,
+                                    const unsigned char *src,
+                                    long                 n);
+// The other way round: packs the n pairs of colour index and alpha at src
+// into GRA bytes, looking each colour up in remap, or keeping it if remap is
+// NULL
+void        gra_pack_indexeda      (unsigned char       *dest,
+                                    const unsigned char *src,
+                                    long                 n,
+                                    const unsigned char *remap);
+
+#endif /* __GRA_EXPAND_H__ */
@@ -0,0 +1,198 @@
+/*
+ * gra-format.c   Recognises GRA files by their content.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "gra-format.h"
+
+#define CT_NONE     1
+#define CT_8_BIT    3
+
+const unsigned char gra_templeos_colors[3 * GRA_PALETTE_COLORS] = {
+    0x00, 0x00, 0x00,   // BLACK
+    0x00, 0x00, 0xAA,   // BLUE
+    0x00, 0xAA, 0x00,   // GREEN
+    0x00, 0xAA, 0xAA,   // CYAN
+    0xAA, 0x00, 0x00,   // RED
+    0xAA, 0x00, 0xAA,   // PURPLE
+    0xAA, 0x55, 0x00,   // BROWN
+    0xAA, 0xAA, 0xAA,   // LTGRAY
+    0x55, 0x55, 0x55,   // DKGRAY
+    0x55, 0x55, 0xFF,   // LTBLUE
+    0x55, 0xFF, 0x55,   // LTGREEN
+    0x55, 0xFF, 0xFF,   // LTCYAN
+    0xFF, 0x55, 0x55,   // LTRED
+    0xFF, 0x55, 0xFF,   // LTPURPLE
+    0xFF, 0xFF, 0x55,   // YELLOW
+    0xFF, 0xFF, 0xFF,   // WHITE
+};
+
+static unsigned int read_u32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+// Sizes are 64 bits, as TempleOS' I64, split into two u32s
+static unsigned long read_u64(const unsigned char *p)
+{
+    return read_u32(p) | (unsigned long)read_u32(p + 4) << 32;
+}
+
+void gra_header_parse(const unsigned char *buf, GraHeader *header)
+{
+    header->width          = (int)read_u32(buf);
+    header->width_internal = (int)read_u32(buf + 4);
+    header->height         = (int)read_u32(buf + 8);
+    header->flags          = (int)read_u32(buf + 12);
+}
+
+// Returns 1 if buf, the first len bytes of a file of file_size bytes (-1 if
+// not known, as for a pipe), is the start of a GRA. Only the first
+// GRA_SNIFF_SIZE bytes are looked at. The pixel data may be either width
+// or width_internal bytes a row: this plugin has always written the former,
+// TempleOS the latter. gra_row_stride tells which.
+int gra_sniff(const unsigned char *buf, long len, long file_size)
+{
+    GraHeader           header;
+    const unsigned char *arc;
+    long                body;
+    unsigned long       rows, expanded_size, compressed_size;
+
+    if (len < GRA_HEADER_SIZE)
+        return 0;
+    gra_header_parse(buf, &header);
+    if (header.width <= 0 || header.height <= 0 ||
+            header.width > 0x7FFFFFF8 ||
+            header.width_internal != ((header.width + 7) & ~7) ||
+            (header.flags & ~DCF_KNOWN_FLAGS))
+        return 0;
+    rows = (unsigned long)header.height;
+    body = GRA_BODY_OFFSET(header.flags);
+
+    if (!(header.flags & DCF_COMPRESSED))
+        return file_size < 0 || (file_size >= body &&
+            (unsigned long)(file_size - body) >= rows * header.width);
+
+    if (len < body + GRA_ARC_HEADER_SIZE)
+        return 0;
+    arc = buf + body;
+    compressed_size = read_u64(arc);
+    expanded_size = read_u64(arc + 8);
+    if (arc[16] < CT_NONE || arc[16] > CT_8_BIT ||
+            compressed_size < GRA_ARC_HEADER_SIZE ||
+            (expanded_size != rows * header.width &&
+             expanded_size != rows * header.width_internal))
+        return 0;
+    return file_size < 0 || compressed_size == (unsigned long)(file_size - body);
+}
+
+// How much of a file starting with the GRA_HEADER_SIZE bytes at buf
+// gra_sniff needs to see: the header, any palette and, if the body is
+// compressed, its CArcCompress header. Reading no more than this from a
+// stream leaves it at the pixels, or just past the CArcCompress header.
+long gra_sniff_size(const unsigned char *buf)
+{
+    GraHeader header;
+
+    gra_header_parse(buf, &header);
+    if (header.flags & ~DCF_KNOWN_FLAGS)
+        return GRA_HEADER_SIZE;
+    return GRA_BODY_OFFSET(header.flags) +
+        (header.flags & DCF_COMPRESSED ? GRA_ARC_HEADER_SIZE : 0);
+}
+
+// Bytes of the file after GRA_BODY_OFFSET, going by the start of it at buf
+// that gra_sniff accepted: the CArcCompress's compressed_size, or the
+// pixels of an uncompressed image. A reader of a pipe knows from this how
+// much is left to read without looking for the end.
+long gra_body_size(const unsigned char *buf)
+{
+    GraHeader header;
+
+    gra_header_parse(buf, &header);
+    if (!(header.flags & DCF_COMPRESSED))
+        return (long)header.width * header.height;
+    return read_u64(buf + GRA_BODY_OFFSET(header.flags));
+}
+
+// Bytes each row takes in the body of the file starting at buf (as for
+// gra_body_size): width_internal if the expanded size says the rows keep
+// TempleOS's padding to a multiple of 8, otherwise width
+int gra_row_stride(const unsigned char *buf)
+{
+    GraHeader       header;
+    unsigned long   expanded_size;
+
+    gra_header_parse(buf, &header);
+    if (!(header.flags & DCF_COMPRESSED))
+        return header.width;
+    expanded_size = read_u64(buf + GRA_BODY_OFFSET(header.flags) + 8);
+    if (expanded_size != (unsigned long)header.height * header.width &&
+            expanded_size == (unsigned long)header.height * header.width_internal)
+        return header.width_internal;
+    return header.width;
+}
+
+// Fills color_map (3 * GRA_PALETTE_COLORS bytes of RGB) from the palette at
+// buf, keeping the top 8 bits of each 16 bit channel
+void gra_palette_parse(const unsigned char *buf, unsigned char *color_map)
+{
+    int i;
+
+    for (i = 0; i < GRA_PALETTE_COLORS; i++, buf += 8){
+        color_map[3*i]     = buf[5];    // r
+        color_map[3*i + 1] = buf[3];    // g
+        color_map[3*i + 2] = buf[1];    // b
+    }
+}
+
+// Writes the first colors entries of color_map as a palette at buf, with
+// the rest black
+void gra_palette_build(const unsigned char *color_map, int colors,
+        unsigned char *buf)
+{
+    int i;
+
+    memset(buf, 0, GRA_PALETTE_SIZE);
+    for (i = 0; i < colors && i < GRA_PALETTE_COLORS; i++, buf += 8){
+        buf[0] = buf[1] = color_map[3*i + 2];   // b, as b * 0x101
+        buf[2] = buf[3] = color_map[3*i + 1];   // g
+        buf[4] = buf[5] = color_map[3*i];       // r
+    }
+}
+
+// Index of the entry of color_map (GRA_PALETTE_COLORS RGB triples) nearest
+// to r, g, b
+int gra_palette_nearest(const unsigned char *color_map, int r, int g, int b)
+{
+    int i, dr, dg, db, dist, best = 0, best_dist = 3 * 256 * 256;
+
+    for (i = 0; i < GRA_PALETTE_COLORS; i++){
+        dr = r - color_map[3*i];
+        dg = g - color_map[3*i + 1];
+        db = b - color_map[3*i + 2];
+        dist = dr*dr + dg*dg + db*db;
+        if (dist < best_dist){
+            best_dist = dist;
+            best = i;
+        }
+    }
+    return best;
+}
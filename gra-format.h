@@ -0,0 +1,82 @@
+/*
+ * gra-format.h   Layout of a GRA file, and recognising one by its content.
+ *
+ * A GRA starts with four little-endian ints: width, width_internal (width
+ * rounded up to a multiple of 8), height and flags. With DCF_COMPRESSED set
+ * the rest of the file is a CArcCompress, whose own header gives the size
+ * of the stream and of the data it expands to.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRA_FORMAT_H__
+#define __GRA_FORMAT_H__
+
+#define GRA_HEADER_SIZE     16      // width, width_internal, height, flags
+#define GRA_PALETTE_COLORS  16
+#define GRA_PALETTE_SIZE    (GRA_PALETTE_COLORS * 8)    // CBGR48: u16 b, g, r, pad
+#define GRA_ARC_HEADER_SIZE 17      // CArcCompress up to its body
+#define GRA_SNIFF_SIZE      (GRA_HEADER_SIZE + GRA_PALETTE_SIZE + GRA_ARC_HEADER_SIZE)
+
+#define DCF_COMPRESSED      0x01
+#define DCF_PALETTE         0x02    // palette follows the header
+#define DCF_KNOWN_FLAGS     (DCF_COMPRESSED | DCF_PALETTE)
+
+// Where the body starts in a file with these flags
+#define GRA_BODY_OFFSET(flags) \
+    (GRA_HEADER_SIZE + ((flags) & DCF_PALETTE ? GRA_PALETTE_SIZE : 0))
+
+// Magic for gimp_register_magic_load_handler. GIMP's tests read "long"s
+// big-endian and can't compare fields with each other, so this only asks
+// for a compressed GRA whose CArcCompress header looks sane: flags 1 (or 3
+// with the palette before the body), width_internal a multiple of 8, both
+// high size words 0 and a compression type from 1 to 3. Bodies of 4GB or
+// more (non-zero high words) are then only recognised by their extension.
+// gra_sniff() does the full check.
+#define GRA_MAGIC \
+    "12&,long,0x01000000," \
+    "4&,byte&0x07,0," \
+    "20&,long,0," \
+    "28&,long,0," \
+    "32&,byte,>0," \
+    "32,byte,<4," \
+    "12&,long,0x03000000," \
+    "4&,byte&0x07,0," \
+    "148&,long,0," \
+    "156&,long,0," \
+    "160&,byte,>0," \
+    "160,byte,<4"
+
+// The palette of files without DCF_PALETTE, as RGB
+extern const unsigned char gra_templeos_colors[3 * GRA_PALETTE_COLORS];
+
+typedef struct _GraHeader
+{
+    int width, width_internal, height, flags;
+} GraHeader;
+
+void gra_header_parse (const unsigned char *buf, GraHeader *header);
+int  gra_sniff        (const unsigned char *buf, long len, long file_size);
+long gra_sniff_size   (const unsigned char *buf);
+long gra_body_size    (const unsigned char *buf);
+int  gra_row_stride   (const unsigned char *buf);
+void gra_palette_parse (const unsigned char *buf, unsigned char *color_map);
+void gra_palette_build (const unsigned char *color_map, int colors,
+                        unsigned char *buf);
+int  gra_palette_nearest (const unsigned char *color_map, int r, int g, int b);
+
+#endif /* __GRA_FORMAT_H__ */
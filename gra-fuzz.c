@@ -0,0 +1,359 @@
+/*
+ * gra-fuzz.c   Fuzz target for the decoder and the file sniffer.
+ *
+ * Hands arbitrary bytes to gra_sniff() as a .GRA file (and to
+ * gra_row_stride() if it takes them for one), and its body (or the whole
+ * input, if it has no GRA header) to decompress(), decompress_chunked(),
+ * decompress_indexed() and decompress_range() from the checkpoints that
+ * built, and decompress_streamed() reading it in pieces of varying size.
+ * Built with -fsanitize=address,undefined (make gra-fuzz), any read or
+ * write out of bounds, leak or undefined behaviour stops it. Every input is copied into a buffer of exactly its size first,
+ * so reading past the end of the stream is caught too.
+ *
+ *   gra-fuzz [-n ITERATIONS] [-s SEED] [FILE...]
+ *
+ * Given files, it runs each of them once. Otherwise it makes ITERATIONS
+ * .GRA files of its own, valid ones with a few bits flipped, bytes
+ * overwritten, the end cut off or the header's sizes changed, and runs
+ * those. The input being run when the sanitizer stops the program is saved
+ * to gra-fuzz-crash.GRA, to be run again on its own.
+ *
+ * Built with -DGRA_FUZZ_LIBFUZZER and clang's -fsanitize=fuzzer instead,
+ * LLVMFuzzerTestOneInput is the entry point and libFuzzer drives it.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+#include "compression.h"
+#include "gra-format.h"
+
+#define FUZZ_CHUNK          0x100       // small, so that inputs cross many chunk seams
+#define FUZZ_MAX_EXPANDED   (1L << 24)  // claimed sizes over this aren't given to decompress()
+#define FUZZ_MAX_SIZE       (1L << 16)  // of the pixels of a generated file
+#define FUZZ_CRASH_FILE     "gra-fuzz-crash.GRA"
+
+// Stream handed to decompress_streamed in pieces whose sizes come from the
+// stream itself, so a run depends on the input alone
+typedef struct
+{
+    const unsigned char *data;
+    long                 size, pos;
+} FuzzReader;
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static int  fuzz_sink       (void *user_data, const unsigned char *buf, long len, long offset);
+static long fuzz_read       (void *user_data, unsigned char *buf, long len);
+static void fuzz_stream     (const unsigned char *stream, long size);
+
+#ifndef GRA_FUZZ_LIBFUZZER
+static const unsigned char  *current;       // input being run, for save_crash
+static long                  current_size;
+static unsigned long long    rng_state;
+
+static unsigned int rng     (void);
+#ifdef __SANITIZE_ADDRESS__
+static void save_crash      (void);
+#endif
+static long make_file       (unsigned char **file);
+static void mutate          (unsigned char *file, long *size);
+static int  run_file        (const char *path);
+static void usage           (void);
+#endif
+
+static int fuzz_sink(void *user_data, const unsigned char *buf, long len, long offset)
+{
+    unsigned char *sum = user_data;
+
+    // Touch every byte, so a bad one is read where it is handed over
+    while (len-- > 0)
+        *sum ^= buf[len] + offset;
+    return 1;
+}
+
+static long fuzz_read(void *user_data, unsigned char *buf, long len)
+{
+    FuzzReader  *in = user_data;
+    long         n = in->size - in->pos;
+
+    if (n > len)
+        n = len;
+    if (n > 1 && in->pos < in->size)
+        n = 1 + in->data[in->pos] % n;
+    memcpy(buf, in->data + in->pos, n);
+    in->pos += n;
+    return n;
+}
+
+// Runs every decoder on one CArcCompress stream
+static void fuzz_stream(const unsigned char *data, long size)
+{
+    ArcExpandIndex   index;
+    FuzzReader       in;
+    unsigned char   *stream, *out = NULL, sum = 0;
+    unsigned int     low;
+    long             expanded = 0, n;
+    int              i;
+
+    stream = malloc(size ? size : 1);
+    memcpy(stream, data, size);
+    if (size >= GRA_ARC_HEADER_SIZE){
+        memcpy(&low, stream + 8, sizeof(low));
+        expanded = low;
+    }
+
+    if (size >= GRA_ARC_HEADER_SIZE && stream[12] == 0 && stream[13] == 0 &&
+            stream[14] == 0 && stream[15] == 0 && expanded <= FUZZ_MAX_EXPANDED){
+        n = decompress(stream, size, &out);
+        if (n > 0)
+            fuzz_sink(&sum, out, n, 0);
+        free(out);
+    }
+
+    decompress_chunked(stream, size, FUZZ_CHUNK, fuzz_sink, &sum);
+
+    index.interval = FUZZ_CHUNK / 2 + size % FUZZ_CHUNK;
+    index.count = 0;
+    index.list = malloc(16 * sizeof(ArcExpandCheckpoint));
+    if (expanded > 0 && expanded <= 16 * index.interval){
+        decompress_indexed(stream, size, FUZZ_CHUNK, fuzz_sink, &sum, &index);
+        for (i = 0; i < index.count; i++)
+            decompress_range(stream, size, &index.list[i],
+                    i + 1 < index.count ? index.list[i + 1].state.dst_pos : -1,
+                    FUZZ_CHUNK, fuzz_sink, &sum);
+    }
+    decompress_range(stream, size, NULL, expanded / 2, FUZZ_CHUNK, fuzz_sink, &sum);
+    free(index.list);
+
+    in.data = stream;
+    in.size = size;
+    in.pos = 0;
+    decompress_streamed(fuzz_read, &in, FUZZ_CHUNK, fuzz_sink, &sum, NULL);
+
+    free(stream);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    unsigned char   *file;
+    GraHeader        header;
+    long             body;
+
+    file = malloc(size ? size : 1);
+    memcpy(file, data, size);
+    if (gra_sniff(file, size, size) | gra_sniff(file, size, -1))
+        gra_row_stride(file);
+    if (size >= GRA_HEADER_SIZE)
+        gra_sniff_size(file);
+    free(file);
+
+    // The body of a compressed .GRA, or else the input as a bare stream
+    body = 0;
+    if (size >= GRA_HEADER_SIZE){
+        gra_header_parse(data, &header);
+        if ((header.flags & DCF_COMPRESSED) && !(header.flags & ~DCF_KNOWN_FLAGS) &&
+                (long)size >= GRA_BODY_OFFSET(header.flags))
+            body = GRA_BODY_OFFSET(header.flags);
+    }
+    fuzz_stream(data + body, size - body);
+    return 0;
+}
+
+#ifndef GRA_FUZZ_LIBFUZZER
+
+// xorshift64*, so a run can be repeated from its seed
+static unsigned int rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned int)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+#ifdef __SANITIZE_ADDRESS__
+static void save_crash(void)
+{
+    FILE *f = fopen(FUZZ_CRASH_FILE, "wb");
+
+    if (f){
+        fwrite(current, 1, current_size, f);
+        fclose(f);
+        fprintf(stderr, "gra-fuzz: input saved to %s\n", FUZZ_CRASH_FILE);
+    }
+}
+#endif
+
+// A valid compressed .GRA of a drawing-like image of random size
+static long make_file(unsigned char **file)
+{
+    unsigned char   *pixels, *body, pixel = 0;
+    int              header[4], width, height, kind = rng() % 3;
+    long             size, body_size, offset, i;
+
+    width = 1 + rng() % 512;
+    height = 1 + rng() % (FUZZ_MAX_SIZE / width);
+    size = (long)width * height;
+    pixels = malloc(size);
+    for (i = 0; i < size; i++){
+        if (kind == 0)
+            pixels[i] = rng();
+        else if (kind == 1 && rng() % 24 == 0)
+            pixel = (rng() % 16) | (rng() % 8 == 0 ? (rng() % 16) << 4 : 0);
+        else if (kind == 2)
+            pixel = (i / (1 + rng() % 64)) & 0x0F;
+        if (kind)
+            pixels[i] = pixel;
+    }
+    body_size = compress(&body, pixels, size);
+    free(pixels);
+
+    header[0] = width;
+    header[1] = (width + 7) & ~7;
+    header[2] = height;
+    header[3] = DCF_COMPRESSED | (rng() % 4 == 0 ? DCF_PALETTE : 0);
+    offset = GRA_BODY_OFFSET(header[3]);
+    *file = malloc(offset + body_size);
+    memcpy(*file, header, GRA_HEADER_SIZE);
+    for (i = GRA_HEADER_SIZE; i < offset; i++)
+        (*file)[i] = rng();
+    memcpy(*file + offset, body, body_size);
+    free(body);
+    return offset + body_size;
+}
+
+// Damages a file the way a bad disk or a hostile one would
+static void mutate(unsigned char *file, long *size)
+{
+    long    n, i;
+
+    switch (rng() % 6){
+        case 0: // flip a few bits anywhere
+            for (n = 1 + rng() % 4; n > 0; n--){
+                i = rng() % *size;
+                file[i] ^= 1 << (rng() % 8);
+            }
+            break;
+        case 1: // overwrite a run with noise
+            i = rng() % *size;
+            for (n = 1 + rng() % 32; n > 0 && i < *size; n--, i++)
+                file[i] = rng();
+            break;
+        case 2: // cut it short
+            *size -= rng() % *size;
+            break;
+        case 3: // change one of the sizes, or the compression type
+            i = *size > GRA_HEADER_SIZE + GRA_ARC_HEADER_SIZE ? GRA_HEADER_SIZE : 0;
+            i += (rng() % 5) * 4;
+            if (i < *size)
+                file[i] ^= 1 << (rng() % 8);
+            break;
+        case 4: // change the header
+            i = rng() % GRA_HEADER_SIZE;
+            if (i < *size)
+                file[i] = rng();
+            break;
+        default: // left valid
+            break;
+    }
+}
+
+static int run_file(const char *path)
+{
+    FILE            *f = fopen(path, "rb");
+    unsigned char   *data = NULL;
+    long             size = 0, alloc = 0, n;
+
+    if (!f){
+        perror(path);
+        return 1;
+    }
+    do {
+        if (size == alloc){
+            alloc = alloc ? 2 * alloc : 0x10000;
+            data = realloc(data, alloc);
+        }
+        n = fread(data + size, 1, alloc - size, f);
+        size += n;
+    } while (n > 0);
+    fclose(f);
+
+    current = data;
+    current_size = size;
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: gra-fuzz [-n ITERATIONS] [-s SEED] [FILE...]\n");
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long long  seed = 1;
+    unsigned char      *file;
+    long                iterations = 10000, n, size;
+    int                 i, failed = 0;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++){
+        if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+            iterations = atol(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-s") == 0)
+            seed = strtoull(argv[++i], NULL, 0);
+        else {
+            usage();
+            return 2;
+        }
+    }
+    if (iterations < 1 || !seed){
+        usage();
+        return 2;
+    }
+#ifdef __SANITIZE_ADDRESS__
+    __sanitizer_set_death_callback(save_crash);
+#endif
+
+    if (i < argc){
+        for (; i < argc; i++)
+            failed |= run_file(argv[i]);
+        return failed;
+    }
+
+    rng_state = seed;
+    for (n = 0; n < iterations; n++){
+        size = make_file(&file);
+        mutate(file, &size);
+        current = file;
+        current_size = size;
+        LLVMFuzzerTestOneInput(file, size);
+        free(file);
+    }
+    printf("%ld inputs, no errors\n", iterations);
+    return 0;
+}
+
+#endif /* GRA_FUZZ_LIBFUZZER */
@@ -0,0 +1,575 @@
+/*
+ * gra-oracle.c   Differential check of the codec against the frozen reference.
+ *
+ * Runs compress(), compress_chunked(), compress_streamed(), decompress(),
+ * decompress_chunked() and decompress_streamed() of the codec it is built
+ * with (compression.c, or ORACLE_CODEC) side by
+ * side with compress() and decompress() of reference/compression.c on
+ * generated inputs, and stops at the first case whose output differs,
+ * naming the byte. The inputs cover random and incompressible data (the
+ * CT_NONE fallback), 7-bit and 8-bit data, data that fills the string table
+ * over and over, long runs, flat areas between noise and tiny buffers. Each
+ * line of the report gives the time spent in the reference and in the codec
+ * under test.
+ *
+ * The reference only ever sees valid streams: it is the codec as first
+ * imported, which doesn't check what it decodes. Damaged streams are given
+ * to decompress() and decompress_streamed() of the codec under test, which
+ * must both reject them or agree on their bytes.
+ *
+ *   gra-oracle [-n CASES] [-c FIRST_CASE] [-s SEED] [-x MAX_SIZE]
+ *
+ * Every case depends only on the seed, its number and MAX_SIZE, so a failure
+ * can be replayed on its own with -c and -n 1.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compression.h"
+#include "gra-format.h"
+#include "reference/compression-ref.h"
+
+#define ORACLE_CHUNK    0x1000  // piece size for the chunked calls, small to exercise their seams
+
+// Makes size bytes of one kind of input at buf
+typedef void (*OracleGen)(unsigned char *buf, long size);
+
+typedef struct
+{
+    const char *name;
+    OracleGen   gen;
+} OracleInput;
+
+// A call of the codec under test and the reference call it must match
+typedef enum
+{
+    ORACLE_COMPRESS,
+    ORACLE_COMPRESS_CHUNKED,
+    ORACLE_COMPRESS_STREAMED,
+    ORACLE_DECOMPRESS,
+    ORACLE_DECOMPRESS_CHUNKED,
+    ORACLE_DECOMPRESS_STREAMED,
+    ORACLE_STREAMED_DAMAGED,
+    ORACLE_N_CHECKS
+} OracleCheck;
+
+typedef struct
+{
+    long    cases;
+    double  ref_time, alt_time;     // seconds
+} OracleTotals;
+
+// Growing buffer the chunked calls write into at the offsets they give
+typedef struct
+{
+    unsigned char  *data;
+    long            size, alloc;
+} OracleBuffer;
+
+// Stream handed to decompress_streamed in pieces of random size, as a pipe
+// would
+typedef struct
+{
+    const unsigned char *data;
+    long                 size, pos;
+} OracleReader;
+
+static const char *check_names[ORACLE_N_CHECKS] = {
+    "compress",
+    "compress_chunked",
+    "compress_streamed",
+    "decompress",
+    "decompress_chunked",
+    "decompress_streamed",
+    "streamed damaged",
+};
+
+static unsigned long long rng_state;
+
+static unsigned int rng     (void);
+static double       now     (void);
+static void gen_random8     (unsigned char *buf, long size);
+static void gen_random7     (unsigned char *buf, long size);
+static void gen_text7       (unsigned char *buf, long size);
+static void gen_gra         (unsigned char *buf, long size);
+static void gen_runs        (unsigned char *buf, long size);
+static void gen_periodic    (unsigned char *buf, long size);
+static void gen_flat        (unsigned char *buf, long size);
+static void gen_table_fill  (unsigned char *buf, long size);
+static void gen_high_tail   (unsigned char *buf, long size);
+static int  buffer_sink     (void *user_data, const unsigned char *buf, long len, long offset);
+static int  memory_source   (void *user_data, unsigned char *buf, long len, long offset);
+static long memory_read     (void *user_data, unsigned char *buf, long len);
+static long first_difference(const unsigned char *a, long a_size, const unsigned char *b, long b_size);
+static int  report          (OracleCheck check, long n, const char *input, long size,
+                             const unsigned char *ref, long ref_size,
+                             const unsigned char *alt, long alt_size);
+static void damage          (unsigned char *stream, long *size);
+static int  run_case        (long n, const OracleInput *input, long size,
+                             unsigned long long seed, OracleTotals *totals);
+static void usage           (void);
+
+static const OracleInput inputs[] = {
+    { "random8",    gen_random8 },
+    { "random7",    gen_random7 },
+    { "text7",      gen_text7 },
+    { "gra",        gen_gra },
+    { "runs",       gen_runs },
+    { "periodic",   gen_periodic },
+    { "flat",       gen_flat },
+    { "table-fill", gen_table_fill },
+    { "high-tail",  gen_high_tail },
+};
+
+#define N_INPUTS    ((long)(sizeof(inputs) / sizeof(inputs[0])))
+
+// xorshift64*, so a case can be replayed from its seed alone
+static unsigned int rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned int)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Incompressible: ends up stored as CT_NONE
+static void gen_random8(unsigned char *buf, long size)
+{
+    long i;
+
+    for (i = 0; i < size; i++)
+        buf[i] = rng();
+}
+
+// Incompressible 7-bit data
+static void gen_random7(unsigned char *buf, long size)
+{
+    long i;
+
+    for (i = 0; i < size; i++)
+        buf[i] = rng() & 0x7F;
+}
+
+// 7-bit data from a small alphabet: compresses, and refills the table
+// every few thousand codes once it is large
+static void gen_text7(unsigned char *buf, long size)
+{
+    int     alphabet = 2 + rng() % 40;
+    long    i;
+
+    for (i = 0; i < size; i++)
+        buf[i] = 'A' + rng() % alphabet;
+}
+
+// Like the pixels of a drawing: runs of a few colours, some transparent
+static void gen_gra(unsigned char *buf, long size)
+{
+    unsigned char   pixel = 0;
+    long            i;
+
+    for (i = 0; i < size; i++){
+        if (rng() % 24 == 0)
+            pixel = (rng() % 16) | (rng() % 8 == 0 ? (rng() % 16) << 4 : 0);
+        buf[i] = pixel;
+    }
+}
+
+// Long runs of one byte: long matches, few table entries
+static void gen_runs(unsigned char *buf, long size)
+{
+    unsigned char   value = rng();
+    long            i;
+
+    for (i = 0; i < size; i++){
+        if (rng() % 4096 == 0)
+            value = rng();
+        buf[i] = value;
+    }
+}
+
+// A random block repeated, so that matches grow with every pass over it
+static void gen_periodic(unsigned char *buf, long size)
+{
+    long    period = 1 + rng() % 5000, i;
+
+    gen_random8(buf, period < size ? period : size);
+    for (i = period; i < size; i++)
+        buf[i] = buf[i - period];
+}
+
+// Every pair of a 64 symbol alphabet once, then again shifted: nearly every
+// code adds a new string, so the table fills and is recycled constantly
+static void gen_flat(unsigned char *buf, long size)
+{
+    // Runs of any length of a few values, between bursts of noise that keep
+    // the table full so the runs' entries get recycled
+    unsigned char   values[3] = { 0xF0, rng() % 16, rng() };
+    unsigned char   value;
+    long            i, len;
+
+    for (i = 0; i < size; ){
+        len = rng() % (1 << (rng() % 13)) + 1;
+        value = values[rng() % 3];
+        for (; len && i < size; len--, i++)
+            buf[i] = rng() % 3 ? value : rng();
+        len = rng() % (1 << (rng() % 13)) + 1;
+        value = values[rng() % 3];
+        for (; len && i < size; len--, i++)
+            buf[i] = value;
+    }
+}
+static void gen_table_fill(unsigned char *buf, long size)
+{
+    unsigned int    base = rng() % 2 ? 0x80 : 0, shift = 0;
+    long            i, k;
+
+    for (i = 0; i < size; shift++)
+        for (k = 0; k < 64 * 64 && i < size; k++, i++)
+            buf[i] = base + (i & 1 ? (k + shift) % 64 : (k / 64 + shift) % 64);
+}
+
+// 7-bit data with a single byte that has the top bit set, at the end,
+// where it decides between 7-bit and 8-bit mode
+static void gen_high_tail(unsigned char *buf, long size)
+{
+    gen_text7(buf, size);
+    if (size)
+        buf[size - 1] |= 0x80;
+}
+
+static int buffer_sink(void *user_data, const unsigned char *buf, long len, long offset)
+{
+    OracleBuffer *out = user_data;
+
+    if (!len)   // compress_chunked asking to wait: nothing is pending here
+        return 1;
+    if (offset + len > out->alloc){
+        out->alloc = (offset + len) * 2;
+        out->data = realloc(out->data, out->alloc);
+    }
+    memcpy(out->data + offset, buf, len);
+    if (offset + len > out->size)
+        out->size = offset + len;
+    return 1;
+}
+
+static int memory_source(void *user_data, unsigned char *buf, long len, long offset)
+{
+    memcpy(buf, (const unsigned char *)user_data + offset, len);
+    return 1;
+}
+
+static long memory_read(void *user_data, unsigned char *buf, long len)
+{
+    OracleReader *in = user_data;
+
+    if (len > in->size - in->pos)
+        len = in->size - in->pos;
+    if (len > 1)
+        len = 1 + rng() % len;
+    memcpy(buf, in->data + in->pos, len);
+    in->pos += len;
+    return len;
+}
+
+// Returns the offset of the first byte that differs, the size of the
+// shorter one if that is a prefix of the other, or -1 if they are the same
+static long first_difference(const unsigned char *a, long a_size,
+    const unsigned char *b, long b_size)
+{
+    long i;
+
+    for (i = 0; i < a_size && i < b_size; i++)
+        if (a[i] != b[i])
+            return i;
+    return a_size == b_size ? -1 : i;
+}
+
+// Prints where the outputs of one case differ. Returns 1 if they do.
+static int report(OracleCheck check, long n, const char *input, long size,
+    const unsigned char *ref, long ref_size,
+    const unsigned char *alt, long alt_size)
+{
+    long at, skip;
+
+    if (ref_size < 0 || alt_size < 0){
+        if ((ref_size < 0) == (alt_size < 0))
+            return 0;
+        printf("FAIL %s, case %ld (%s, %ld bytes): "
+                "reference %s, codec %s\n",
+                check_names[check], n, input, size,
+                ref_size < 0 ? "rejects the stream" : "accepts it",
+                alt_size < 0 ? "rejects it" : "accepts it");
+        return 1;
+    }
+    // A stream starts with its own size, which differs whenever anything
+    // after it does, so the body is compared first
+    skip = check <= ORACLE_COMPRESS_STREAMED ? GRA_ARC_HEADER_SIZE : 0;
+    at = -1;
+    if (ref_size >= skip && alt_size >= skip)
+        at = first_difference(ref + skip, ref_size - skip, alt + skip, alt_size - skip);
+    if (at >= 0)
+        at += skip;
+    else
+        at = first_difference(ref, ref_size, alt, alt_size);
+    if (at < 0)
+        return 0;
+    printf("FAIL %s, case %ld (%s, %ld bytes): first difference "
+            "at byte %ld of %ld/%ld",
+            check_names[check], n, input, size, at, ref_size, alt_size);
+    if (at < ref_size && at < alt_size)
+        printf(" (reference 0x%02x, codec 0x%02x)", ref[at], alt[at]);
+    printf("\n");
+    return 1;
+}
+
+// Damages a valid stream the way a bad disk or a hostile file would
+static void damage(unsigned char *stream, long *size)
+{
+    long    n, i;
+
+    switch (rng() % 4){
+        case 0: // flip a few bits of the body
+            for (n = 1 + rng() % 4; n > 0; n--){
+                i = 17 + rng() % (*size - 17 > 0 ? *size - 17 : 1);
+                if (i < *size)
+                    stream[i] ^= 1 << (rng() % 8);
+            }
+            break;
+        case 1: // overwrite a run of the body with noise
+            i = 17 + rng() % (*size - 17 > 0 ? *size - 17 : 1);
+            for (n = 1 + rng() % 32; n > 0 && i < *size; n--, i++)
+                stream[i] = rng();
+            break;
+        case 2: // cut it short, with the header still claiming the old size
+            *size -= 1 + rng() % (*size / 2 + 1);
+            if (*size < 17)
+                *size = 17;
+            break;
+        default: // change the compression type or expanded size
+            if (rng() % 2)
+                stream[16] = 1 + rng() % 3;
+            else
+                stream[8 + rng() % 2] ^= 1 << (rng() % 8);
+            break;
+    }
+}
+
+// Runs every check on one input. Returns 1 if any of them differs.
+static int run_case(long n, const OracleInput *input, long size,
+    unsigned long long seed, OracleTotals *totals)
+{
+    unsigned char   *src, *ref, *alt, *stream;
+    long            ref_size, alt_size, stream_size;
+    OracleBuffer    out;
+    OracleReader    in;
+    double          t0, t1, t2, ref_time;
+    int             failed = 0;
+
+    rng_state = seed;
+    src = malloc(size ? size : 1);
+    input->gen(src, size);
+
+    // Encoding: the stream must match byte for byte
+    t0 = now();
+    ref_size = ref_compress(&ref, src, size);
+    t1 = now();
+    alt_size = compress(&alt, src, size);
+    t2 = now();
+    ref_time = t1 - t0;
+    totals[ORACLE_COMPRESS].cases++;
+    totals[ORACLE_COMPRESS].ref_time += ref_time;
+    totals[ORACLE_COMPRESS].alt_time += t2 - t1;
+    failed |= report(ORACLE_COMPRESS, n, input->name, size,
+            ref, ref_size, alt, alt_size);
+    free(alt);
+
+    memset(&out, 0, sizeof(out));
+    t1 = now();
+    alt_size = compress_chunked(src, size, ORACLE_CHUNK, buffer_sink, &out);
+    t2 = now();
+    totals[ORACLE_COMPRESS_CHUNKED].cases++;
+    totals[ORACLE_COMPRESS_CHUNKED].ref_time += ref_time;
+    totals[ORACLE_COMPRESS_CHUNKED].alt_time += t2 - t1;
+    failed |= report(ORACLE_COMPRESS_CHUNKED, n, input->name, size,
+            ref, ref_size, out.data, alt_size);
+    free(out.data);
+
+    memset(&out, 0, sizeof(out));
+    t1 = now();
+    alt_size = compress_streamed(size, ORACLE_CHUNK, memory_source, src,
+            buffer_sink, &out);
+    t2 = now();
+    totals[ORACLE_COMPRESS_STREAMED].cases++;
+    totals[ORACLE_COMPRESS_STREAMED].ref_time += ref_time;
+    totals[ORACLE_COMPRESS_STREAMED].alt_time += t2 - t1;
+    failed |= report(ORACLE_COMPRESS_STREAMED, n, input->name, size,
+            ref, ref_size, out.data, alt_size);
+    free(out.data);
+
+    // Decoding the reference's stream: must give back src
+    stream = ref;
+    stream_size = ref_size;
+    t0 = now();
+    ref_size = ref_decompress(stream, stream_size, &ref);
+    t1 = now();
+    alt_size = decompress(stream, stream_size, &alt);
+    t2 = now();
+    ref_time = t1 - t0;
+    totals[ORACLE_DECOMPRESS].cases++;
+    totals[ORACLE_DECOMPRESS].ref_time += ref_time;
+    totals[ORACLE_DECOMPRESS].alt_time += t2 - t1;
+    failed |= report(ORACLE_DECOMPRESS, n, input->name, size,
+            ref, ref_size, alt, alt_size);
+    if (ref_size != size || memcmp(ref, src, size)){
+        printf("FAIL reference, case %ld (%s, %ld bytes): "
+                "doesn't round trip\n", n, input->name, size);
+        failed = 1;
+    }
+    free(alt);
+
+    memset(&out, 0, sizeof(out));
+    t1 = now();
+    alt_size = decompress_chunked(stream, stream_size, ORACLE_CHUNK,
+            buffer_sink, &out);
+    t2 = now();
+    totals[ORACLE_DECOMPRESS_CHUNKED].cases++;
+    totals[ORACLE_DECOMPRESS_CHUNKED].ref_time += ref_time;
+    totals[ORACLE_DECOMPRESS_CHUNKED].alt_time += t2 - t1;
+    failed |= report(ORACLE_DECOMPRESS_CHUNKED, n, input->name, size,
+            ref, ref_size, out.data, alt_size);
+    free(out.data);
+
+    memset(&out, 0, sizeof(out));
+    in.data = stream;
+    in.size = stream_size;
+    in.pos = 0;
+    t1 = now();
+    alt_size = decompress_streamed(memory_read, &in, ORACLE_CHUNK,
+            buffer_sink, &out, NULL);
+    t2 = now();
+    totals[ORACLE_DECOMPRESS_STREAMED].cases++;
+    totals[ORACLE_DECOMPRESS_STREAMED].ref_time += ref_time;
+    totals[ORACLE_DECOMPRESS_STREAMED].alt_time += t2 - t1;
+    failed |= report(ORACLE_DECOMPRESS_STREAMED, n, input->name, size,
+            ref, ref_size, out.data, alt_size);
+    free(out.data);
+    free(ref);
+
+    // Decoding a damaged copy, which the reference can't be trusted with:
+    // decompress and decompress_streamed must both reject it, or agree on
+    // its bytes. decompress stands in for the reference in the report.
+    damage(stream, &stream_size);
+    t0 = now();
+    ref_size = decompress(stream, stream_size, &ref);
+    ref_time = now() - t0;
+
+    memset(&out, 0, sizeof(out));
+    in.data = stream;
+    in.size = stream_size;
+    in.pos = 0;
+    t1 = now();
+    alt_size = decompress_streamed(memory_read, &in, ORACLE_CHUNK,
+            buffer_sink, &out, NULL);
+    t2 = now();
+    totals[ORACLE_STREAMED_DAMAGED].cases++;
+    totals[ORACLE_STREAMED_DAMAGED].ref_time += ref_time;
+    totals[ORACLE_STREAMED_DAMAGED].alt_time += t2 - t1;
+    failed |= report(ORACLE_STREAMED_DAMAGED, n, input->name, size,
+            ref, ref_size, out.data, alt_size);
+    free(out.data);
+    free(ref);
+
+    free(stream);
+    free(src);
+    return failed;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: gra-oracle [-n CASES] [-c FIRST_CASE] [-s SEED] [-x MAX_SIZE]\n");
+}
+
+int main(int argc, char **argv)
+{
+    OracleTotals        totals[ORACLE_N_CHECKS];
+    unsigned long long  seed = 1, case_seed;
+    long                cases = 2000, first = 0, max_size = 1 << 18, n, size;
+    int                 i, bits, failed = 0;
+
+    for (i = 1; i < argc; i++){
+        if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+            cases = atol(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-c") == 0)
+            first = atol(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-s") == 0)
+            seed = strtoull(argv[++i], NULL, 0);
+        else if (i + 1 < argc && strcmp(argv[i], "-x") == 0)
+            max_size = atol(argv[++i]);
+        else {
+            usage();
+            return 2;
+        }
+    }
+    if (cases < 1 || first < 0 || max_size < 1 || !seed){
+        usage();
+        return 2;
+    }
+
+    for (bits = 1; bits < 62 && (1L << bits) <= max_size; bits++)
+        ;
+    memset(totals, 0, sizeof(totals));
+    for (n = first; n < first + cases && !failed; n++){
+        rng_state = seed + n * 0x9E3779B97F4A7C15ULL;
+        case_seed = rng_state ? rng_state : 1;
+
+        // Sizes spread evenly over powers of two, with the first cases
+        // covering the empty and tiny buffers
+        if (n < 17)
+            size = n;
+        else {
+            size = 1L << (rng() % bits);
+            size += rng() % size;
+            if (size > max_size)
+                size = max_size;
+        }
+        failed = run_case(n, &inputs[n % N_INPUTS], size, case_seed, totals);
+    }
+
+    for (i = 0; i < ORACLE_N_CHECKS; i++)
+        printf("%-20s %6ld cases   reference %8.3fs   codec %8.3fs   x%.2f\n",
+                check_names[i], totals[i].cases, totals[i].ref_time,
+                totals[i].alt_time,
+                totals[i].alt_time > 0 ? totals[i].ref_time / totals[i].alt_time : 0.0);
+    if (failed)
+        return 1;
+    printf("%ld cases, no differences\n", cases);
+    return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * gra-pam.c   Turning PAM and PPM images into GRA files, for gra-convert.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compression.h"
+#include "gra-format.h"
+#include "gra-pam.h"
+
+#define PAM_MAX_SIDE    (1 << 24)   // beyond what GRA's int sizes can describe once packed
+
+// Nearest TempleOS colour plus one of every RGB value, 0 until it is first
+// looked up. Filled in by whichever thread gets there first; they all
+// store the same value.
+static unsigned char nearest_lut[1 << 24];
+
+static int  is_space    (unsigned char c);
+static long skip_space  (const unsigned char *buf, long len, long pos);
+static long read_number (const unsigned char *buf, long len, long *pos);
+static int  nearest     (int r, int g, int b);
+
+static int is_space(unsigned char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Skips whitespace and # comments in a header
+static long skip_space(const unsigned char *buf, long len, long pos)
+{
+    while (pos < len){
+        if (buf[pos] == '#'){
+            while (pos < len && buf[pos] != '\n')
+                pos++;
+        } else if (is_space(buf[pos]))
+            pos++;
+        else
+            break;
+    }
+    return pos;
+}
+
+// Reads a decimal number of the header, or returns -1 if there isn't one
+static long read_number(const unsigned char *buf, long len, long *pos)
+{
+    long    value = 0, start;
+
+    *pos = skip_space(buf, len, *pos);
+    start = *pos;
+    while (*pos < len && buf[*pos] >= '0' && buf[*pos] <= '9' && value < PAM_MAX_SIDE)
+        value = value * 10 + buf[(*pos)++] - '0';
+    return *pos > start ? value : -1;
+}
+
+int gra_pam_parse(const unsigned char *buf, long len, GraPam *pam,
+        const char **why)
+{
+    long    pos = 2, width = -1, height = -1, depth = -1, maxval = -1, start;
+
+    if (len < 2 || buf[0] != 'P' || (buf[1] != '6' && buf[1] != '7')){
+        *why = "Not a PPM (P6) or PAM (P7) image";
+        return 0;
+    }
+    if (buf[1] == '6'){
+        width = read_number(buf, len, &pos);
+        height = read_number(buf, len, &pos);
+        maxval = read_number(buf, len, &pos);
+        depth = 3;
+        pos++;      // the single whitespace before the pixels
+    } else {
+        // Lines of "NAME value" up to ENDHDR; TUPLTYPE is implied by DEPTH
+        for (;;){
+            pos = skip_space(buf, len, pos);
+            start = pos;
+            while (pos < len && !is_space(buf[pos]))
+                pos++;
+            if (pos == start){
+                *why = "PAM header has no ENDHDR";
+                return 0;
+            }
+            if (pos - start == 6 && !memcmp(buf + start, "ENDHDR", 6)){
+                pos++;
+                break;
+            } else if (pos - start == 5 && !memcmp(buf + start, "WIDTH", 5))
+                width = read_number(buf, len, &pos);
+            else if (pos - start == 6 && !memcmp(buf + start, "HEIGHT", 6))
+                height = read_number(buf, len, &pos);
+            else if (pos - start == 5 && !memcmp(buf + start, "DEPTH", 5))
+                depth = read_number(buf, len, &pos);
+            else if (pos - start == 6 && !memcmp(buf + start, "MAXVAL", 6))
+                maxval = read_number(buf, len, &pos);
+            else {
+                while (pos < len && buf[pos] != '\n')
+                    pos++;
+            }
+        }
+    }
+
+    if (width < 1 || height < 1 || width >= PAM_MAX_SIDE || height >= PAM_MAX_SIDE){
+        *why = "Image has no size or is too big";
+        return 0;
+    }
+    if (depth < 1 || depth > 4){
+        *why = "Only grey, grey and alpha, RGB and RGB and alpha images are supported";
+        return 0;
+    }
+    if (maxval != 255){
+        *why = "Only 8-bit images (MAXVAL 255) are supported";
+        return 0;
+    }
+    if (pos > len || (len - pos) / depth / width < height){
+        *why = "Image data is cut short";
+        return 0;
+    }
+
+    pam->width = width;
+    pam->height = height;
+    pam->depth = depth;
+    pam->pixels = buf + pos;
+    return 1;
+}
+
+static int nearest(int r, int g, int b)
+{
+    unsigned char  *entry = &nearest_lut[(r << 16) | (g << 8) | b];
+    int             index = __atomic_load_n(entry, __ATOMIC_RELAXED);
+
+    if (!index){
+        index = gra_palette_nearest(gra_templeos_colors, r, g, b) + 1;
+        __atomic_store_n(entry, index, __ATOMIC_RELAXED);
+    }
+    return index - 1;
+}
+
+void gra_pam_pack(const GraPam *pam, unsigned char *dest)
+{
+    const unsigned char *src = pam->pixels;
+    unsigned char        alpha_value;
+    long                 i, n = (long)pam->width * pam->height;
+
+    for (i = 0; i < n; i++, src += pam->depth){
+        switch (pam->depth){
+            case 1:  dest[i] = nearest(src[0], src[0], src[0]); alpha_value = 0; break;
+            case 2:  dest[i] = nearest(src[0], src[0], src[0]); alpha_value = 0xFF - src[1]; break;
+            case 3:  dest[i] = nearest(src[0], src[1], src[2]); alpha_value = 0; break;
+            default: dest[i] = nearest(src[0], src[1], src[2]); alpha_value = 0xFF - src[3]; break;
+        }
+        dest[i] |= alpha_value & 0xF0;
+    }
+}
+
+int gra_pam_convert(const char *name, const unsigned char *buf, long len,
+        FILE *out, int *width, int *height)
+{
+    GraPam          pam;
+    const char     *why;
+    unsigned char  *pixels, *body;
+    int             header[4];      // width, width_internal, height, flags
+    long            body_size;
+
+    if (!gra_pam_parse(buf, len, &pam, &why)){
+        fprintf(stderr, "%s: %s\n", name, why);
+        return 1;
+    }
+    pixels = malloc((size_t)pam.width * pam.height);
+    if (!pixels){
+        fprintf(stderr, "%s: %s\n", name, strerror(ENOMEM));
+        return 1;
+    }
+    gra_pam_pack(&pam, pixels);
+    body_size = compress(&body, pixels, (long)pam.width * pam.height);
+    free(pixels);
+
+    header[0] = pam.width;
+    header[1] = (pam.width + 7) & ~7;
+    header[2] = pam.height;
+    header[3] = DCF_COMPRESSED;
+    if (fwrite(header, GRA_HEADER_SIZE, 1, out) != 1 ||
+            fwrite(body, body_size, 1, out) != 1){
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        free(body);
+        return 1;
+    }
+    free(body);
+    *width = pam.width;
+    *height = pam.height;
+    return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * gra-pam.h   Turning PAM and PPM images into GRA files, for gra-convert.
+ *
+ * Reads 8-bit PPM (P6) and PAM (P7) images with 1 to 4 channels (grey,
+ * grey and alpha, RGB, RGB and alpha), maps every pixel to the nearest of
+ * the 16 TempleOS colours with its transparency in the high nibble, the
+ * same bytes the GIMP plugin saves, and writes them out as a compressed
+ * GRA. The nearest colour of each RGB value is worked out once per process
+ * and kept in a table shared by every thread.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRA_PAM_H__
+#define __GRA_PAM_H__
+
+#include <stdio.h>
+
+typedef struct _GraPam
+{
+    int                  width, height;
+    int                  depth;     // channels: 1 grey, 2 grey+alpha, 3 RGB, 4 RGBA
+    const unsigned char *pixels;    // width * height * depth bytes, in the parsed buffer
+} GraPam;
+
+// Parses the len bytes at buf as a PPM or PAM image. Returns 0, with why
+// set, if it isn't one this can convert or is cut short.
+int  gra_pam_parse   (const unsigned char *buf, long len, GraPam *pam,
+                      const char **why);
+// Writes pam->width * pam->height GRA bytes to dest
+void gra_pam_pack    (const GraPam *pam, unsigned char *dest);
+// Converts the PPM or PAM image in the len bytes at buf to a GRA file
+// written to out. Errors are reported on stderr against name. Returns 0 on
+// success, 1 on failure; *width and *height get the image's size.
+int  gra_pam_convert (const char *name, const unsigned char *buf, long len,
+                      FILE *out, int *width, int *height);
+
+#endif /* __GRA_PAM_H__ */
@@ -0,0 +1,315 @@
+/*
+ * gra-preview.c   What an export will look like, worked out while the
+ *                 export dialog is open.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <libgimp/gimp.h>
+#include <libgimp/gimpui.h>
+
+#include "gra.h"
+#include "gra-format.h"
+#include "gra-expand.h"
+#include "gra-preview.h"
+#include "compression.h"
+
+#define PREVIEW_STRIP_BYTES (4 << 20)   // RGBA fetched from the drawable at once
+
+struct _GraPreview
+{
+    GeglBuffer    *buffer;
+    gint           x, y, width, height;    // area of buffer that is exported
+    gint           preview_width, preview_height;
+    gint          *columns;         // drawable column of each preview column
+    guchar         color_map[3 * 16];
+    GtkWidget     *area, *label;
+    GThread       *thread;
+    gint           stop;            // atomic, makes the thread give up
+    gboolean       dither;
+    GMutex         lock;            // guards the fields below
+    guchar        *pixels;          // the preview, RGBA
+    gboolean       pixels_ready;    // pixels are complete and not drawn yet
+    long           estimate;        // file size, or -1 if not known (yet)
+    gboolean       too_big;         // no memory to compress the whole image
+    guint          idle_id;
+};
+
+static void     preview_start  (GraPreview     *preview);
+static gpointer preview_thread (gpointer        data);
+static gboolean preview_idle   (gpointer        data);
+static void     preview_notify (GraPreview     *preview);
+static void     quantize_row   (const GraPreview *preview,
+                                guchar         *dest,
+                                const guchar   *src,
+                                gint           *err,
+                                gint           *err_next);
+static int      estimate_sink  (void           *user_data,
+                                const guchar   *buf,
+                                long            len,
+                                long            offset);
+
+GraPreview *
+gra_preview_new (gint32 drawable_ID, const GeglRectangle *rect,
+        gboolean dither, GtkWidget *box)
+{
+    GraPreview  *preview = g_new0 (GraPreview, 1);
+    gint         longest, x;
+
+    preview->buffer = gimp_drawable_get_buffer (drawable_ID);
+    preview->x      = rect->x;
+    preview->y      = rect->y;
+    preview->width  = rect->width;
+    preview->height = rect->height;
+    preview->dither = dither;
+    get_color_map (preview->color_map);
+    g_mutex_init (&preview->lock);
+
+    // Scaled down to fit GRA_PREVIEW_SIZE, never up
+    longest = MAX (preview->width, preview->height);
+    if (longest > GRA_PREVIEW_SIZE){
+        preview->preview_width  = MAX (1, (gint64) preview->width * GRA_PREVIEW_SIZE / longest);
+        preview->preview_height = MAX (1, (gint64) preview->height * GRA_PREVIEW_SIZE / longest);
+    } else {
+        preview->preview_width  = preview->width;
+        preview->preview_height = preview->height;
+    }
+    preview->columns = g_new (gint, preview->preview_width);
+    for (x = 0; x < preview->preview_width; x++)
+        preview->columns[x] = (2 * (gint64) x + 1) * preview->width / (2 * preview->preview_width);
+    preview->pixels = g_new0 (guchar, (gsize) preview->preview_width * preview->preview_height * 4);
+
+    preview->area = gimp_preview_area_new ();
+    gtk_widget_set_size_request (preview->area,
+            preview->preview_width, preview->preview_height);
+    gtk_box_pack_start (GTK_BOX (box), preview->area, FALSE, FALSE, 0);
+    gtk_widget_show (preview->area);
+
+    preview->label = gtk_label_new (NULL);
+    gtk_box_pack_start (GTK_BOX (box), preview->label, FALSE, FALSE, 0);
+    gtk_widget_show (preview->label);
+
+    preview_start (preview);
+    return preview;
+}
+
+void
+gra_preview_set_dither (GraPreview *preview, gboolean dither)
+{
+    if (preview->dither == dither)
+        return;
+    preview->dither = dither;
+    preview_start (preview);
+}
+
+void
+gra_preview_free (GraPreview *preview)
+{
+    if (preview->thread){
+        g_atomic_int_set (&preview->stop, TRUE);
+        g_thread_join (preview->thread);
+    }
+    // The thread is gone, and the idle callback runs on this thread, so
+    // idle_id can't change under us
+    if (preview->idle_id)
+        g_source_remove (preview->idle_id);
+    g_object_unref (preview->buffer);
+    g_mutex_clear (&preview->lock);
+    g_free (preview->columns);
+    g_free (preview->pixels);
+    g_free (preview);
+}
+
+// Stops the thread if it's running and starts it again with the current
+// options. The last preview stays up until the new one is ready.
+static void
+preview_start (GraPreview *preview)
+{
+    if (preview->thread){
+        g_atomic_int_set (&preview->stop, TRUE);
+        g_thread_join (preview->thread);
+    }
+    g_atomic_int_set (&preview->stop, FALSE);
+    preview->pixels_ready = FALSE;
+    preview->estimate = -1;
+    preview->too_big = FALSE;
+    gtk_label_set_text (GTK_LABEL (preview->label), "Estimating file size...");
+    preview->thread = g_thread_new ("gra-preview", preview_thread, preview);
+}
+
+// Maps the drawable to GRA bytes a strip at a time, filling in the preview
+// rows as it passes them, then compresses the bytes to find the file size
+static gpointer
+preview_thread (gpointer data)
+{
+    GraPreview  *preview = data;
+    const Babl  *format = babl_format ("R'G'B'A u8");
+    guchar      *packed, *line, *rgba, *samples, *dest;
+    gint        *err = NULL, *err_next = NULL, *temp;
+    gint         rows, y, row, x, py = 0;
+    long         size;
+
+    // The whole image is needed for the estimate; without room for it the
+    // preview is still made a line at a time
+    packed = g_try_new (guchar, (gsize) preview->width * preview->height);
+    line = g_new (guchar, preview->width);
+    samples = g_new (guchar, preview->preview_width);
+    rows = CLAMP (PREVIEW_STRIP_BYTES / ((gsize) preview->width * 4), 1, preview->height);
+    rgba = g_new (guchar, (gsize) preview->width * 4 * rows);
+    if (preview->dither){
+        err = g_new0 (gint, 3 * (preview->width + 2));
+        err_next = g_new0 (gint, 3 * (preview->width + 2));
+    }
+
+    for (y = 0; y < preview->height; y += rows){
+        if (g_atomic_int_get (&preview->stop))
+            goto done;
+        if (y + rows > preview->height)
+            rows = preview->height - y;
+        gegl_buffer_get (preview->buffer,
+                GEGL_RECTANGLE (preview->x, preview->y + y, preview->width, rows), 1.0, format,
+                rgba, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+
+        for (row = 0; row < rows; row++){
+            dest = packed ? packed + (gsize) (y + row) * preview->width : line;
+            quantize_row (preview, dest,
+                    rgba + (gsize) row * preview->width * 4, err, err_next);
+            if (err){
+                temp = err;
+                err = err_next;
+                err_next = temp;
+                memset (err_next, 0, sizeof (gint) * 3 * (preview->width + 2));
+            }
+
+            // Preview rows sample the drawable row at their centre
+            while (py < preview->preview_height &&
+                    (2 * (gint64) py + 1) * preview->height / (2 * preview->preview_height) == y + row){
+                for (x = 0; x < preview->preview_width; x++)
+                    samples[x] = dest[preview->columns[x]];
+                gra_expand_rgba (preview->pixels + (gsize) py * preview->preview_width * 4,
+                        samples, preview->preview_width, preview->color_map);
+                py++;
+            }
+        }
+    }
+
+    g_mutex_lock (&preview->lock);
+    preview->pixels_ready = TRUE;
+    preview->too_big = !packed;
+    preview_notify (preview);
+    g_mutex_unlock (&preview->lock);
+
+    if (packed){
+        size = compress_chunked (packed, (long) preview->width * preview->height,
+                GRA_PREVIEW_CHUNK, estimate_sink, preview);
+        if (size >= 0){
+            g_mutex_lock (&preview->lock);
+            preview->estimate = GRA_HEADER_SIZE + size;
+            preview_notify (preview);
+            g_mutex_unlock (&preview->lock);
+        }
+    }
+
+done:
+    g_free (packed);
+    g_free (line);
+    g_free (samples);
+    g_free (rgba);
+    g_free (err);
+    g_free (err_next);
+    return NULL;
+}
+
+// Has preview_idle show what's new, unless it's already due to. Called with
+// the lock held.
+static void
+preview_notify (GraPreview *preview)
+{
+    if (!preview->idle_id)
+        preview->idle_id = g_idle_add (preview_idle, preview);
+}
+
+// Shows the finished preview and estimate, on the dialog's thread
+static gboolean
+preview_idle (gpointer data)
+{
+    GraPreview  *preview = data;
+    gchar       *size, *text;
+
+    g_mutex_lock (&preview->lock);
+    preview->idle_id = 0;
+    if (preview->pixels_ready){
+        gimp_preview_area_draw (GIMP_PREVIEW_AREA (preview->area), 0, 0,
+                preview->preview_width, preview->preview_height,
+                GIMP_RGBA_IMAGE, preview->pixels, preview->preview_width * 4);
+        preview->pixels_ready = FALSE;
+    }
+    if (preview->estimate >= 0){
+        size = g_format_size (preview->estimate);
+        text = g_strdup_printf ("Estimated file size: %s", size);
+        gtk_label_set_text (GTK_LABEL (preview->label), text);
+        g_free (text);
+        g_free (size);
+    } else if (preview->too_big){
+        gtk_label_set_text (GTK_LABEL (preview->label),
+                "The image is too big to estimate its file size");
+    }
+    g_mutex_unlock (&preview->lock);
+    return FALSE;
+}
+
+// Maps one row of RGBA to GRA bytes: the nearest TempleOS colour, after
+// adding the error carried in err if dithering, and the transparency in
+// the high nibble as WriteGRA packs it. err and err_next have a pixel of
+// padding at each end.
+static void
+quantize_row (const GraPreview *preview, guchar *dest, const guchar *src,
+        gint *err, gint *err_next)
+{
+    gint    value[3], index, e, c, x;
+    guchar  alpha_value;
+
+    for (x = 0; x < preview->width; x++, src += 4){
+        for (c = 0; c < 3; c++)
+            value[c] = err ? CLAMP (src[c] + err[3 * (x + 1) + c] / 16, 0, 255) : src[c];
+        index = gra_palette_nearest (preview->color_map, value[0], value[1], value[2]);
+        if (err){
+            // Floyd-Steinberg: 7/16 to the right, 3/16, 5/16 and 1/16 below
+            for (c = 0; c < 3; c++){
+                e = value[c] - preview->color_map[3 * index + c];
+                err[3 * (x + 2) + c]      += e * 7;
+                err_next[3 * x + c]       += e * 3;
+                err_next[3 * (x + 1) + c] += e * 5;
+                err_next[3 * (x + 2) + c] += e;
+            }
+        }
+        alpha_value = 0xFF - src[3];
+        dest[x] = index | (alpha_value & 0xF0);
+    }
+}
+
+// ArcChunkSink for the estimate: only the size is wanted, so nothing is
+// kept. Gives up once the thread is asked to stop.
+static int
+estimate_sink (void *user_data, const guchar *buf, long len, long offset)
+{
+    GraPreview  *preview = user_data;
+
+    return !g_atomic_int_get (&preview->stop);
+}
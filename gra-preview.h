@@ -0,0 +1,50 @@
+/*
+ * gra-preview.h   What an export will look like, worked out while the
+ *                 export dialog is open.
+ *
+ * When an image has to be brought down to the 16 TempleOS colours to be
+ * exported, the dialog shows a scaled down copy of the result and an
+ * estimate of the file size. Both come from a thread that maps every pixel
+ * of the drawable to its nearest colour, optionally with Floyd-Steinberg
+ * dithering, and compresses the result without writing it anywhere. When
+ * an option changes the thread is stopped and started again, so the dialog
+ * never waits for it.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRA_PREVIEW_H__
+#define __GRA_PREVIEW_H__
+
+#define GRA_PREVIEW_SIZE    256             // longest side of the preview
+#define GRA_PREVIEW_CHUNK   (16 * 1024)     // compressed bytes between checks for a restart
+
+typedef struct _GraPreview GraPreview;
+
+// Packs the preview and the size estimate into box and starts working them
+// out for rect of drawable_ID
+GraPreview *gra_preview_new        (gint32               drawable_ID,
+                                    const GeglRectangle *rect,
+                                    gboolean             dither,
+                                    GtkWidget           *box);
+// Starts again with dithering on or off
+void        gra_preview_set_dither (GraPreview  *preview,
+                                    gboolean     dither);
+// Stops the thread; call before the widgets are destroyed
+void        gra_preview_free       (GraPreview  *preview);
+
+#endif /* __GRA_PREVIEW_H__ */
@@ -23,6 +23,7 @@
 
 #include <errno.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,133 +35,779 @@
 #include "gra.h"
 
 #include "compression.h"
+#include "gra-cache.h"
+#include "gra-expand.h"
+#include "gra-format.h"
+#include "gra-trace.h"
 
-#define DCF_COMPRESSED  0x01
-#define DCF_PALETTE     0x02 //TODO: Implement this
+#define GRA_BAND_ROWS   64  // rows decoded and handed to GEGL at a time, divides GRA_INDEX_ROWS
 
-gint32 ReadGRA (const gchar *name, GError **error)
+// Pixel formats the decoder can write into directly
+typedef enum
+{
+    GRA_LAYOUT_INDEXEDA,    // colour index and alpha
+    GRA_LAYOUT_INDEXED,     // colour index only, while the image has been opaque
+    GRA_LAYOUT_RGBA         // colour looked up in the palette, and alpha
+} GraLayout;
+
+// Receives the decoded GRA bytes and turns them straight into rows of the
+// layer's format, flushing them to the layer a band of rows at a time
+typedef struct _GraLayerSink
 {
-    // My files
-    FILE            *fd;
-    gint            width, width_internal, height, flags;
-    guchar          *body;
-    long            original, body_size;
-    GimpPixelRgn    pixel_rgn;
-    GimpDrawable    *drawable;
-    guchar          color_map[3*16];
-    gint32          image;
     gint32          layer;
-    guchar          *alpha_body;
-    int             i;
+    GeglBuffer     *buffer;
+    const Babl     *format;
+    GraLayout       layout;
+    gint            bpp;
+    gint            width, height;
+    gint            stride;     // bytes of a row in the stream: width, or width_internal
+    guchar         *band;       // band_rows rows in the layer's format
+    gint            band_rows;
+    gint            band_y;     // row at the start of band
+    const guchar   *color_map;
+} GraLayerSink;
 
-    // My code
-    filename = name;
-    fd = g_fopen (filename, "rb");
+// A file of a batch load, decoded on a pool thread into memory and then
+// turned into an image on the main thread
+typedef struct _GraBatchItem
+{
+    const gchar    *path;
+    gchar          *display_name;
+    GraHeader       header;
+    gint            stride;
+    guchar          color_map[3*16];
+    guchar         *pixels;     // the stream's GRA bytes, stride a row
+    GError         *error;
+} GraBatchItem;
 
-    if (!fd)
-    {
-        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-                "Could not open '%s' for reading: %s",
-                gimp_filename_to_utf8 (filename), g_strerror (errno));
-        goto out;
+// One thread's share of a parallel decode: the rows from one checkpoint of
+// the load index up to a later one
+typedef struct _GraDecodeJob
+{
+    guchar                     *pixels;     // the whole image's GRA bytes, shared by the jobs
+    long                        size, chunk;
+    guchar                     *body;
+    long                        body_size;
+    const ArcExpandCheckpoint  *from;       // NULL for the start of the image
+    long                        end;        // -1 for the end of the image
+    long                        expanded;
+} GraDecodeJob;
+
+// A file as an ArcReadFn source, starting with the bytes of it that
+// open_gra_file had to read already
+typedef struct _GraFileReader
+{
+    FILE           *fd;
+    const guchar   *pending;
+    long            pending_len;
+} GraFileReader;
+
+static gboolean expand_gra_bytes (guchar    *dest,
+                              const guchar  *src,
+                              long           n,
+                              GraLayout      layout,
+                              const guchar  *color_map);
+static gboolean layer_sink_add_alpha (GraLayerSink *sink,
+                              long           done);
+static int  layer_sink_write (void          *user_data,
+                              const guchar  *buf,
+                              long           len,
+                              long           offset);
+static gpointer decode_job_run (gpointer       data);
+static FILE   *open_gra_file (const gchar   *path,
+                              const gchar   *display_name,
+                              GraHeader     *header,
+                              guchar        *color_map,
+                              guchar        *sniff,
+                              GError       **error);
+static guchar *read_gra_file (const gchar   *path,
+                              const gchar   *display_name,
+                              GraHeader     *header,
+                              gint          *stride,
+                              guchar        *color_map,
+                              long          *body_size,
+                              GError       **error);
+static gint32 create_gra_image (const gchar  *path,
+                              gint           width,
+                              gint           height,
+                              gint           stride,
+                              GraLayout      layout,
+                              const guchar  *color_map,
+                              gint           band_rows,
+                              GraLayerSink  *sink,
+                              GError       **error);
+static long   file_read      (void          *user_data,
+                              guchar        *buf,
+                              long           len);
+static gint32 read_gra_strips (const gchar  *path,
+                              gsize          ceiling,
+                              GError       **error);
+static void finish_gra_image (GraLayerSink  *sink);
+static GraLayout load_layout (void);
+static int  batch_sink_write (void          *user_data,
+                              const guchar  *buf,
+                              long           len,
+                              long           offset);
+static void batch_decode     (gpointer       data,
+                              gpointer       user_data);
+static int  job_sink_write   (void          *user_data,
+                              const guchar  *buf,
+                              long           len,
+                              long           offset);
+static guchar *decode_parallel (guchar      *body,
+                              long           body_size,
+                              gint           stride,
+                              gint           height,
+                              ArcExpandIndex *index);
+
+// Returns FALSE if some of the pixels weren't opaque and layout has no
+// alpha to hold their transparency
+static gboolean
+expand_gra_bytes (guchar *dest, const guchar *src, long n, GraLayout layout,
+        const guchar *color_map)
+{
+    switch (layout){
+        case GRA_LAYOUT_INDEXEDA:
+            gra_expand_indexeda (dest, src, n);
+            break;
+
+        case GRA_LAYOUT_INDEXED:
+            return !gra_expand_indexed (dest, src, n);
+
+        case GRA_LAYOUT_RGBA:
+            gra_expand_rgba (dest, src, n, color_map);
+            break;
     }
+    return TRUE;
+}
 
-    gimp_progress_init_printf ("Opening '%s'",
-            gimp_filename_to_utf8 (name));
+// Gives the layer an alpha channel once the first pixel that isn't opaque
+// turns up, flushing the bands before it and widening the done pixels of
+// the current one. Until then an opaque image is sent to GIMP a byte a
+// pixel instead of two.
+static gboolean
+layer_sink_add_alpha (GraLayerSink *sink, long done)
+{
+    long            i;
 
-    if (!ReadOK(fd, &width, 4)){
-        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-                "Error reading width");
-        goto out;
+    g_object_unref (sink->buffer);
+    gimp_layer_add_alpha (sink->layer);
+    sink->buffer = gimp_drawable_get_buffer (sink->layer);
+    sink->format = gimp_drawable_get_format (sink->layer);
+    sink->bpp = babl_format_get_bytes_per_pixel (sink->format);
+    sink->layout = GRA_LAYOUT_INDEXEDA;
+
+    for (i = done; i-- > 0;){
+        sink->band[2 * i + 1] = 0xFF;
+        sink->band[2 * i] = sink->band[i];
     }
+    return TRUE;
+}
 
-    if (!ReadOK(fd, &width_internal, 4)){
-        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-                "Error reading width_internal");
-        goto out;
+// ArcExpandSink for decompress_chunked. Runs arrive in order; each is
+// expanded into the current band, which goes to the layer once it's full.
+// The padding at the end of each row of a file with a stride wider than
+// the image is dropped.
+static int
+layer_sink_write (void *user_data, const guchar *buf, long len, long offset)
+{
+    GraLayerSink    *sink = user_data;
+    long            row, x, done, band_size, n;
+    gint            rows;
+
+    if (offset + len > (long)sink->stride * sink->height)
+        return FALSE;
+
+    while (len > 0){
+        row = offset / sink->stride;
+        x = offset % sink->stride;
+        if (x >= sink->width){
+            n = MIN (len, sink->stride - x);
+            buf += n;
+            len -= n;
+            offset += n;
+            continue;
+        }
+        rows = MIN (sink->band_rows, sink->height - sink->band_y);
+        band_size = (long)rows * sink->width;
+        done = (row - sink->band_y) * sink->width + x;
+        // Rows without padding follow each other, so one piece can fill
+        // the rest of the band
+        n = MIN (len, sink->stride == sink->width ? band_size - done : sink->width - x);
+
+        if (!expand_gra_bytes (sink->band + done * sink->bpp,
+                    buf, n, sink->layout, sink->color_map)){
+            if (!layer_sink_add_alpha (sink, done))
+                return FALSE;
+            expand_gra_bytes (sink->band + done * sink->bpp,
+                    buf, n, sink->layout, sink->color_map);
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+
+        if (done + n == band_size){
+            gegl_buffer_set (sink->buffer,
+                    GEGL_RECTANGLE (0, sink->band_y, sink->width, rows), 0,
+                    sink->format, sink->band, GEGL_AUTO_ROWSTRIDE);
+            sink->band_y += rows;
+        }
     }
+    return TRUE;
+}
+
+// ArcExpandSink for a decode job: stores its piece of the image's GRA bytes
+static int
+job_sink_write (void *user_data, const guchar *buf, long len, long offset)
+{
+    GraDecodeJob    *job = user_data;
+
+    if (offset + len > job->size)
+        return FALSE;
+    memcpy (job->pixels + offset, buf, len);
+    return TRUE;
+}
+
+static gpointer
+decode_job_run (gpointer data)
+{
+    GraDecodeJob *job = data;
+
+    job->expanded = decompress_range (job->body, job->body_size, job->from,
+            job->end, job->chunk, job_sink_write, job);
+    return NULL;
+}
+
+// Decodes body, height rows of stride bytes once expanded, into memory on
+// as many threads as there are cores, each starting at a checkpoint of index. Only the
+// main thread may touch the layer, so as in ReadGRABatch the threads
+// decode GRA bytes and the caller hands them to the layer. Returns them,
+// or NULL if any part failed.
+static guchar *
+decode_parallel (guchar *body, long body_size, gint stride, gint height,
+        ArcExpandIndex *index)
+{
+    GraDecodeJob  *jobs;
+    GThread      **threads;
+    guchar        *pixels;
+    gint           n_segments = index->count + 1;
+    gint           n_jobs, i, first, last;
+    long           size = (long)stride * height, expanded = 0;
+
+    for (i = 0; i < index->count; i++)
+        if (index->list[i].state.dst_pos != (i + 1) * index->interval)
+            return NULL;
+    pixels = g_try_malloc (size);
+    if (!pixels)
+        return NULL;
+
+    n_jobs = MIN (g_get_num_processors (), n_segments);
+    jobs = g_new0 (GraDecodeJob, n_jobs);
+    threads = g_new (GThread *, n_jobs);
+    for (i = 0; i < n_jobs; i++){
+        first = (gint64)i * n_segments / n_jobs;
+        last = (gint64)(i + 1) * n_segments / n_jobs;
+
+        jobs[i].pixels = pixels;
+        jobs[i].size = size;
+        jobs[i].chunk = (long)stride * GRA_BAND_ROWS;
+        jobs[i].body = body;
+        jobs[i].body_size = body_size;
+        jobs[i].from = first ? &index->list[first - 1] : NULL;
+        jobs[i].end = last < n_segments ? index->list[last - 1].state.dst_pos : -1;
+        threads[i] = g_thread_new ("gra-decode", decode_job_run, &jobs[i]);
+    }
+    for (i = 0; i < n_jobs; i++){
+        g_thread_join (threads[i]);
+        if (jobs[i].expanded < 0 || expanded < 0)
+            expanded = -1;
+        else
+            expanded += jobs[i].expanded;
+    }
+    g_free (threads);
+    g_free (jobs);
+    if (expanded != size){
+        g_free (pixels);
+        return NULL;
+    }
+    return pixels;
+}
+
+// Opens path, checks it is a GRA and reads its header into header and its
+// colors into color_map (3*16 bytes). Nothing is read beyond what the check
+// needs and the file is never seeked in, so path may be a pipe: what was
+// read is left in sniff (GRA_SNIFF_SIZE bytes), and the file at the start
+// of the pixels, or just past the CArcCompress header at
+// sniff + GRA_BODY_OFFSET. Only uses glib, so it can run on any thread;
+// display_name is path as it should appear in messages.
+static FILE *
+open_gra_file (const gchar *path, const gchar *display_name, GraHeader *header,
+        guchar *color_map, guchar *sniff, GError **error)
+{
+    FILE            *fd;
+    size_t          sniff_size;
+    struct stat     st;
+    GraTraceSpan    span = { 0 };
 
-    if (!ReadOK(fd, &height, 4)){
+    fd = g_fopen (path, "rb");
+    if (!fd)
+    {
         g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-                "Error reading height");
-        goto out;
+                "Could not open '%s' for reading: %s",
+                display_name, g_strerror (errno));
+        return NULL;
     }
 
-    if (!ReadOK(fd, &flags, 4)){
+    // Check this really is a GRA before trusting any of its fields
+    GRA_TRACE_BEGIN(span);
+    sniff_size = fread (sniff, 1, GRA_HEADER_SIZE, fd);
+    if (sniff_size == GRA_HEADER_SIZE)
+        sniff_size += fread (sniff + sniff_size, 1,
+                gra_sniff_size (sniff) - sniff_size, fd);
+    if (ferror (fd)){
         g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-                "Error reading flags");
-        goto out;
+                "Error reading header");
+        fclose (fd);
+        return NULL;
     }
+    if (!gra_sniff (sniff, sniff_size,
+                fstat (fileno (fd), &st) == 0 && S_ISREG (st.st_mode) ? (long)st.st_size : -1)){
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                "'%s' is not a valid GRA image", display_name);
+        fclose (fd);
+        return NULL;
+    }
+    gra_header_parse (sniff, header);
+    if (header->flags & DCF_PALETTE)
+        gra_palette_parse (sniff + GRA_HEADER_SIZE, color_map);
+    else
+        get_color_map (color_map);
+
+    GRA_TRACE_END(span, "header read", sniff_size);
+    return fd;
+}
+
+// open_gra_file, then reads the compressed data into the returned buffer.
+// stride is set to the bytes a row takes once it is expanded.
+static guchar *
+read_gra_file (const gchar *path, const gchar *display_name, GraHeader *header,
+        gint *stride, guchar *color_map, long *body_size, GError **error)
+{
+    FILE            *fd;
+    guchar          *body = NULL;
+    guchar          sniff[GRA_SNIFF_SIZE];
+    long            already;
+    GraTraceSpan    span = { 0 };
+
+    fd = open_gra_file (path, display_name, header, color_map, sniff, error);
+    if (!fd)
+        return NULL;
 
-    // Get size of body
-    original=ftell(fd);
-    fseek(fd,0,SEEK_END);
-    body_size = ftell(fd) - original;
-    fseek(fd,original,SEEK_SET);
+    // The size of the body is in its header, so the file needn't be one
+    // that can be seeked to its end
+    GRA_TRACE_BEGIN(span);
+    *body_size = gra_body_size (sniff);
+    *stride = gra_row_stride (sniff);
+    already = header->flags & DCF_COMPRESSED ? GRA_ARC_HEADER_SIZE : 0;
 
     // Allocate memory for the file
-    body = (guchar*) malloc (body_size);
-    if (!ReadOK(fd, body, body_size)){
+    body = (guchar*) malloc (*body_size);
+    if (!body){
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOMEM,
+                "Not enough memory to load '%s'", display_name);
+        goto out;
+    }
+    memcpy (body, sniff + GRA_BODY_OFFSET (header->flags), already);
+    if (!ReadOK(fd, body + already, *body_size - already)){
         g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
                 "Error reading body bytes");
+        free (body);
+        body = NULL;
         goto out;
     }
 
-    // Uncompress body data
-    if (flags & DCF_COMPRESSED){
-        guchar * decompressed_body;
-        decompress(body, body_size, &decompressed_body);
-        free(body);
-        body = decompressed_body;
-    }
+    GRA_TRACE_END(span, "body read", *body_size);
 
-    alpha_body = (guchar *) malloc(width * height * 2);
-    guchar alpha_value;
-    for (i = 0; i < width * height; i++){
-        // Set first byte to the colour
-        alpha_body[2*i] = body[i] & 0x0F;
+out:
+    fclose (fd);
+    return body;
+}
+
+// Creates the image for a width x height GRA loaded from path, with a single
+// layer in the format of layout, and sets sink up to fill that layer
+// band_rows rows at a time from a stream whose rows take stride bytes. A
+// GRA_LAYOUT_INDEXED layer gets alpha from the sink if it needs it.
+static gint32
+create_gra_image (const gchar *path, gint width, gint height, gint stride,
+        GraLayout layout, const guchar *color_map, gint band_rows,
+        GraLayerSink *sink, GError **error)
+{
+    GimpImageBaseType   base_type;
+    GimpImageType   layer_type;
+    gint32          image;
+    gint32          layer;
+
+    memset (sink, 0, sizeof (*sink));
+    sink->layout = layout;
+    sink->width = width;
+    sink->height = height;
+    sink->stride = stride;
+    sink->color_map = color_map;
+    sink->band_rows = band_rows;
 
-        // Get the alpha value, scale it to a fraction out of 256, set this as the second byte
-        alpha_value = 0xFF - (body[i] & 0xF0); // GIMP's alpha scale is the opposite of TempleOS'
-        alpha_body[2*i + 1] = alpha_value | (alpha_value >> 1);
+    if (layout == GRA_LAYOUT_RGBA){
+        base_type = GIMP_RGB;
+        layer_type = GIMP_RGBA_IMAGE;
+    } else {
+        base_type = GIMP_INDEXED;
+        layer_type = layout == GRA_LAYOUT_INDEXED ?
+            GIMP_INDEXED_IMAGE : GIMP_INDEXEDA_IMAGE;
     }
-    free(body);
-    body = alpha_body;
 
-    get_color_map(&color_map);
+    image = gimp_image_new (width, height, base_type);
 
-    image = gimp_image_new (width, height, GIMP_INDEXED); // Assuming base_type is indexed
+    if (base_type == GIMP_INDEXED){
+        if (!gimp_context_set_palette(PALETTE_NAME)){
+            // Not a breaking error but something's wrong with the plugin
+            g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                    "Couldn't find palette. Re-install plugin.");
+        }
+        gimp_image_set_colormap (image, color_map, 16); // no. of cols = 16
+    }
 
     layer = gimp_layer_new (image, "Background",
             width, height,
-            GIMP_INDEXEDA_IMAGE, 100, GIMP_NORMAL_MODE); // Assuming image type is indexed
+            layer_type, 100, GIMP_NORMAL_MODE);
 
-    gimp_image_set_filename (image, filename);
+    gimp_image_set_filename (image, path);
 
     gimp_image_insert_layer (image, layer, -1, 0);
-    drawable = gimp_drawable_get (layer);
 
-    gimp_pixel_rgn_init (&pixel_rgn, drawable,
-            0, 0, drawable->width, drawable->height, TRUE, FALSE);
+    sink->buffer = gimp_drawable_get_buffer (layer);
+    sink->format = layout == GRA_LAYOUT_RGBA ?
+        babl_format ("R'G'B'A u8") : gimp_drawable_get_format (layer);
+    sink->bpp = babl_format_get_bytes_per_pixel (sink->format);
+    sink->layer = layer;
+    // With room for the alpha layer_sink_add_alpha may add
+    sink->band = g_new (guchar, (gsize)width * band_rows * MAX (sink->bpp, 2));
+    return image;
+}
+
+// Hands what create_gra_image's sink wrote over to the core
+static void
+finish_gra_image (GraLayerSink *sink)
+{
+    GraTraceSpan    span = { 0 };
 
-    gimp_pixel_rgn_set_rect (&pixel_rgn, body,
-            0, 0, drawable->width, drawable->height);
+    // Dropping the buffer flushes its tiles to the core
+    GRA_TRACE_BEGIN(span);
+    g_object_unref (sink->buffer);
+    GRA_TRACE_END(span, "tile upload", (long long)sink->width * sink->height * sink->bpp);
+    g_free (sink->band);
+}
 
-    if (!gimp_context_set_palette(PALETTE_NAME)){
-        // Not a breaking error but something's wrong with the plugin
-        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-                "Couldn't find palette. Re-install plugin.");
+// Images open as indexed ones, the way they were drawn, without alpha until
+// a pixel that isn't opaque is decoded. With GRA_LOAD_RGBA set they open as
+// RGBA instead, with the palette already applied, for users who would
+// convert them to RGB straight away.
+static GraLayout
+load_layout (void)
+{
+    return g_getenv ("GRA_LOAD_RGBA") ? GRA_LAYOUT_RGBA : GRA_LAYOUT_INDEXED;
+}
+
+// ArcReadFn for a GraFileReader
+static long
+file_read (void *user_data, guchar *buf, long len)
+{
+    GraFileReader   *reader = user_data;
+    size_t          n;
+
+    if (reader->pending_len){
+        n = MIN (len, reader->pending_len);
+        memcpy (buf, reader->pending, n);
+        reader->pending += n;
+        reader->pending_len -= n;
+        return n;
+    }
+    n = fread (buf, 1, len, reader->fd);
+    return n ? (long)n : ferror (reader->fd) ? -1 : 0;
+}
+
+// Loads path keeping what is allocated for it within ceiling bytes, however
+// large the image: the body is read and decoded a window at a time and
+// handed to the layer in strips of as many rows as fit in a quarter of the
+// ceiling. The window and the decoded pieces take about a fifth, and GEGL's
+// tile cache another quarter (see run()). The load index and the parallel
+// decode are left out, as both need the whole body in memory.
+static gint32
+read_gra_strips (const gchar *path, gsize ceiling, GError **error)
+{
+    GraHeader       header;
+    GraLayerSink    sink;
+    guchar          color_map[3*16];
+    guchar          sniff[GRA_SNIFF_SIZE];
+    guchar          *buf;
+    FILE            *fd;
+    GraFileReader   reader;
+    gint32          image;
+    long            size, chunk, expanded_size, n;
+    gint            band_rows, stride;
+    GraTraceSpan    span = { 0 };
+
+    GRA_TRACE_BEGIN(span);
+    fd = open_gra_file (path, gimp_filename_to_utf8 (path), &header,
+            color_map, sniff, error);
+    if (!fd)
+        return -1;
+    stride = gra_row_stride (sniff);
+    size = (long)stride * header.height;
+
+    band_rows = CLAMP (ceiling / 4 / ((gsize)header.width * 4), 1,
+            (gsize)header.height);
+    chunk = MAX (ceiling / 16, GRA_MIN_CHUNK);
+    image = create_gra_image (path, header.width, header.height, stride,
+            load_layout (), color_map, band_rows, &sink, error);
+
+    if (header.flags & DCF_COMPRESSED){
+        reader.fd = fd;
+        reader.pending = sniff + GRA_BODY_OFFSET (header.flags);
+        reader.pending_len = GRA_ARC_HEADER_SIZE;
+        expanded_size = decompress_streamed (file_read, &reader, chunk,
+                layer_sink_write, &sink, NULL);
+    } else {
+        buf = g_new (guchar, chunk);
+        for (expanded_size = 0; expanded_size < size; expanded_size += n){
+            n = fread (buf, 1, MIN (chunk, size - expanded_size), fd);
+            if (!n || !layer_sink_write (&sink, buf, n, expanded_size))
+                break;
+        }
+        g_free (buf);
     }
-    gimp_image_set_colormap (image, color_map, 16); // no. of cols = 16
+    fclose (fd);
+    finish_gra_image (&sink);
 
-    gimp_drawable_flush(drawable);
-    gimp_drawable_detach(drawable);
-    g_free(body);
+    if (expanded_size != size){
+        g_clear_error (error);
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                "'%s' has corrupt or missing image data",
+                gimp_filename_to_utf8 (path));
+        gimp_image_delete (image);
+        return -1;
+    }
+    GRA_TRACE_END(span, "strip load", size);
+    return image;
+}
 
-out:
-    if (fd)
-        fclose (fd);
+gint32 ReadGRA (const gchar *name, GError **error)
+{
+    // My files
+    gint            width, height, flags, stride;
+    GraHeader       header;
+    guchar          *body, *pixels;
+    long            body_size;
+    GraLayerSink    sink;
+    GraLayout       layout;
+    ArcExpandIndex  *index;
+    gboolean        opaque;
+    guchar          color_map[3*16];
+    gint32          image;
+    long            expanded_size;
+    gsize           ceiling;
+
+    // My code
+    filename = name;
+
+    gimp_progress_init_printf ("Opening '%s'",
+            gimp_filename_to_utf8 (name));
+
+    ceiling = gra_memory_ceiling ();
+    if (ceiling)
+        return read_gra_strips (filename, ceiling, error);
+
+    body = read_gra_file (filename, gimp_filename_to_utf8 (filename), &header,
+            &stride, color_map, &body_size, error);
+    if (!body)
+        return -1;
+    width = header.width;
+    height = header.height;
+    flags = header.flags;
+
+    // With an index from an earlier load, bands can be decoded in parallel.
+    // The threads can't add alpha to the layer, so that load's finding of
+    // whether the image is opaque decides the layer's format up front.
+    layout = load_layout ();
+    index = NULL;
+    if (flags & DCF_COMPRESSED){
+        index = gra_index_new (stride, height);
+        if (gra_index_load (index, filename, width, height, &opaque) &&
+                !opaque && layout == GRA_LAYOUT_INDEXED)
+            layout = GRA_LAYOUT_INDEXEDA;
+    }
+
+    image = create_gra_image (filename, width, height, stride, layout,
+            color_map, GRA_BAND_ROWS, &sink, error);
+
+    // Decode the body straight into the layer's format, a band of rows at a
+    // time, instead of expanding it into memory and converting it after
+    if (index){
+        // Without an index, build it while decoding for next time
+        if (index->count){
+            pixels = NULL;
+            if (g_get_num_processors () > 1)
+                pixels = decode_parallel (body, body_size, stride, height, index);
+            if (pixels){
+                expanded_size = (long)stride * height;
+                if (!layer_sink_write (&sink, pixels, expanded_size, 0))
+                    expanded_size = -1;
+                g_free (pixels);
+            } else
+                expanded_size = decompress_chunked (body, body_size,
+                        (long)stride * GRA_BAND_ROWS, layer_sink_write, &sink);
+        } else {
+            expanded_size = decompress_indexed (body, body_size,
+                    (long)stride * GRA_BAND_ROWS, layer_sink_write, &sink, index);
+            if (expanded_size == (long)stride * height)
+                gra_index_store (index, filename, width, height,
+                        sink.layout == GRA_LAYOUT_INDEXED);
+        }
+        gra_index_free (index);
+    } else {
+        expanded_size = MIN (body_size, (long)stride * height);
+        if (!layer_sink_write (&sink, body, expanded_size, 0))
+            expanded_size = -1;
+    }
+
+    finish_gra_image (&sink);
+    free (body);
+
+    if (expanded_size != (long)stride * height){
+        g_clear_error (error);
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                "'%s' has corrupt or missing image data",
+                gimp_filename_to_utf8 (filename));
+        gimp_image_delete (image);
+        image = -1;
+    }
 
     // Set the resolution
     return image;
 }
+
+// ArcExpandSink for a batch item: stores the GRA bytes as they are
+static int
+batch_sink_write (void *user_data, const guchar *buf, long len, long offset)
+{
+    GraBatchItem    *item = user_data;
+
+    if (offset + len > (long)item->stride * item->header.height)
+        return FALSE;
+    memcpy (item->pixels + offset, buf, len);
+    return TRUE;
+}
+
+// GThreadPool worker for ReadGRABatch. Reads and decodes one file into
+// item->pixels, or sets item->error, then queues the item for the main
+// thread, which is the only one allowed to talk to GIMP.
+static void
+batch_decode (gpointer data, gpointer user_data)
+{
+    GraBatchItem    *item = data;
+    GAsyncQueue     *done = user_data;
+    guchar          *body;
+    long            body_size, size, expanded_size = -1;
+
+    body = read_gra_file (item->path, item->display_name, &item->header,
+            &item->stride, item->color_map, &body_size, &item->error);
+    if (body){
+        size = (long)item->stride * item->header.height;
+        item->pixels = g_try_malloc (size);
+        if (!item->pixels){
+            g_set_error (&item->error, G_FILE_ERROR, G_FILE_ERROR_NOMEM,
+                    "Not enough memory to load '%s'", item->display_name);
+        } else {
+            if (item->header.flags & DCF_COMPRESSED){
+                expanded_size = decompress_chunked (body, body_size,
+                        (long)item->stride * GRA_BAND_ROWS,
+                        batch_sink_write, item);
+            } else if (body_size >= size){
+                memcpy (item->pixels, body, size);
+                expanded_size = size;
+            }
+            if (expanded_size != size)
+                g_set_error (&item->error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                        "'%s' has corrupt or missing image data",
+                        item->display_name);
+        }
+        free (body);
+    }
+    g_async_queue_push (done, item);
+}
+
+// Loads each of the n_files paths as a new image, reading and decoding them
+// on a pool of threads while images are created for the ones already
+// decoded. images[i] gets the image for paths[i], or -1 if it couldn't be
+// loaded, and errors[i] (newly allocated) the reason, or "" if it could.
+void
+ReadGRABatch (const gchar **paths, gint n_files, gint32 *images, gchar **errors)
+{
+    GraBatchItem    *items, *item;
+    GThreadPool     *pool;
+    GAsyncQueue     *done;
+    GraLayerSink    sink;
+    GError          *error;
+    gsize           ceiling;
+    gint            i, n;
+
+    gimp_progress_init_printf ("Opening %d GRA images", n_files);
+
+    // Under a memory ceiling the files are loaded one after the other in
+    // strips, as decoding several at once means holding them all in memory
+    ceiling = gra_memory_ceiling ();
+    if (ceiling){
+        for (i = 0; i < n_files; i++){
+            error = NULL;
+            images[i] = read_gra_strips (paths[i], ceiling, &error);
+            errors[i] = g_strdup (images[i] == -1 && error ? error->message : "");
+            g_clear_error (&error);
+            gimp_progress_update ((gdouble)(i + 1) / n_files);
+        }
+        return;
+    }
+
+    items = g_new0 (GraBatchItem, n_files);
+    done = g_async_queue_new ();
+    pool = g_thread_pool_new (batch_decode, done, g_get_num_processors (),
+            FALSE, NULL);
+    for (i = 0; i < n_files; i++){
+        items[i].path = paths[i];
+        items[i].display_name = g_strdup (gimp_filename_to_utf8 (paths[i]));
+        g_thread_pool_push (pool, &items[i], NULL);
+    }
+
+    for (n = 0; n < n_files; n++){
+        item = g_async_queue_pop (done);
+        i = item - items;
+        images[i] = -1;
+        if (!item->error){
+            error = NULL;
+            images[i] = create_gra_image (item->path, item->header.width,
+                    item->header.height, item->stride, load_layout (),
+                    item->color_map, GRA_BAND_ROWS, &sink, &error);
+            layer_sink_write (&sink, item->pixels,
+                    (long)item->stride * item->header.height, 0);
+            finish_gra_image (&sink);
+            g_clear_error (&error);
+        }
+        errors[i] = g_strdup (item->error ? item->error->message : "");
+
+        g_clear_error (&item->error);
+        g_free (item->pixels);
+        g_free (item->display_name);
+        gimp_progress_update ((gdouble)(n + 1) / n_files);
+    }
+
+    g_thread_pool_free (pool, FALSE, TRUE);
+    g_async_queue_unref (done);
+    g_free (items);
+}
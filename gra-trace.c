@@ -0,0 +1,100 @@
+/*
+ * gra-trace.c   Writes Chrome trace events for the stages of a load or save.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "gra-trace.h"
+
+#ifndef GRA_DISABLE_TRACE
+
+int gra_trace_enabled = 0;
+
+static FILE            *trace_file = NULL;
+static pthread_mutex_t  trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Opens the file named by GRA_TRACE, if any. Events from every run are
+// appended to the same JSON array; the closing bracket is optional in the
+// trace-event format, so nothing needs to be rewritten between runs.
+void gra_trace_init(void)
+{
+    const char *path = getenv(GRA_TRACE_ENV);
+
+    if (trace_file || !path || !*path)
+        return;
+
+    trace_file = fopen(path, "a");
+    if (!trace_file)
+        return;
+    if (ftell(trace_file) == 0)
+        fputs("[\n", trace_file);
+    gra_trace_enabled = 1;
+}
+
+void gra_trace_finish(void)
+{
+    if (!trace_file)
+        return;
+    gra_trace_enabled = 0;
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+long long gra_trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Writes one complete ("X") event running from start until now. Peak memory
+// is the process' maximum resident set size so far, as reported by the OS.
+void gra_trace_event(const char *name, long long start, long long bytes)
+{
+    long long     end = gra_trace_now();
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file)
+        fprintf(trace_file,
+                "{\"name\":\"%s\",\"cat\":\"gra\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                "\"pid\":%d,\"tid\":%ld,"
+                "\"args\":{\"bytes\":%lld,\"peak_rss_kb\":%ld}},\n",
+                name, start, end - start,
+                (int)getpid(), (long)syscall(SYS_gettid),
+                bytes, usage.ru_maxrss);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+#else
+
+void gra_trace_init(void) {}
+void gra_trace_finish(void) {}
+long long gra_trace_now(void) { return 0; }
+void gra_trace_event(const char *name, long long start, long long bytes) {}
+
+#endif /* GRA_DISABLE_TRACE */
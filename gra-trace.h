@@ -0,0 +1,55 @@
+/*
+ * gra-trace.h   Per-stage timing of the load and save paths.
+ *
+ * When the GRA_TRACE environment variable names a file, every traced stage
+ * is appended to it as a Chrome trace event (load it in chrome://tracing or
+ * Perfetto). When it is unset the macros below cost a single test of
+ * gra_trace_enabled, and building with -DGRA_DISABLE_TRACE removes them.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRA_TRACE_H__
+#define __GRA_TRACE_H__
+
+#define GRA_TRACE_ENV   "GRA_TRACE"
+
+typedef struct _GraTraceSpan
+{
+    long long start;    // microseconds, monotonic
+} GraTraceSpan;
+
+#ifdef GRA_DISABLE_TRACE
+#define gra_trace_enabled 0
+#else
+extern int gra_trace_enabled;
+#endif
+
+void      gra_trace_init   (void);
+void      gra_trace_finish (void);
+long long gra_trace_now    (void);
+void      gra_trace_event  (const char *name, long long start, long long bytes);
+
+// Marks the start of a stage
+#define GRA_TRACE_BEGIN(span) \
+    do { if (gra_trace_enabled) (span).start = gra_trace_now(); } while (0)
+
+// Records the stage started by GRA_TRACE_BEGIN, with the number of bytes it handled
+#define GRA_TRACE_END(span, name, bytes) \
+    do { if (gra_trace_enabled) gra_trace_event(name, (span).start, bytes); } while (0)
+
+#endif /* __GRA_TRACE_H__ */
@@ -0,0 +1,519 @@
+/*
+ * gra-watch.c   gra-convert --watch: converts images as they land in a
+ *               directory.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gra-pam.h"
+#include "gra-watch.h"
+
+#define WATCH_BUCKETS   1024            // in the table of files seen, a power of 2
+#define WATCH_EVENTS    (16 * 1024)     // bytes of inotify events read at once
+#define WATCH_MASK      (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY | IN_CREATE)
+
+enum
+{
+    WATCH_IDLE,
+    WATCH_QUEUED,
+    WATCH_RUNNING
+};
+
+typedef struct _WatchFile
+{
+    char               *name;
+    uint64_t            hash;       // of the content last converted
+    int                 hashed;     // hash is set
+    double              due;        // ms at which to convert it, 0 if nothing is pending
+    int                 state;
+    double              again;      // delay to convert it after once it's done, if it
+                                    // changed while queued or running; -1 if it didn't
+    struct _WatchFile  *next;       // in the same bucket
+} WatchFile;
+
+typedef struct
+{
+    const char         *dir, *out_dir;
+    int                 debounce_ms;
+    int                 pipe_fds[2];    // wakes the main loop: a worker finished or a signal arrived
+    pthread_mutex_t     lock;           // guards everything below
+    pthread_cond_t      wake;           // there's something in the queue, or stop is set
+    WatchFile          *files[WATCH_BUCKETS];
+    WatchFile         **queue;          // ring of queue_size
+    int                 queue_size, queue_head, queue_count;
+    int                 stop;
+} Watch;
+
+static volatile sig_atomic_t watch_signalled;
+static int                   watch_signal_fd = -1;
+
+static double     now_ms        (void);
+static int        is_image_name (const char *name);
+static char      *make_path     (const char *dir, const char *prefix,
+                                 const char *name, int name_len, const char *suffix);
+static uint64_t   content_hash  (const unsigned char *buf, long len);
+static unsigned char *read_file (const char *path, long *len);
+static WatchFile *file_lookup   (Watch *watch, const char *name);
+static void       note_change   (Watch *watch, const char *name, double delay);
+static int        scan_dir      (Watch *watch);
+static int        dispatch      (Watch *watch);
+static void       convert_file  (Watch *watch, WatchFile *file);
+static void      *worker_thread (void *data);
+static void       wake_main     (int fd);
+static void       on_signal     (int sig);
+
+static double now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+// PPM and PAM files, leaving out hidden ones such as our own temporaries
+static int is_image_name(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+
+    return name[0] != '.' && dot &&
+        (!strcasecmp(dot, ".ppm") || !strcasecmp(dot, ".pnm") || !strcasecmp(dot, ".pam"));
+}
+
+// dir/prefix + name_len bytes of name + suffix
+static char *make_path(const char *dir, const char *prefix, const char *name,
+        int name_len, const char *suffix)
+{
+    size_t  size = strlen(dir) + strlen(prefix) + name_len + strlen(suffix) + 2;
+    char   *path = malloc(size);
+
+    snprintf(path, size, "%s/%s%.*s%s", dir, prefix, name_len, name, suffix);
+    return path;
+}
+
+// A 64-bit hash of the file, a word at a time
+static uint64_t content_hash(const unsigned char *buf, long len)
+{
+    uint64_t    hash = 0x9E3779B97F4A7C15ull ^ len, word;
+    long        i;
+
+    for (i = 0; i + 8 <= len; i += 8){
+        memcpy(&word, buf + i, 8);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+    }
+    for (; i < len; i++)
+        hash = (hash ^ buf[i]) * 0x100000001B3ull;
+    return hash;
+}
+
+// Reads the whole file, or returns NULL with errno set
+static unsigned char *read_file(const char *path, long *len)
+{
+    struct stat     info;
+    unsigned char  *buf;
+    ssize_t         got;
+    int             fd, saved;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &info) < 0 || !(buf = malloc(info.st_size ? info.st_size : 1))){
+        saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+    for (*len = 0; *len < info.st_size; *len += got){
+        got = read(fd, buf + *len, info.st_size - *len);
+        if (got < 0 && errno == EINTR)
+            got = 0;
+        else if (got <= 0)
+            break;      // shrank since the stat; what's there is still parsed
+    }
+    close(fd);
+    return buf;
+}
+
+// The record of name, made if it hasn't been seen before. Called with the
+// lock held.
+static WatchFile *file_lookup(Watch *watch, const char *name)
+{
+    unsigned int    bucket = 0;
+    const char     *c;
+    WatchFile      *file;
+
+    for (c = name; *c; c++)
+        bucket = bucket * 31 + (unsigned char) *c;
+    bucket &= WATCH_BUCKETS - 1;
+
+    for (file = watch->files[bucket]; file; file = file->next)
+        if (!strcmp(file->name, name))
+            return file;
+    file = calloc(1, sizeof(WatchFile));
+    file->name = strdup(name);
+    file->again = -1;
+    file->next = watch->files[bucket];
+    watch->files[bucket] = file;
+    return file;
+}
+
+// Has name converted delay ms from now, or once it's done if a worker has
+// it already. A later event replaces the delay of an earlier one, so a
+// file that's written to and then closed waits for debounce_ms, not the
+// settle time.
+static void note_change(Watch *watch, const char *name, double delay)
+{
+    WatchFile  *file;
+
+    pthread_mutex_lock(&watch->lock);
+    file = file_lookup(watch, name);
+    if (file->state == WATCH_IDLE)
+        file->due = now_ms() + delay;
+    else
+        file->again = delay;
+    pthread_mutex_unlock(&watch->lock);
+}
+
+// Has every image in the directory whose .GRA is missing or older than it
+// converted now. Used at the start and when inotify drops events.
+static int scan_dir(Watch *watch)
+{
+    DIR            *dir;
+    struct dirent  *entry;
+    struct stat     in, out;
+    char           *path;
+    const char     *dot;
+    int             stale;
+
+    dir = opendir(watch->dir);
+    if (!dir){
+        fprintf(stderr, "%s: %s\n", watch->dir, strerror(errno));
+        return 0;
+    }
+    while ((entry = readdir(dir))){
+        if (!is_image_name(entry->d_name))
+            continue;
+        path = make_path(watch->dir, "", entry->d_name, strlen(entry->d_name), "");
+        stale = !stat(path, &in) && S_ISREG(in.st_mode);
+        free(path);
+        if (!stale)
+            continue;
+
+        dot = strrchr(entry->d_name, '.');
+        path = make_path(watch->out_dir, "", entry->d_name, dot - entry->d_name, ".GRA");
+        stale = stat(path, &out) < 0 || out.st_mtim.tv_sec < in.st_mtim.tv_sec ||
+            (out.st_mtim.tv_sec == in.st_mtim.tv_sec && out.st_mtim.tv_nsec < in.st_mtim.tv_nsec);
+        free(path);
+
+        pthread_mutex_lock(&watch->lock);
+        file_lookup(watch, entry->d_name);
+        pthread_mutex_unlock(&watch->lock);
+        if (stale)
+            note_change(watch, entry->d_name, 0);
+    }
+    closedir(dir);
+    return 1;
+}
+
+// Queues the files that are due, as many as there's room for. Returns the
+// ms until the next one is due, or -1 if there's nothing to wait for.
+static int dispatch(Watch *watch)
+{
+    double      now = now_ms(), next = -1;
+    WatchFile  *file;
+    int         i;
+
+    pthread_mutex_lock(&watch->lock);
+    for (i = 0; i < WATCH_BUCKETS; i++){
+        for (file = watch->files[i]; file; file = file->next){
+            if (!file->due || file->state != WATCH_IDLE)
+                continue;
+            if (file->due > now){
+                if (next < 0 || file->due < next)
+                    next = file->due;
+            } else if (watch->queue_count < watch->queue_size){
+                watch->queue[(watch->queue_head + watch->queue_count) % watch->queue_size] = file;
+                watch->queue_count++;
+                file->state = WATCH_QUEUED;
+                file->due = 0;
+                pthread_cond_signal(&watch->wake);
+            }
+            // else a worker wakes us when it's done
+        }
+    }
+    pthread_mutex_unlock(&watch->lock);
+    return next < 0 ? -1 : (int)(next - now) + 1;
+}
+
+// Converts one image to a temporary file next to its .GRA, then renames it
+// into place
+static void convert_file(Watch *watch, WatchFile *file)
+{
+    const char     *dot = strrchr(file->name, '.');
+    char           *path, *out_path, *part_path;
+    unsigned char  *buf;
+    double          start = now_ms();
+    long            len, size = 0;
+    uint64_t        hash;
+    int             width, height, unchanged, failed;
+    FILE           *out;
+
+    path = make_path(watch->dir, "", file->name, strlen(file->name), "");
+    buf = read_file(path, &len);
+    if (!buf){
+        // Most likely renamed or deleted before its turn came
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        free(path);
+        return;
+    }
+    hash = content_hash(buf, len);
+    pthread_mutex_lock(&watch->lock);
+    unchanged = file->hashed && file->hash == hash;
+    pthread_mutex_unlock(&watch->lock);
+    if (unchanged){
+        printf("%s: unchanged, skipped\n", path);
+        fflush(stdout);
+        free(buf);
+        free(path);
+        return;
+    }
+
+    out_path = make_path(watch->out_dir, "", file->name, dot - file->name, ".GRA");
+    part_path = make_path(watch->out_dir, ".", file->name, dot - file->name, ".GRA.part");
+    out = fopen(part_path, "wb");
+    if (!out){
+        fprintf(stderr, "%s: %s\n", part_path, strerror(errno));
+        failed = 1;
+    } else {
+        failed = gra_pam_convert(path, buf, len, out, &width, &height);
+        size = ftell(out);
+        if (fclose(out) != 0 && !failed){
+            fprintf(stderr, "%s: %s\n", part_path, strerror(errno));
+            failed = 1;
+        }
+        if (!failed && rename(part_path, out_path) < 0){
+            fprintf(stderr, "%s: %s\n", out_path, strerror(errno));
+            failed = 1;
+        }
+        if (failed)
+            unlink(part_path);
+    }
+
+    if (!failed){
+        // Only content that made it out is skipped next time, so a failure
+        // is tried again when the file changes or is touched
+        pthread_mutex_lock(&watch->lock);
+        file->hash = hash;
+        file->hashed = 1;
+        pthread_mutex_unlock(&watch->lock);
+        printf("%s -> %s: %dx%d, %ld bytes, %.1f ms\n",
+                path, out_path, width, height, size, now_ms() - start);
+        fflush(stdout);
+    }
+    free(buf);
+    free(path);
+    free(out_path);
+    free(part_path);
+}
+
+// Takes files off the queue until the watch stops
+static void *worker_thread(void *data)
+{
+    Watch      *watch = data;
+    WatchFile  *file;
+
+    pthread_mutex_lock(&watch->lock);
+    for (;;){
+        while (!watch->stop && !watch->queue_count)
+            pthread_cond_wait(&watch->wake, &watch->lock);
+        if (watch->stop)
+            break;
+        file = watch->queue[watch->queue_head];
+        watch->queue_head = (watch->queue_head + 1) % watch->queue_size;
+        watch->queue_count--;
+        file->state = WATCH_RUNNING;
+        pthread_mutex_unlock(&watch->lock);
+
+        convert_file(watch, file);
+
+        pthread_mutex_lock(&watch->lock);
+        file->state = WATCH_IDLE;
+        if (file->again >= 0){
+            file->due = now_ms() + file->again;
+            file->again = -1;
+        }
+        // There's room in the queue, and maybe this file to schedule again
+        wake_main(watch->pipe_fds[1]);
+    }
+    pthread_mutex_unlock(&watch->lock);
+    return NULL;
+}
+
+static void wake_main(int fd)
+{
+    char    byte = 0;
+
+    if (write(fd, &byte, 1) < 0){
+        // The pipe is full, so the main loop has a wake-up waiting already
+    }
+}
+
+static void on_signal(int sig)
+{
+    int     saved = errno;
+
+    watch_signalled = 1;
+    wake_main(watch_signal_fd);
+    errno = saved;
+}
+
+int gra_watch(const char *dir, const char *out_dir, int threads, int debounce_ms)
+{
+    Watch                       watch;
+    pthread_t                  *workers;
+    WatchFile                  *file;
+    struct pollfd               fds[2];
+    struct sigaction            action, old_int, old_term;
+    const struct inotify_event *event;
+    char                        events[WATCH_EVENTS]
+                                    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    char                        drain[64], *p;
+    ssize_t                     got;
+    int                         inotify_fd, i, timeout;
+
+    memset(&watch, 0, sizeof(watch));
+    watch.dir = dir;
+    watch.out_dir = out_dir ? out_dir : dir;
+    watch.debounce_ms = debounce_ms;
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+
+    // Watching starts before the scan so nothing lands unseen in between
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0 || inotify_add_watch(inotify_fd, dir, WATCH_MASK) < 0){
+        fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+        if (inotify_fd >= 0)
+            close(inotify_fd);
+        return 1;
+    }
+    if (pipe(watch.pipe_fds) < 0){
+        fprintf(stderr, "gra-convert: %s\n", strerror(errno));
+        close(inotify_fd);
+        return 1;
+    }
+    for (i = 0; i < 2; i++)
+        fcntl(watch.pipe_fds[i], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&watch.lock, NULL);
+    pthread_cond_init(&watch.wake, NULL);
+    watch.queue_size = 2 * threads;
+    watch.queue = calloc(watch.queue_size, sizeof(WatchFile *));
+
+    watch_signalled = 0;
+    watch_signal_fd = watch.pipe_fds[1];
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &old_int);
+    sigaction(SIGTERM, &action, &old_term);
+
+    workers = calloc(threads, sizeof(pthread_t));
+    for (i = 0; i < threads; i++)
+        pthread_create(&workers[i], NULL, worker_thread, &watch);
+
+    if (scan_dir(&watch)){
+        printf("Watching %s, writing to %s with %d threads\n", watch.dir, watch.out_dir, threads);
+        fflush(stdout);
+    } else
+        watch_signalled = 1;
+
+    while (!watch_signalled){
+        timeout = dispatch(&watch);
+        fds[0].fd = inotify_fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = watch.pipe_fds[0];
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        if (poll(fds, 2, timeout) < 0){
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "gra-convert: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents & POLLIN)
+            while (read(watch.pipe_fds[0], drain, sizeof(drain)) > 0)
+                ;
+        if (fds[0].revents & POLLIN){
+            got = read(inotify_fd, events, sizeof(events));
+            for (p = events; got > 0 && p < events + got; p += sizeof(struct inotify_event) + event->len){
+                event = (const struct inotify_event *) p;
+                if (event->mask & IN_Q_OVERFLOW)
+                    scan_dir(&watch);
+                else if (event->len && !(event->mask & IN_ISDIR) && is_image_name(event->name))
+                    note_change(&watch, event->name,
+                            event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO) ?
+                            watch.debounce_ms : GRA_WATCH_SETTLE);
+            }
+        }
+    }
+
+    // Files being converted are finished; queued and pending ones are
+    // picked up by the scan next time
+    pthread_mutex_lock(&watch.lock);
+    watch.stop = 1;
+    pthread_cond_broadcast(&watch.wake);
+    pthread_mutex_unlock(&watch.lock);
+    for (i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    watch_signal_fd = -1;
+    for (i = 0; i < WATCH_BUCKETS; i++){
+        while ((file = watch.files[i])){
+            watch.files[i] = file->next;
+            free(file->name);
+            free(file);
+        }
+    }
+    free(workers);
+    free(watch.queue);
+    pthread_cond_destroy(&watch.wake);
+    pthread_mutex_destroy(&watch.lock);
+    close(watch.pipe_fds[0]);
+    close(watch.pipe_fds[1]);
+    close(inotify_fd);
+    return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * gra-watch.h   gra-convert --watch: converts images as they land in a
+ *               directory.
+ *
+ * Waits on inotify for PPM (.ppm, .pnm) and PAM (.pam) files to be
+ * written to or moved into a directory, and converts each one to a .GRA of
+ * the same name in the output directory on a pool of worker threads. A
+ * file is converted debounce_ms after it was closed or moved in, or a
+ * second after its last write if it is never closed, so partly written
+ * files are left alone. Files whose content hasn't changed since their
+ * last conversion are skipped. Each .GRA is written next to where it ends
+ * up and renamed into place, so readers never see half of one.
+ *
+ * The workers live as long as the watch, so each keeps its encoder and the
+ * colour lookup table warm between files.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRA_WATCH_H__
+#define __GRA_WATCH_H__
+
+#define GRA_WATCH_DEBOUNCE  20      // ms after a file is closed, by default
+#define GRA_WATCH_SETTLE    1000    // ms after the last write to a file that isn't closed
+
+// Converts what's in dir and then everything that changes in it until
+// SIGINT or SIGTERM. Output goes to out_dir, or dir if it's NULL. threads
+// of 0 uses one per CPU. Returns 0, or 1 if the watch couldn't be set up.
+int gra_watch (const char *dir, const char *out_dir, int threads, int debounce_ms);
+
+#endif /* __GRA_WATCH_H__ */
@@ -25,6 +25,8 @@
 
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <glib/gstdio.h>
 
@@ -32,56 +34,606 @@
 #include <libgimp/gimpui.h>
 
 #include "gra.h"
+#include "gra-trace.h"
+#include "gra-cache.h"
+#include "gra-expand.h"
+#include "gra-format.h"
+#include "gra-preview.h"
+#include "compression.h"
+
+#define GRA_WRITE_CHUNK     (256 * 1024)    // pieces of compressed body handed to the writer
+
+// With GRA_VERIFY set, expands the compressed body on its own thread while
+// it is being written and compares it with the pixels it was made from, so
+// the file can be left alone if they differ.
+typedef struct _GraVerifier
+{
+    GThread       *thread;
+    GMutex         lock;
+    GCond          cond;
+    ArcVerify     *verify;
+    guchar        *stream;      // copy of the body as written so far
+    long           stream_size;
+    long           available;   // leading bytes of stream that are final
+    long           fed;         // bytes of those verify has been given
+    gboolean       busy, rewound, quit, failed;
+} GraVerifier;
+
+// Stores pieces of the compressed body in the output file on its own thread,
+// while compress_chunked works on the next piece.
+typedef struct _GraWriter
+{
+    FILE          *file;
+    long           base;        // where the body starts in file
+    GByteArray    *stream;      // the body, if file is a pipe that can't be seeked in
+    GraVerifier   *verifier;    // NULL unless verifying
+    GThread       *thread;
+    GMutex         lock;
+    GCond          cond;
+    const guchar  *buf;         // piece being written while busy
+    long           len, offset;
+    gboolean       busy, quit, failed;
+    gint           saved_errno;
+} GraWriter;
+
+// Reads the drawable for compress_streamed under a memory ceiling, packing
+// the pixels it asks for as it goes
+typedef struct _GraStripSource
+{
+    GeglBuffer    *buffer;
+    const Babl    *format;
+    GimpImageType  drawable_type;
+    const guchar  *remap;       // NULL if colours are kept as they are
+    gint           x, y;        // where the exported area starts
+    gint           width;
+    guchar        *scratch;     // chunk pixels in the drawable's format
+} GraStripSource;
 
 static gint    cur_progress = 0;
 static gint    max_progress = 0;
 
-static gboolean save_dialog ();
+static GimpPDBStatusType write_gra (const gchar *filename,
+                                gint32          image,
+                                gint32          drawable_ID,
+                                const GeglRectangle *rect,
+                                GError        **error);
+static gboolean save_rect      (gint32          drawable_ID,
+                                const GraSaveVals *vals,
+                                GeglRectangle  *rect,
+                                GError        **error);
+static gint32   crop_image     (gint32          drawable_ID,
+                                const GeglRectangle *rect,
+                                gint32         *layer_ID);
+static gboolean save_dialog    (gint32          drawable_ID,
+                                const GeglRectangle *rect,
+                                gboolean        can_dither,
+                                gboolean       *dither);
+static void     dither_toggled (GtkWidget      *button,
+                                GraPreview     *preview);
+static void     pack_gra_bytes (guchar         *dest,
+                                const guchar   *src,
+                                long            n,
+                                GimpImageType   drawable_type,
+                                const guchar   *remap);
+static gboolean pack_is_copy   (GimpImageType   drawable_type,
+                                const guchar   *remap);
+static guchar  *pack_drawable  (gint32          drawable_ID,
+                                const GeglRectangle *rect,
+                                const guchar   *remap);
+static int      strip_source   (void           *user_data,
+                                guchar         *buf,
+                                long            len,
+                                long            offset);
+static gpointer writer_thread  (gpointer        data);
+static int      writer_sink    (void           *user_data,
+                                const guchar   *buf,
+                                long            len,
+                                long            offset);
+static FILE    *open_temp_file (const gchar    *filename,
+                                gchar         **temp_name,
+                                GError        **error);
+static GraVerifier *verifier_new    (const guchar   *pixels,
+                                     long            size);
+static gpointer     verifier_thread (gpointer        data);
+static void         verifier_write  (GraVerifier    *verifier,
+                                     const guchar   *buf,
+                                     long            len,
+                                     long            offset);
+static gboolean     verifier_finish (GraVerifier    *verifier,
+                                     long            compressed_size);
 
 gboolean
 check_color_mapping(int image){
     guchar      gra_color_map[3*16];
     guchar      *image_color_map;
     gint        colors; 
+    gboolean    same;
+
+    image_color_map = gimp_image_get_colormap (image, &colors);
+    same = colors == 16;
+    if (same){
+        get_color_map(&gra_color_map); // Get our color map
+        // Compare colors
+        same = memcmp(gra_color_map, image_color_map, 3*16) == 0;
+    }
+    g_free(image_color_map);
+    return same;
+}
+
+// Fills remap with the nearest TempleOS color for every index of the image's
+// colormap, so images with a foreign palette can be packed with one lookup
+// per pixel instead of being converted to RGB and back.
+static void
+build_color_remap(gint32 image, guchar *remap){
+    guchar      gra_color_map[3*16];
+    guchar      *image_color_map;
+    gint        colors;
     int         i;
 
+    memset(remap, 0, MAXCOLORS);
+    get_color_map(gra_color_map);
     image_color_map = gimp_image_get_colormap (image, &colors);
-    if (colors != 16){
+
+    for (i = 0; i < colors && i < MAXCOLORS; i++)
+        remap[i] = gra_palette_nearest(gra_color_map, image_color_map[3*i],
+                image_color_map[3*i + 1], image_color_map[3*i + 2]);
+    g_free(image_color_map);
+}
+
+// If image's colormap has 16 colors or fewer, stores it in palette in the
+// file's format and returns TRUE: the pixels can then be saved as they are
+static gboolean
+build_custom_palette (gint32 image, guchar *palette)
+{
+    guchar      *image_color_map;
+    gint        colors;
+
+    image_color_map = gimp_image_get_colormap (image, &colors);
+    if (colors < 1 || colors > GRA_PALETTE_COLORS){
+        g_free (image_color_map);
         return FALSE;
     }
-    get_color_map(&gra_color_map); // Get our color map
-    // Compare colors
-    for (i = 0; i < 3*16; i++){
-        if (gra_color_map[i] != image_color_map[i]){
-            return FALSE;
+    gra_palette_build (image_color_map, colors, palette);
+    g_free (image_color_map);
+    return TRUE;
+}
+
+// Packs n pixels of a GIMP_INDEXED_IMAGE or GIMP_INDEXEDA_IMAGE drawable
+// into GRA bytes: the colour, remapped onto the TempleOS palette if remap
+// isn't NULL, in the low nibble and the transparency in the high nibble
+static void
+pack_gra_bytes (guchar *dest, const guchar *src, long n,
+        GimpImageType drawable_type, const guchar *remap)
+{
+    long    x;
+
+    if (drawable_type == GIMP_INDEXEDA_IMAGE){
+        gra_pack_indexeda (dest, src, n, remap);
+    } else if (remap){
+        for (x = 0; x < n; x++)
+            dest[x] = remap[*src++];
+    } else {
+        memcpy (dest, src, n);
+    }
+}
+
+// Pixels of an opaque drawable whose colours are kept as they are already
+// are GRA bytes, so GEGL can copy them straight to where they're wanted
+static gboolean
+pack_is_copy (GimpImageType drawable_type, const guchar *remap)
+{
+    return drawable_type == GIMP_INDEXED_IMAGE && !remap;
+}
+
+// Packs rect of the drawable into a newly allocated buffer of GRA bytes, a
+// tile at a time straight out of its buffer; tiles outside rect are never
+// fetched
+static guchar *
+pack_drawable (gint32 drawable_ID, const GeglRectangle *rect, const guchar *remap)
+{
+    GimpImageType        drawable_type = gimp_drawable_type (drawable_ID);
+    GeglBuffer          *buffer;
+    GeglBufferIterator  *iter;
+    guchar              *pixels;
+    const guchar        *src;
+    gint                 y;
+
+    pixels = g_new (guchar, (gsize)rect->width * rect->height);
+    buffer = gimp_drawable_get_buffer (drawable_ID);
+    if (pack_is_copy (drawable_type, remap)){
+        gegl_buffer_get (buffer, rect, 1.0, gimp_drawable_get_format (drawable_ID),
+                pixels, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+        g_object_unref (buffer);
+        return pixels;
+    }
+    iter = gegl_buffer_iterator_new (buffer, rect, 0,
+            gimp_drawable_get_format (drawable_ID),
+            GEGL_ACCESS_READ, GEGL_ABYSS_NONE, 1);
+
+    while (gegl_buffer_iterator_next (iter)){
+        const GeglRectangle *roi = &iter->items[0].roi;
+
+        src = iter->items[0].data;
+        for (y = roi->y; y < roi->y + roi->height; y++){
+            pack_gra_bytes (pixels + (gsize)(y - rect->y) * rect->width + roi->x - rect->x, src,
+                    roi->width, drawable_type, remap);
+            src += roi->width * (drawable_type == GIMP_INDEXEDA_IMAGE ? 2 : 1);
+        }
+    }
+    g_object_unref (buffer);
+    return pixels;
+}
+
+// ArcSourceFn for compress_streamed: fetches the pixels from offset on, as
+// many whole rows at once as fit, and packs them into buf
+static int
+strip_source (void *user_data, guchar *buf, long len, long offset)
+{
+    GraStripSource  *strip = user_data;
+    GeglRectangle    rect;
+    long             n;
+
+    while (len > 0){
+        rect.x = offset % strip->width;
+        rect.y = offset / strip->width;
+        if (rect.x == 0 && len >= strip->width){
+            rect.width = strip->width;
+            rect.height = len / strip->width;
+        } else {
+            rect.width = MIN (len, strip->width - rect.x);
+            rect.height = 1;
+        }
+        rect.x += strip->x;
+        rect.y += strip->y;
+        n = (long)rect.width * rect.height;
+
+        if (pack_is_copy (strip->drawable_type, strip->remap)){
+            gegl_buffer_get (strip->buffer, &rect, 1.0, strip->format,
+                    buf, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+        } else {
+            gegl_buffer_get (strip->buffer, &rect, 1.0, strip->format,
+                    strip->scratch, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+            pack_gra_bytes (buf, strip->scratch, n, strip->drawable_type,
+                    strip->remap);
         }
+        buf += n;
+        len -= n;
+        offset += n;
     }
     return TRUE;
 }
 
+static gpointer
+writer_thread (gpointer data)
+{
+    GraWriter *writer = data;
+    gboolean   ok;
+
+    g_mutex_lock (&writer->lock);
+    for (;;){
+        while (!writer->busy && !writer->quit)
+            g_cond_wait (&writer->cond, &writer->lock);
+        if (!writer->busy)
+            break;
+        g_mutex_unlock (&writer->lock);
+
+        if (writer->stream){
+            // Pieces can go back to offset 0, so they wait until the end
+            if (writer->stream->len < (guint)(writer->offset + writer->len))
+                g_byte_array_set_size (writer->stream, writer->offset + writer->len);
+            memcpy (writer->stream->data + writer->offset, writer->buf, writer->len);
+            ok = TRUE;
+        } else {
+            ok = fseek (writer->file, writer->base + writer->offset, SEEK_SET) == 0 &&
+                fwrite (writer->buf, writer->len, 1, writer->file) == 1;
+        }
+
+        g_mutex_lock (&writer->lock);
+        if (!ok && !writer->failed){
+            writer->failed = TRUE;
+            writer->saved_errno = errno;
+        }
+        writer->busy = FALSE;
+        g_cond_broadcast (&writer->cond);
+    }
+    g_mutex_unlock (&writer->lock);
+    return NULL;
+}
+
+// ArcChunkSink for compress_chunked: waits for the writer to finish the
+// previous piece (so compress_chunked may reuse its buffer), then passes it
+// the new one. A zero length piece only waits.
+static int
+writer_sink (void *user_data, const guchar *buf, long len, long offset)
+{
+    GraWriter *writer = user_data;
+    gboolean   ok;
+
+    g_mutex_lock (&writer->lock);
+    while (writer->busy)
+        g_cond_wait (&writer->cond, &writer->lock);
+    ok = !writer->failed;
+    if (ok && len){
+        writer->buf    = buf;
+        writer->len    = len;
+        writer->offset = offset;
+        writer->busy   = TRUE;
+        g_cond_broadcast (&writer->cond);
+    }
+    g_mutex_unlock (&writer->lock);
+    if (ok && len && writer->verifier)
+        verifier_write (writer->verifier, buf, len, offset);
+    return ok;
+}
+
+static GraVerifier *
+verifier_new (const guchar *pixels, long size)
+{
+    GraVerifier *verifier = g_new0 (GraVerifier, 1);
+
+    verifier->verify = decompress_verify_new (pixels, size);
+    // Room for the stream even if it ends up stored uncompressed
+    verifier->stream_size = size + GRA_ARC_HEADER_SIZE + 8;
+    verifier->stream = g_try_malloc (verifier->stream_size);
+    verifier->failed = !verifier->stream;
+    g_mutex_init (&verifier->lock);
+    g_cond_init (&verifier->cond);
+    verifier->thread = g_thread_new ("gra-verifier", verifier_thread, verifier);
+    return verifier;
+}
+
+static gpointer
+verifier_thread (gpointer data)
+{
+    GraVerifier *verifier = data;
+    long         len;
+    gboolean     ok;
+
+    g_mutex_lock (&verifier->lock);
+    for (;;){
+        while (!verifier->quit && (verifier->rewound || verifier->failed ||
+                    verifier->fed == verifier->available))
+            g_cond_wait (&verifier->cond, &verifier->lock);
+        if (verifier->quit)
+            break;
+        len = verifier->available;
+        verifier->busy = TRUE;
+        g_mutex_unlock (&verifier->lock);
+
+        ok = decompress_verify_feed (verifier->verify, verifier->stream, len);
+
+        g_mutex_lock (&verifier->lock);
+        verifier->busy = FALSE;
+        verifier->fed = len;
+        if (!ok)
+            verifier->failed = TRUE;
+        g_cond_broadcast (&verifier->cond);
+    }
+    g_mutex_unlock (&verifier->lock);
+    return NULL;
+}
+
+// Copies a piece passed to writer_sink into verifier's stream. Only bytes
+// past what the verifier thread may be reading are written while it runs.
+static void
+verifier_write (GraVerifier *verifier, const guchar *buf, long len, long offset)
+{
+    g_mutex_lock (&verifier->lock);
+    if (verifier->failed || offset + len > verifier->stream_size){
+        verifier->failed = TRUE;
+        g_mutex_unlock (&verifier->lock);
+        return;
+    }
+    // Apart from the two halves of compressed_size at offset 0, which the
+    // verifier thread doesn't read, nothing is rewritten unless the whole
+    // stream is being redone uncompressed. verifier_finish checks that one
+    // on its own.
+    if (offset < verifier->available && !(offset == 0 && len == 2 * sizeof (guint32))){
+        verifier->rewound = TRUE;
+        while (verifier->busy)
+            g_cond_wait (&verifier->cond, &verifier->lock);
+    }
+    g_mutex_unlock (&verifier->lock);
+
+    memcpy (verifier->stream + offset, buf, len);
+
+    g_mutex_lock (&verifier->lock);
+    if (offset == verifier->available && !verifier->rewound){
+        verifier->available += len;
+        g_cond_broadcast (&verifier->cond);
+    }
+    g_mutex_unlock (&verifier->lock);
+}
+
+// Stops verifier's thread, checks the rest of the stream, compressed_size
+// bytes long (-1 if writing it failed), and frees verifier. Returns TRUE if
+// the stream expands to the pixels verifier was made with.
+static gboolean
+verifier_finish (GraVerifier *verifier, long compressed_size)
+{
+    gboolean ok;
+
+    g_mutex_lock (&verifier->lock);
+    verifier->quit = TRUE;
+    g_cond_broadcast (&verifier->cond);
+    g_mutex_unlock (&verifier->lock);
+    g_thread_join (verifier->thread);
+
+    ok = !verifier->failed && compressed_size >= 0 &&
+        decompress_verify_finish (verifier->verify, verifier->stream, compressed_size);
+
+    decompress_verify_free (verifier->verify);
+    g_free (verifier->stream);
+    g_mutex_clear (&verifier->lock);
+    g_cond_clear (&verifier->cond);
+    g_free (verifier);
+    return ok;
+}
+
+// Creates a temporary file next to filename, so it can later be renamed over
+// it. It gets the permissions of the file it replaces, or the usual ones for
+// a new file.
+static FILE *
+open_temp_file (const gchar *filename, gchar **temp_name, GError **error)
+{
+    struct stat  st;
+    mode_t       mode;
+    gint         fd;
+    FILE        *file;
+
+    if (stat (filename, &st) == 0){
+        mode = st.st_mode & 07777;
+    } else {
+        mode = umask (0);
+        umask (mode);
+        mode = 0666 & ~mode;
+    }
+
+    *temp_name = g_strdup_printf ("%s.XXXXXX", filename);
+    fd = g_mkstemp (*temp_name);
+    if (fd == -1 || fchmod (fd, mode) != 0 || !(file = fdopen (fd, "wb"))){
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                "Could not open '%s' for writing: %s",
+                gimp_filename_to_utf8 (filename), g_strerror (errno));
+        if (fd != -1){
+            close (fd);
+            g_unlink (*temp_name);
+        }
+        g_free (*temp_name);
+        *temp_name = NULL;
+        return NULL;
+    }
+    return file;
+}
+
 GimpPDBStatusType
-WriteGRA (const gchar  *filename,
-        gint32        image,
-        gint32        drawable_ID,
-        GError      **error)
+WriteGRA (const gchar        *filename,
+        gint32              image,
+        gint32              drawable_ID,
+        const GraSaveVals  *vals,
+        GError            **error)
 {
-    FILE          *outfile;
-    GimpDrawable  *drawable;
-    GimpImageType  drawable_type;
-    GimpPixelRgn   pixel_rgn;
-    guchar        *pixels;
-    gint          channels;
+    GeglRectangle       rect;
+    gint32              cropped, layer_ID;
+    GimpPDBStatusType   status;
+
+    if (!save_rect (drawable_ID, vals, &rect, error))
+        return GIMP_PDB_EXECUTION_ERROR;
+
+    // Converting all of a large canvas to indexed to export a sprite from it
+    // would cost more than the export, so the sprite is copied into an
+    // image of its own first
+    if (!gimp_drawable_is_indexed (drawable_ID) &&
+            (rect.width != gimp_drawable_width (drawable_ID) ||
+             rect.height != gimp_drawable_height (drawable_ID))){
+        cropped = crop_image (drawable_ID, &rect, &layer_ID);
+        rect.x = rect.y = 0;
+        status = write_gra (filename, cropped, layer_ID, &rect, error);
+        gimp_image_delete (cropped);
+        return status;
+    }
+    return write_gra (filename, image, drawable_ID, &rect, error);
+}
+
+// Works out the area of the drawable vals asks for, in its own coordinates
+static gboolean
+save_rect (gint32 drawable_ID, const GraSaveVals *vals, GeglRectangle *rect,
+        GError **error)
+{
+    GeglRectangle   bounds = { 0, 0, gimp_drawable_width (drawable_ID),
+                               gimp_drawable_height (drawable_ID) };
+
+    switch (vals->region){
+        case GRA_REGION_SELECTION:
+            if (gimp_drawable_mask_intersect (drawable_ID, &rect->x, &rect->y,
+                        &rect->width, &rect->height))
+                return TRUE;
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                    "The selection doesn't cover any of the layer being exported");
+            return FALSE;
+
+        case GRA_REGION_RECT:
+            *rect = *GEGL_RECTANGLE (vals->x, vals->y, vals->width, vals->height);
+            if (gegl_rectangle_intersect (rect, rect, &bounds))
+                return TRUE;
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                    "The rectangle %dx%d at %d,%d is outside the layer being exported",
+                    vals->width, vals->height, vals->x, vals->y);
+            return FALSE;
 
+        default:
+            *rect = bounds;
+            return TRUE;
+    }
+}
+
+// Copies rect of the drawable into a new RGB image with a single layer,
+// reading only the tiles rect touches
+static gint32
+crop_image (gint32 drawable_ID, const GeglRectangle *rect, gint32 *layer_ID)
+{
+    gint32          image;
+    GeglBuffer     *src, *dest;
+
+    image = gimp_image_new (rect->width, rect->height, GIMP_RGB);
+    *layer_ID = gimp_layer_new (image, "Export", rect->width, rect->height,
+            gimp_drawable_has_alpha (drawable_ID) ? GIMP_RGBA_IMAGE : GIMP_RGB_IMAGE,
+            100, GIMP_NORMAL_MODE);
+    gimp_image_insert_layer (image, *layer_ID, -1, 0);
+
+    src = gimp_drawable_get_buffer (drawable_ID);
+    dest = gimp_drawable_get_buffer (*layer_ID);
+    gegl_buffer_copy (src, rect, GEGL_ABYSS_NONE,
+            dest, GEGL_RECTANGLE (0, 0, rect->width, rect->height));
+    g_object_unref (src);
+    g_object_unref (dest);
+    return image;
+}
+
+// Saves rect of the drawable, which is the whole of it unless the drawable
+// is already indexed
+static GimpPDBStatusType
+write_gra (const gchar          *filename,
+        gint32                image,
+        gint32                drawable_ID,
+        const GeglRectangle  *rect,
+        GError              **error)
+{
+    FILE          *outfile;
+    gchar         *temp_name = NULL;
+    struct stat    st;
+    gboolean       stream;
+    GraWriter      writer;
+    GraSaveCache  *cache = NULL;
+    GraStripSource strip;
+    gint           header[4];
+    long           compressed_size, chunk;
+    guchar        *pixels = NULL;
+    guchar         remap[MAXCOLORS];
+    const guchar  *pack_remap = NULL;
+    guchar         palette[GRA_PALETTE_SIZE];
+    gboolean       custom_palette = FALSE;
+    gint          width, height;
+    gsize         ceiling = gra_memory_ceiling ();
+    gboolean      verified = TRUE;
+    gboolean      dither = FALSE;
+    GraTraceSpan  span = { 0 };
+    GraTraceSpan  verify_span = { 0 };
+    GraTraceSpan  strip_span = { 0 };
+
+    GRA_TRACE_BEGIN(strip_span);
     if (!gimp_drawable_is_indexed(drawable_ID)) {
-        if (!save_dialog()){
+        if (!save_dialog(drawable_ID, rect, TRUE, &dither)){
             g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
                 "Can only save indexed images as .GRA");
             return GIMP_PDB_EXECUTION_ERROR;
         }
+        GRA_TRACE_BEGIN(strip_span); // not counting the time in the dialog
 
         // Convert to indexed
+        GRA_TRACE_BEGIN(span);
         if (!gimp_image_convert_indexed(image,
-                    GIMP_NO_DITHER,
+                    dither ? GIMP_FS_DITHER : GIMP_NO_DITHER,
                     GIMP_CUSTOM_PALETTE,
                     16,         // Ignored
                     FALSE,      // No dither
@@ -91,170 +643,216 @@ WriteGRA (const gchar  *filename,
                 "Error converting image to correct format (couldn't convert to indexed).");
             return GIMP_PDB_EXECUTION_ERROR;
         }
+        GRA_TRACE_END(span, "palette conversion",
+                (long long)gimp_drawable_width (drawable_ID) * gimp_drawable_height (drawable_ID));
     }
 
-    //TODO: Handle custom color maps. For now we'll assume it's the same as the default
-    // Need to check the color map used is valid
+    // The TempleOS palette, or any other of up to 16 colors (which is then
+    // stored in the file), is saved as it is. A bigger palette is mapped
+    // onto the TempleOS colors while packing, leaving the image untouched.
     if (!check_color_mapping(image)){
-        if (!save_dialog()){
-            g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-                    "Color mapping is incorrect. Please ensure you used the TempleOS GRA Color palette");
-            return GIMP_PDB_EXECUTION_ERROR;
+        custom_palette = build_custom_palette (image, palette);
+        if (!custom_palette){
+            if (!save_dialog(drawable_ID, rect, FALSE, NULL)){
+                g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                        "Color mapping is incorrect. Please ensure you used the TempleOS GRA Color palette");
+                return GIMP_PDB_EXECUTION_ERROR;
+            }
+            GRA_TRACE_BEGIN(span);
+            build_color_remap(image, remap);
+            pack_remap = remap;
+            GRA_TRACE_END(span, "palette remap", MAXCOLORS);
         }
+    }
 
-        // Convert to RGB and then back to indexed with proper colourmap.
-        // A little bit hacky, but it ensures the colours are the most accurate
-        if (!gimp_image_convert_rgb(image)){
+    width  = rect->width;
+    height = rect->height;
+
+    // Get the file. Everything goes to a temporary file that only replaces
+    // filename once it is complete, so a failed save leaves no broken GRA.
+    // A pipe or device can't be replaced, or seeked in, so it is written to
+    // directly and from start to end, the body once it's all compressed.
+    stream = g_stat (filename, &st) == 0 && !S_ISREG (st.st_mode) && !S_ISDIR (st.st_mode);
+    if (stream){
+        outfile = g_fopen (filename, "wb");
+        if (!outfile){
             g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-                "Error converting image to correct format (couldn't convert to RGB).");
+                    "Could not open '%s' for writing: %s",
+                    gimp_filename_to_utf8 (filename), g_strerror (errno));
             return GIMP_PDB_EXECUTION_ERROR;
         }
-
-        if (!gimp_image_convert_indexed(image,
-                    GIMP_NO_DITHER,
-                    GIMP_CUSTOM_PALETTE,
-                    16,         // Ignored
-                    FALSE,      // No dither
-                    FALSE,      // Do NOT remove unused colours
-                    PALETTE_NAME)){
-            g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-                "Error converting image to correct format (couldn't convert to indexed).");
+    } else {
+        outfile = open_temp_file (filename, &temp_name, error);
+        if (!outfile)
             return GIMP_PDB_EXECUTION_ERROR;
-        }
     }
 
-    drawable = gimp_drawable_get (drawable_ID);
-
-    drawable_type = gimp_drawable_type (drawable_ID);
-
-    gimp_pixel_rgn_init (&pixel_rgn, drawable,
-            0, 0, drawable->width, drawable->height, FALSE, FALSE);
-
-    // Type is either GIMP_INDEXED_IMAGE or GIMP_INDEXEDA_IMAGE
-    channels = drawable_type == GIMP_INDEXED_IMAGE ? 1 : 2;
-
-
-    // Get the file
-    outfile = g_fopen(filename, "wb");
-    if (!outfile)
-    {
-        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-                "Could not open '%s' for writing: %s",
-                gimp_filename_to_utf8 (filename), g_strerror (errno));
-        return GIMP_PDB_EXECUTION_ERROR;
-    }
-
-    // Get the image
-    pixels = g_new (guchar, drawable->width * drawable->height * channels );
-    gimp_pixel_rgn_get_rect (&pixel_rgn, pixels,
-            0, 0, drawable->width, drawable->height);
-    // Set transparency here
-    if (drawable_type == GIMP_INDEXEDA_IMAGE){
-        guchar * alpha_pixels = (guchar *)malloc(drawable->width * drawable->height);
-        int i;
-        guchar alpha_value;
-        for (i=0; i < drawable->width * drawable->height; i++){
-            // Set colour value
-            alpha_pixels[i] |= (pixels[i*2] & 0x0F); // Shouldn't need the & but just in case
-            // Set alpha value
-            alpha_value = 0xFF - pixels[i*2 + 1];
-            alpha_pixels[i] |= (alpha_value & 0xF0); 
-        }
-
-        g_free(pixels);
-        pixels = alpha_pixels;
+    // Pack each pixel into a GRA byte. Under a memory ceiling this is
+    // left to compress_streamed, which asks for the pixels a strip at a time.
+    if (!ceiling){
+        GRA_TRACE_BEGIN(span);
+        pixels = pack_drawable (drawable_ID, rect, pack_remap);
+        GRA_TRACE_END(span, "packing", (long long)width * height);
     }
 
     // Begin the process
     gimp_progress_init_printf ("Saving '%s'",
             gimp_filename_to_utf8 (filename));
     cur_progress = 0;
-    max_progress = drawable->height;
+    max_progress = height;
+
+    header[0] = width;
+    header[1] = (width + 7) & ~7;   // width_internal, rounded up to a multiple of 8
+    header[2] = height;
+    header[3] = DCF_COMPRESSED;     // flags
+    if (custom_palette)
+        header[3] |= DCF_PALETTE;
+    // TODO: Add option for compression/no compression
 
-    // Write the width
-    if (!fwrite(&drawable->width, 1, 4, outfile)){
-        //TODO: Replace with proper errors
-        fprintf(stderr, "Error writing width to file\n");
-        return GIMP_PDB_EXECUTION_ERROR;
+    // Bands that haven't changed since filename was last saved from here
+    // needn't be encoded again. This needs all the pixels at once, so not
+    // under a memory ceiling, and an old file to take them from.
+    if (pixels && !stream){
+        GRA_TRACE_BEGIN(span);
+        cache = gra_save_cache_new (pixels, width, height);
+        gra_save_cache_load (cache, filename, header);
+        GRA_TRACE_END(span, "checkpoint load",
+                cache->checkpoints.count ? cache->checkpoints.list[cache->checkpoints.count - 1].src_pos : 0);
     }
 
-    gint width_internal = drawable->width;
+    // Compress the image data a piece at a time, with the writer thread
+    // storing each piece while the next one is compressed
+    memset (&writer, 0, sizeof (writer));
+    writer.file = outfile;
+    writer.base = GRA_BODY_OFFSET (header[3]);
+    if (stream)
+        writer.stream = g_byte_array_new ();
+    g_mutex_init (&writer.lock);
+    g_cond_init (&writer.cond);
+
+    // With GRA_VERIFY set, the body is also expanded again as it is written,
+    // and the file only replaces filename if it comes out as pixels. The
+    // pixels to compare with are only all there without a memory ceiling.
+    if (g_getenv ("GRA_VERIFY") && pixels)
+        writer.verifier = verifier_new (pixels, (long)width * height);
+
+    GRA_TRACE_BEGIN(span);
+    if (fwrite (header, GRA_HEADER_SIZE, 1, outfile) != 1 ||
+            (custom_palette && fwrite (palette, GRA_PALETTE_SIZE, 1, outfile) != 1)){
+        writer.failed = TRUE;
+        writer.saved_errno = errno;
+        compressed_size = -1;
+    } else {
+        writer.thread = g_thread_new ("gra-writer", writer_thread, &writer);
+        if (pixels){
+            compressed_size = compress_checkpointed (pixels, (long)width * height,
+                    GRA_WRITE_CHUNK, writer_sink, &writer, cache ? &cache->checkpoints : NULL);
+        } else {
+            // A sixteenth of the ceiling for each of the piece being
+            // packed, the two being written and the drawable's own pixels
+            // (two of them with alpha); GEGL's tile cache has a quarter
+            chunk = MAX (ceiling / 16, GRA_MIN_CHUNK);
+            strip.buffer = gimp_drawable_get_buffer (drawable_ID);
+            strip.format = gimp_drawable_get_format (drawable_ID);
+            strip.drawable_type = gimp_drawable_type (drawable_ID);
+            strip.remap = pack_remap;
+            strip.x = rect->x;
+            strip.y = rect->y;
+            strip.width = width;
+            strip.scratch = pack_is_copy (strip.drawable_type, pack_remap) ? NULL :
+                g_new (guchar, chunk * babl_format_get_bytes_per_pixel (strip.format));
+            compressed_size = compress_streamed ((long)width * height, chunk,
+                    strip_source, &strip, writer_sink, &writer);
+            g_free (strip.scratch);
+            g_object_unref (strip.buffer);
+        }
 
-    // Calculate width_internal (round up to nearest multiple of 8)
-    while (width_internal % 8){
-        width_internal++;
-        // I guess you could also do:
-        // width_internal++ >> 3;
-        // width_internal << 3;
-    };
+        g_mutex_lock (&writer.lock);
+        writer.quit = TRUE;
+        g_cond_broadcast (&writer.cond);
+        g_mutex_unlock (&writer.lock);
+        g_thread_join (writer.thread);
+    }
 
-    // Write width_internal
-    if (!fwrite(&width_internal, 1, 4, outfile)){
-        fprintf(stderr, "Error writing width_internal to file\n");
-        return GIMP_PDB_EXECUTION_ERROR;
+    if (writer.verifier){
+        GRA_TRACE_BEGIN(verify_span);
+        verified = verifier_finish (writer.verifier, compressed_size);
+        GRA_TRACE_END(verify_span, "verification", (long long)width * height);
+        if (!verified)
+            compressed_size = -1;
     }
 
-    // Write height
-    if (!fwrite(&drawable->height, 1, 4, outfile)){
-        //TODO: Replace with proper errors
-        fprintf(stderr, "Error writing height to file\n");
-        return GIMP_PDB_EXECUTION_ERROR;
+    if (writer.stream){
+        if (compressed_size >= 0 &&
+                fwrite (writer.stream->data, compressed_size, 1, outfile) != 1){
+            writer.saved_errno = errno;
+            compressed_size = -1;
+        }
+        g_byte_array_free (writer.stream, TRUE);
     }
 
-    // TODO: Add option for compression/no compression
-    // Write compression flag
-    gint flags = 0x00000001;
-    if (!fwrite(&flags, 1, 4, outfile)){
-        //TODO: Replace with proper errors
-        fprintf(stderr, "Error writing height to file\n");
-        return GIMP_PDB_EXECUTION_ERROR;
+    // Make sure the data is on disk before the rename makes it visible
+    if (compressed_size >= 0 && !stream &&
+            (fflush (outfile) != 0 || fsync (fileno (outfile)) != 0)){
+        writer.saved_errno = errno;
+        compressed_size = -1;
+    }
+    if (fclose (outfile) != 0 && compressed_size >= 0){
+        writer.saved_errno = errno;
+        compressed_size = -1;
     }
+    if (compressed_size >= 0 && !stream && g_rename (temp_name, filename) != 0){
+        writer.saved_errno = errno;
+        compressed_size = -1;
+    }
+    GRA_TRACE_END(span, "file write", writer.base + compressed_size);
 
-    // Need to compress the image data
-    guchar * compressed_pixels;
-    long compressed_size = compress(&compressed_pixels, pixels, drawable->width*drawable->height);
-    if (!fwrite(compressed_pixels, compressed_size, 1, outfile)){
-        fprintf(stderr, "Error writing image data to file\n");
+    if (compressed_size >= 0 && cache){
+        GRA_TRACE_BEGIN(span);
+        gra_save_cache_store (cache, filename);
+        GRA_TRACE_END(span, "checkpoint store",
+                (long long)cache->checkpoints.count * sizeof (ArcCheckpoint));
+    }
+    if (cache)
+        gra_save_cache_free (cache);
+
+    g_mutex_clear (&writer.lock);
+    g_cond_clear (&writer.cond);
+    g_free (pixels);
+
+    if (compressed_size < 0){
+        if (temp_name)
+            g_unlink (temp_name);
+        g_free (temp_name);
+        if (!verified)
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                    "Error writing '%s': the written data didn't read back "
+                    "as the image, so the file was left unchanged",
+                    gimp_filename_to_utf8 (filename));
+        else
+            g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (writer.saved_errno),
+                    "Error writing '%s': %s",
+                    gimp_filename_to_utf8 (filename), g_strerror (writer.saved_errno));
         return GIMP_PDB_EXECUTION_ERROR;
     }
-
-    /* If we didn't have compression, we'd do the following and then we'd be done*/
-    /*
-       if (!fwrite(pixels, drawable->width*drawable->height, 1, outfile)){
-       fprintf(stderr, "Error writing height to file\n");
-       return GIMP_PDB_EXECUTION_ERROR;
-       }
-       */
-
-    /*
-       int i;
-       for (i =0; i < 112; i++){
-       printf("%02x", pixels[i]);
-       if (i % 2){
-       printf(" ");
-       }
-       if ((i + 1) % 16 == 0) {
-       printf("\n");
-       }
-       }
-       printf("\n");
-       */
-
-    fclose(outfile);
-    gimp_drawable_detach (drawable);
-    g_free(pixels);
-    g_free(compressed_pixels);
+    g_free (temp_name);
+    if (ceiling)
+        GRA_TRACE_END(strip_span, "strip save", (long long)width * height);
     return GIMP_PDB_SUCCESS;
 }
 
 // Prompts the user to convert the image to indexed mode
-// with the proper palette.
+// with the proper palette, showing what it will look like and roughly how
+// big the file will be. With can_dither the conversion can be dithered,
+// which is what *dither is set to.
 // Mostly taken from bmp-write.c
-static gboolean save_dialog(gint channels){
+static gboolean save_dialog(gint32 drawable_ID, const GeglRectangle *rect,
+        gboolean can_dither, gboolean *dither){
     GtkWidget   *dialog;
     GtkWidget   *vbox;
-    GtkWidget   *frame;
     GtkWidget   *label;
+    GtkWidget   *toggle = NULL;
+    GraPreview  *preview;
     gboolean    run;
 
     dialog = gimp_export_dialog_new ("GRA", PLUG_IN_BINARY, SAVE_PROC);
@@ -276,12 +874,78 @@ static gboolean save_dialog(gint channels){
 
     gtk_widget_show(label);
 
+    preview = gra_preview_new (drawable_ID, rect, FALSE, vbox);
+
+    if (can_dither){
+        toggle = gtk_check_button_new_with_mnemonic ("_Dither (Floyd-Steinberg)");
+        gtk_box_pack_start (GTK_BOX (vbox), toggle, FALSE, FALSE, 0);
+        g_signal_connect (toggle, "toggled", G_CALLBACK (dither_toggled), preview);
+        gtk_widget_show (toggle);
+    }
+
     gtk_widget_show(dialog);
 
     run = (gimp_dialog_run (GIMP_DIALOG (dialog)) == GTK_RESPONSE_OK);
 
+    if (can_dither)
+        *dither = gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (toggle));
+    gra_preview_free (preview);
     gtk_widget_destroy(dialog);
 
     return run;
 }
 
+// Asks whether to export only the bounding box of the selection, and
+// records the answer in vals
+gboolean
+region_dialog (gint32 drawable_ID, GraSaveVals *vals)
+{
+    GtkWidget   *dialog;
+    GtkWidget   *vbox;
+    GtkWidget   *toggle;
+    GeglRectangle rect;
+    gchar       *text;
+    gboolean    run;
+
+    if (!gimp_drawable_mask_intersect (drawable_ID, &rect.x, &rect.y,
+                &rect.width, &rect.height)){
+        vals->region = GRA_REGION_IMAGE;
+        return TRUE;
+    }
+
+    dialog = gimp_export_dialog_new ("GRA", PLUG_IN_BINARY, SAVE_PROC);
+    gtk_window_set_resizable (GTK_WINDOW (dialog), FALSE);
+
+    vbox = gtk_box_new (GTK_ORIENTATION_VERTICAL, 12);
+    gtk_container_set_border_width (GTK_CONTAINER (vbox), 12);
+    gtk_box_pack_start (GTK_BOX (gimp_export_dialog_get_content_area (dialog)),
+            vbox, TRUE, TRUE, 0);
+    gtk_widget_show (vbox);
+
+    text = g_strdup_printf ("Export only the _selection (%d x %d at %d, %d)",
+            rect.width, rect.height, rect.x, rect.y);
+    toggle = gtk_check_button_new_with_mnemonic (text);
+    g_free (text);
+    gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (toggle),
+            vals->region == GRA_REGION_SELECTION);
+    gtk_box_pack_start (GTK_BOX (vbox), toggle, FALSE, FALSE, 0);
+    gtk_widget_show (toggle);
+
+    gtk_widget_show (dialog);
+
+    run = (gimp_dialog_run (GIMP_DIALOG (dialog)) == GTK_RESPONSE_OK);
+    if (run)
+        vals->region = gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (toggle)) ?
+            GRA_REGION_SELECTION : GRA_REGION_IMAGE;
+
+    gtk_widget_destroy (dialog);
+
+    return run;
+}
+
+static void
+dither_toggled (GtkWidget *button, GraPreview *preview)
+{
+    gra_preview_set_dither (preview,
+            gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (button)));
+}
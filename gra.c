@@ -34,6 +34,8 @@
 #include <libgimp/gimpui.h>
 
 #include "gra.h"
+#include "gra-format.h"
+#include "gra-trace.h"
 
 const gchar *filename    = NULL;
 gboolean     interactive = FALSE;
@@ -73,6 +75,20 @@ query (void)
         { GIMP_PDB_IMAGE, "image", "Output image" },
     };
 
+    static const GimpParamDef load_batch_args[] =
+    {
+        { GIMP_PDB_INT32,       "run-mode",  "The run mode { RUN-INTERACTIVE (0), RUN-NONINTERACTIVE (1) }" },
+        { GIMP_PDB_INT32,       "num-files", "The number of files to load" },
+        { GIMP_PDB_STRINGARRAY, "filenames", "The names of the files to load" },
+    };
+    static const GimpParamDef load_batch_return_vals[] =
+    {
+        { GIMP_PDB_INT32,       "num-images", "The number of images" },
+        { GIMP_PDB_INT32ARRAY,  "images",     "Output images, -1 for each file that couldn't be loaded" },
+        { GIMP_PDB_INT32,       "num-errors", "The number of error messages" },
+        { GIMP_PDB_STRINGARRAY, "errors",     "Why each file couldn't be loaded, or \"\" if it was" },
+    };
+
     static const GimpParamDef save_args[] =
     {
         { GIMP_PDB_INT32,    "run-mode",     "The run mode { RUN-INTERACTIVE (0), RUN-NONINTERACTIVE (1) }" },
@@ -80,6 +96,11 @@ query (void)
         { GIMP_PDB_DRAWABLE, "drawable",     "Drawable to save" },
         { GIMP_PDB_STRING,   "filename",     "The name of the file to save the image in" },
         { GIMP_PDB_STRING,   "raw-filename", "The name entered" },
+        { GIMP_PDB_INT32,    "region",       "Part of the drawable to save { WHOLE (0), SELECTION-BOUNDS (1), RECTANGLE (2) }" },
+        { GIMP_PDB_INT32,    "x",            "Left edge of the rectangle, for RECTANGLE" },
+        { GIMP_PDB_INT32,    "y",            "Top edge of the rectangle, for RECTANGLE" },
+        { GIMP_PDB_INT32,    "width",        "Width of the rectangle, for RECTANGLE" },
+        { GIMP_PDB_INT32,    "height",       "Height of the rectangle, for RECTANGLE" },
     };
 
     gimp_install_procedure (LOAD_PROC,
@@ -99,11 +120,29 @@ query (void)
     gimp_register_magic_load_handler (LOAD_PROC,
             "gra",
             "",
-            "0,string,BM");
+            GRA_MAGIC);
+
+    gimp_install_procedure (LOAD_BATCH_PROC,
+            "Loads many files of TempleOS GRA file format",
+            "Loads each of the files as a new image, decoding several at "
+            "once. A file that can't be loaded doesn't stop the others; its "
+            "image is -1 and its error says why.",
+            "Michael Barlow",
+            "Michael Barlow",
+            "2015",
+            NULL,
+            NULL,
+            GIMP_PLUGIN,
+            G_N_ELEMENTS (load_batch_args),
+            G_N_ELEMENTS (load_batch_return_vals),
+            load_batch_args, load_batch_return_vals);
 
     gimp_install_procedure (SAVE_PROC,
             "Saves files in TempleOS GRA file format",
-            "Saves files in TempleOS GRA file format",
+            "Saves files in TempleOS GRA file format. The region arguments "
+            "can be left out to save the whole drawable; otherwise only "
+            "the selection's bounding box or the rectangle given is saved, "
+            "clipped to the drawable.",
             "Michael Barlow",
             "Michael Barlow",
             "2015",
@@ -124,16 +163,26 @@ run (const gchar      *name,
         gint             *nreturn_vals,
         GimpParam       **return_vals)
 {
-    static GimpParam   values[2];
+    static GimpParam   values[5];
     GimpRunMode        run_mode;
     GimpPDBStatusType  status = GIMP_PDB_SUCCESS;
     gint32             image_ID;
     gint32             drawable_ID;
     GimpExportReturn   export = GIMP_EXPORT_CANCEL;
+    GraSaveVals        savevals = { GRA_REGION_IMAGE, 0, 0, 0, 0 };
     GError            *error  = NULL;
 
     run_mode = param[0].data.d_int32;
 
+    gegl_init (NULL, NULL);
+    gra_trace_init ();
+
+    // Under a memory ceiling, GEGL's cache of the layer's tiles gets a
+    // share of it too; tiles beyond that go back to GIMP
+    if (gra_memory_ceiling ())
+        g_object_set (gegl_config (), "tile-cache-size",
+                (guint64) gra_memory_ceiling () / 4, NULL);
+
     *nreturn_vals = 1;
     *return_vals  = values;
     values[0].type          = GIMP_PDB_STATUS;
@@ -173,6 +222,36 @@ run (const gchar      *name,
             }
         }
     }
+    else if (strcmp (name, LOAD_BATCH_PROC) == 0)
+    {
+        gint     n_files;
+        gint32  *images;
+        gchar  **errors;
+
+        /*  Make sure all the arguments are there!  */
+        if (nparams != 3 || param[1].data.d_int32 < 0)
+            status = GIMP_PDB_CALLING_ERROR;
+
+        if (status == GIMP_PDB_SUCCESS)
+        {
+            n_files = param[1].data.d_int32;
+            images = g_new (gint32, n_files);
+            errors = g_new (gchar *, n_files);
+
+            ReadGRABatch ((const gchar **) param[2].data.d_stringarray,
+                    n_files, images, errors);
+
+            *nreturn_vals = 5;
+            values[1].type              = GIMP_PDB_INT32;
+            values[1].data.d_int32      = n_files;
+            values[2].type              = GIMP_PDB_INT32ARRAY;
+            values[2].data.d_int32array = images;
+            values[3].type              = GIMP_PDB_INT32;
+            values[3].data.d_int32      = n_files;
+            values[4].type              = GIMP_PDB_STRINGARRAY;
+            values[4].data.d_stringarray = errors;
+        }
+    }
     else if (strcmp (name, SAVE_PROC) == 0)
     {
         image_ID    = param[1].data.d_int32;
@@ -183,11 +262,14 @@ run (const gchar      *name,
         {
             case GIMP_RUN_INTERACTIVE:
                 interactive = TRUE;
+                gimp_get_data (SAVE_PROC, &savevals);
                 /* fallthrough */
 
             case GIMP_RUN_WITH_LAST_VALS:
-                if (run_mode == GIMP_RUN_WITH_LAST_VALS)
+                if (run_mode == GIMP_RUN_WITH_LAST_VALS){
                     lastvals = TRUE;
+                    gimp_get_data (SAVE_PROC, &savevals);
+                }
 
                 gimp_ui_init (PLUG_IN_BINARY, FALSE);
 
@@ -197,16 +279,38 @@ run (const gchar      *name,
                         GIMP_EXPORT_CAN_HANDLE_ALPHA |
                         GIMP_EXPORT_CAN_HANDLE_INDEXED);
 
+                // With something selected, ask whether to save just that
+                if (export != GIMP_EXPORT_CANCEL && interactive)
+                {
+                    if (gimp_selection_is_empty (image_ID))
+                        savevals.region = GRA_REGION_IMAGE;
+                    else if (!region_dialog (drawable_ID, &savevals))
+                    {
+                        if (export == GIMP_EXPORT_EXPORT)
+                            gimp_image_delete (image_ID);
+                        export = GIMP_EXPORT_CANCEL;
+                    }
+                }
+
                 if (export == GIMP_EXPORT_CANCEL)
                 {
                     values[0].data.d_status = GIMP_PDB_CANCEL;
+                    gra_trace_finish ();
                     return;
                 }
                 break;
 
             case GIMP_RUN_NONINTERACTIVE:
                 /*  Make sure all the arguments are there!  */
-                if (nparams != 5)
+                if (nparams == 10)
+                {
+                    savevals.region = param[5].data.d_int32;
+                    savevals.x      = param[6].data.d_int32;
+                    savevals.y      = param[7].data.d_int32;
+                    savevals.width  = param[8].data.d_int32;
+                    savevals.height = param[9].data.d_int32;
+                }
+                else if (nparams != 5)
                     status = GIMP_PDB_CALLING_ERROR;
                 break;
 
@@ -216,7 +320,10 @@ run (const gchar      *name,
 
         if (status == GIMP_PDB_SUCCESS)
             status = WriteGRA (param[3].data.d_string, image_ID, drawable_ID,
-                    &error);
+                    &savevals, &error);
+
+        if (status == GIMP_PDB_SUCCESS)
+            gimp_set_data (SAVE_PROC, &savevals, sizeof (savevals));
 
         if (export == GIMP_EXPORT_EXPORT)
             gimp_image_delete (image_ID);
@@ -234,73 +341,28 @@ run (const gchar      *name,
     }
 
     values[0].data.d_status = status;
+    gra_trace_finish ();
+}
+
+// With GRA_MAX_MEMORY set to a number of megabytes, loads and saves go
+// through the image a strip of rows at a time and keep everything they
+// allocate within that much memory, whatever the size of the image.
+// Returns the ceiling in bytes, or 0 if there is none.
+gsize
+gra_memory_ceiling (void)
+{
+    const gchar *value = g_getenv ("GRA_MAX_MEMORY");
+    guint64      megabytes;
+
+    if (!value)
+        return 0;
+    megabytes = g_ascii_strtoull (value, NULL, 10);
+    if (!megabytes)
+        return 0;
+    return MAX (MIN (megabytes, G_MAXSIZE >> 20) << 20, GRA_MIN_MEMORY);
 }
 
 void get_color_map(guchar * color_map){
-    int             col_index = 0;
-
-    color_map[col_index++] =  0x00;
-    color_map[col_index++] =  0x00;
-    color_map[col_index++] =  0x00;
-    // BLUE
-    color_map[col_index++] =  0x00;
-    color_map[col_index++] =  0x00;
-    color_map[col_index++] =  0xAA;
-    // GREEN
-    color_map[col_index++] =  0x00;
-    color_map[col_index++] =  0xAA;
-    color_map[col_index++] =  0x00;
-    // CYAN
-    color_map[col_index++] =  0x00;
-    color_map[col_index++] = 0xAA;
-    color_map[col_index++] = 0xAA;
-    // RED
-    color_map[col_index++] = 0xAA;
-    color_map[col_index++] = 0x00;
-    color_map[col_index++] = 0x00;
-    // PURPLE
-    color_map[col_index++] = 0xAA;
-    color_map[col_index++] = 0x00;
-    color_map[col_index++] = 0xAA;
-    // BROWN
-    color_map[col_index++] = 0xAA;
-    color_map[col_index++] = 0x55;
-    color_map[col_index++] = 0x00;
-    // LTGRAY
-    color_map[col_index++] = 0xAA;
-    color_map[col_index++] = 0xAA;
-    color_map[col_index++] = 0xAA;
-    // DKGRAY
-    color_map[col_index++] = 0x55;
-    color_map[col_index++] = 0x55;
-    color_map[col_index++] = 0x55;
-    // LTBLUE
-    color_map[col_index++] = 0x55;
-    color_map[col_index++] = 0x55;
-    color_map[col_index++] = 0xFF;
-    // LTGREEN
-    color_map[col_index++] = 0x55;
-    color_map[col_index++] = 0xFF;
-    color_map[col_index++] = 0x55;
-    // LTCYAN
-    color_map[col_index++] = 0x55;
-    color_map[col_index++] = 0xFF;
-    color_map[col_index++] = 0xFF;
-    // LTRED
-    color_map[col_index++] = 0xFF;
-    color_map[col_index++] = 0x55;
-    color_map[col_index++] = 0x55;
-    // LTPURPLE
-    color_map[col_index++] = 0xFF;
-    color_map[col_index++] = 0x55;
-    color_map[col_index++] = 0xFF;
-    // YELLOW
-    color_map[col_index++] = 0xFF;
-    color_map[col_index++] = 0xFF;
-    color_map[col_index++] = 0x55;
-    // WHITE
-    color_map[col_index++] = 0xFF;
-    color_map[col_index++] = 0xFF;
-    color_map[col_index++] = 0xFF;
+    memcpy (color_map, gra_templeos_colors, sizeof (gra_templeos_colors));
 }
 
@@ -20,6 +20,7 @@
 #define __GRA_H__
 
 #define LOAD_PROC      "file-gra-load"
+#define LOAD_BATCH_PROC "file-gra-load-batch"
 #define SAVE_PROC      "file-gra-save"
 #define PLUG_IN_BINARY "file-gra"
 #define PLUG_IN_ROLE   "gimp-file-gra"
@@ -34,17 +35,39 @@
 
 #define PALETTE_NAME    "TempleOS GRA Colors"
 
+#define GRA_MIN_MEMORY  (8 << 20)   // lowest ceiling GRA_MAX_MEMORY can set
+#define GRA_MIN_CHUNK   (64 * 1024) // smallest piece of stream handled at a time under a ceiling
+
+// Which part of the drawable an export saves
+#define GRA_REGION_IMAGE        0   // all of it
+#define GRA_REGION_SELECTION    1   // the bounding box of the selection
+#define GRA_REGION_RECT         2   // x, y, width, height
+
+typedef struct
+{
+    gint    region;
+    gint    x, y, width, height;
+} GraSaveVals;
+
 
 gint32             ReadGRA   (const gchar  *filename,
         GError      **error);
+void               ReadGRABatch (const gchar **filenames,
+        gint          n_files,
+        gint32       *images,
+        gchar       **errors);
 GimpPDBStatusType  WriteGRA  (const gchar  *filename,
         gint32        image,
         gint32        drawable_ID,
+        const GraSaveVals *vals,
         GError      **error);
+gboolean           region_dialog (gint32       drawable_ID,
+        GraSaveVals  *vals);
 
 extern       gboolean  interactive;
 extern       gboolean  lastvals;
 extern const gchar    *filename;
 void get_color_map(guchar * color_map);
+gsize gra_memory_ceiling (void);
 
 #endif /* __GRA_H__ */
@@ -0,0 +1,68 @@
+/*
+ * compression-ref.c   Builds the frozen reference codec under ref_ names.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+
+#include "compression-ref.h"
+
+// The reference reads and writes its bit fields a DWORD at a time, up to
+// three bytes past the end of its buffers, so every buffer it allocates
+// gets that much room after it. They are all zeroed, as the byte after the
+// body of a stored stream is left as malloc gave it, and the codec writes 0.
+#define REF_SLACK   sizeof(unsigned int)
+
+static void *ref_malloc (size_t size);
+static void *ref_calloc (size_t n, size_t size);
+
+static void *
+ref_malloc (size_t size)
+{
+    return calloc (size + REF_SLACK, 1);
+}
+
+static void *
+ref_calloc (size_t n, size_t size)
+{
+    return calloc (n * size + REF_SLACK, 1);
+}
+
+#define malloc                      ref_malloc
+#define calloc                      ref_calloc
+
+// Every external symbol of reference/compression.c
+#define Bt                          ref_Bt
+#define Bts                         ref_Bts
+#define BFieldExtU32                ref_BFieldExtU32
+#define BFieldOrU32                 ref_BFieldOrU32
+#define ArcEntryGet                 ref_ArcEntryGet
+#define ArcExpandBuf                ref_ArcExpandBuf
+#define ArcCompressBuf              ref_ArcCompressBuf
+#define ArcFinishCompression        ref_ArcFinishCompression
+#define ArcCtrlNew                  ref_ArcCtrlNew
+#define ArcCtrlDel                  ref_ArcCtrlDel
+#define ArcDetermineCompressionType ref_ArcDetermineCompressionType
+#define ExpandBuf                   ref_ExpandBuf
+#define FSize                       ref_FSize
+#define compress                    ref_compress
+#define decompress                  ref_decompress
+
+#include "compression.c"
@@ -0,0 +1,37 @@
+/*
+ * compression-ref.h   The frozen reference codec, for gra-oracle.
+ *
+ * reference/compression.c and compression.h are the codec as it was first
+ * imported, before any of it was reworked, when it was the only description
+ * of the format TempleOS reads and writes. They are not to be changed or optimised: their output is what
+ * every later version of compression.c is checked against. Their symbols
+ * get a ref_ prefix (see compression-ref.c) so both can be linked into one
+ * program.
+ *
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COMPRESSION_REF_H__
+#define __COMPRESSION_REF_H__
+
+// compress() and decompress() of the reference: the whole of ArcCompressBuf
+// and ArcExpandBuf is reached through them
+long ref_compress   (unsigned char **compressed, unsigned char *src, long size);
+long ref_decompress (unsigned char *compressed, long compressed_size,
+                     unsigned char **decompressed);
+
+#endif /* __COMPRESSION_REF_H__ */